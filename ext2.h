@@ -87,7 +87,7 @@ struct ext2_super_block
      */
     unsigned char  s_prealloc_blocks;     /* Nr of blocks to try to preallocate*/
     unsigned char  s_prealloc_dir_blocks; /* Nr to preallocate for dirs */
-    unsigned short s_padding1;
+    unsigned short s_reserved_gdt_blocks; /* Per group desc for online growth */
     /*
      * Journaling support valid if EXT3_FEATURE_COMPAT_HAS_JOURNAL set.
      */
@@ -101,9 +101,28 @@ struct ext2_super_block
     unsigned short s_reserved_word_pad;
     unsigned int   s_default_mount_opts;
     unsigned int   s_first_meta_bg; /* First metablock block group */
-    unsigned int   s_reserved[190]; /* Padding to the end of the block */
+    unsigned int   s_mkfs_time;     /* When the filesystem was created */
+    unsigned int   s_jnl_blocks[17]; /* Backup of the journal inode */
+    unsigned int   s_reserved_hi[3]; /* 64-bit block counts, unused in ext2 */
+    unsigned short s_min_extra_isize; /* All inodes have at least # bytes */
+    unsigned short s_want_extra_isize; /* New inodes should reserve # bytes */
+    unsigned int   s_flags;         /* Miscellaneous flags */
+    unsigned int   s_reserved[167]; /* Padding to the end of the block */
 };
 
+/*
+ * Compatible feature and miscellaneous superblock flags
+ */
+#define EXT3_FEATURE_COMPAT_HAS_JOURNAL 0x0004 /* Journal in s_journal_inum */
+#define EXT2_FEATURE_COMPAT_DIR_INDEX 0x0020 /* Directories may be indexed */
+#define EXT2_FLAGS_SIGNED_HASH        0x0001 /* Signed dirhash in use */
+#define EXT2_FLAGS_UNSIGNED_HASH      0x0002 /* Unsigned dirhash in use */
+
+/*
+ * Incompatible feature flags
+ */
+#define EXT3_FEATURE_INCOMPAT_RECOVER 0x0004 /* Journal needs replaying */
+
 
 /*
  * Structure of a blocks group descriptor
@@ -157,6 +176,12 @@ struct ext2_inode
 };
 
 
+/*
+ * Inode flags
+ */
+#define EXT2_INDEX_FL 0x00001000 /* Hash-indexed directory */
+
+
 /*
  * Type field for file mode
  */
@@ -215,4 +240,107 @@ struct ext2_dir_entry
 
 #define    EXT2_FT_MAX      8
 
+
+/*
+ * Structures of an indexed (htree) directory. The first block of the
+ * directory holds the . and .. entries, with the record of .. spanning the
+ * rest of the block, which is taken up by a dx_root_info followed by an
+ * array of dx_entry. Interior index blocks hold a single empty entry that
+ * spans the whole block, followed by another dx_entry array. The hash field
+ * of the first dx_entry in an array holds a dx_countlimit instead. Block
+ * numbers in the index are logical blocks of the directory, and the leaf
+ * blocks they point to are ordinary directory blocks.
+ */
+#define EXT2_HASH_LEGACY            0
+#define EXT2_HASH_HALF_MD4          1
+#define EXT2_HASH_TEA               2
+#define EXT2_HASH_LEGACY_UNSIGNED   3 /* Reserved for userspace lib */
+#define EXT2_HASH_HALF_MD4_UNSIGNED 4 /* Reserved for userspace lib */
+#define EXT2_HASH_TEA_UNSIGNED      5 /* Reserved for userspace lib */
+
+struct dx_root_info 
+{
+    unsigned int  reserved_zero;
+    unsigned char hash_version;    /* Hash used to order the index */
+    unsigned char info_length;     /* 8 */
+    unsigned char indirect_levels; /* Interior index levels below the root */
+    unsigned char unused_flags;
+};
+
+struct dx_entry 
+{
+    unsigned int hash;  /* Lowest hash in the block, low bit set if continued */
+    unsigned int block; /* Logical block number in the directory */
+};
+
+struct dx_countlimit 
+{
+    unsigned short limit; /* Maximum number of dx_entry in the array */
+    unsigned short count; /* Number of dx_entry in use */
+};
+
+
+/*
+ * Structures of a journal (JBD2). The journal is a circular log taking up
+ * the blocks of the inode s_journal_inum, the first of which holds the
+ * journal superblock. Each transaction is one or more descriptor blocks,
+ * each followed by the blocks its tags describe, and then a commit block.
+ * A tag without JBD2_FLAG_SAME_UUID is followed by a 16-byte UUID. Unlike
+ * everything else in the image, all fields are big-endian.
+ */
+#define JBD2_MAGIC_NUMBER     0xC03B3998
+#define JBD2_DESCRIPTOR_BLOCK 1
+#define JBD2_COMMIT_BLOCK     2
+#define JBD2_SUPERBLOCK_V1    3
+#define JBD2_SUPERBLOCK_V2    4
+#define JBD2_REVOKE_BLOCK     5
+
+#define JBD2_FLAG_ESCAPE    1 /* Block began with the magic number, now 0 */
+#define JBD2_FLAG_SAME_UUID 2 /* No UUID follows the tag */
+#define JBD2_FLAG_DELETED   4 /* Block deleted by this transaction */
+#define JBD2_FLAG_LAST_TAG  8 /* Last tag in the descriptor block */
+
+#define JBD2_FEATURE_INCOMPAT_REVOKE 0x0001 /* Revoke blocks may be present */
+
+struct journal_header 
+{
+    unsigned int h_magic;
+    unsigned int h_blocktype;
+    unsigned int h_sequence; /* Transaction the block belongs to */
+};
+
+struct journal_block_tag 
+{
+    unsigned int   t_blocknr; /* Where the block belongs in the image */
+    unsigned short t_checksum;
+    unsigned short t_flags;
+};
+
+struct journal_commit_header 
+{
+    struct journal_header h_header;
+    unsigned char h_chksum_type;
+    unsigned char h_chksum_size;
+    unsigned char h_padding[2];
+    unsigned int  h_chksum[8];
+    unsigned int  h_commit_sec_hi; /* High and low words of the commit time */
+    unsigned int  h_commit_sec;
+    unsigned int  h_commit_nsec;
+};
+
+struct journal_superblock 
+{
+    struct journal_header s_header;
+    unsigned int  s_blocksize;         /* Journal device blocksize */
+    unsigned int  s_maxlen;            /* Total blocks in journal file */
+    unsigned int  s_first;             /* First block of log information */
+    unsigned int  s_sequence;          /* First commit ID expected in log */
+    unsigned int  s_start;             /* Block of start of log, 0 if empty */
+    unsigned int  s_errno;
+    unsigned int  s_feature_compat;    /* Only in V2 superblocks */
+    unsigned int  s_feature_incompat;
+    unsigned int  s_feature_ro_compat;
+    unsigned char s_uuid[16];
+};
+
 #endif
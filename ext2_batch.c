@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "ext2_utils.h"
+
+#define MAX_COMMAND_WORDS 4
+#define COMMANDS_PER_COMMIT 64
+
+/*
+ * Split the given line into its whitespace-separated words in place, storing
+ * up to max_words of them in words. A '#' starts a comment running to the 
+ * end of the line. Return the number of words, or max_words + 1 if there are
+ * too many.
+ */
+int split_words (char *line, char **words, int max_words) 
+{
+    int num_words = 0;
+    char *word;
+
+    line[strcspn(line, "#")] = '\0';
+
+    for (word = strtok(line, " \t\r\n"); word; word = strtok(NULL, " \t\r\n")) {
+        if (num_words == max_words)
+            return max_words + 1;
+        words[num_words++] = word;
+    }
+
+    return num_words;
+}
+
+/*
+ * Run the command made up of the given words, taking the same arguments as
+ * the tool of the same name, minus the image. Return the command's status,
+ * which is the tool's exit status, or EINVAL if the command is malformed.
+ */
+int run_command (struct ext2_fs *fs, int num_words, char **words) 
+{
+    char *cmd = words[0];
+    int has_flag = (num_words > 1) && (!strcmp(words[1], "-s") || !strcmp(words[1], "-r"));
+
+    if (!strcmp(cmd, "mkdir") && num_words == 2)
+        return cmd_mkdir(fs, words[1]);
+
+    if (!strcmp(cmd, "cp") && num_words == 3)
+        return cmd_cp(fs, words[1], words[2]);
+
+    if (!strcmp(cmd, "ln") && num_words == 3 + has_flag && 
+            (!has_flag || !strcmp(words[1], "-s")))
+        return cmd_ln(fs, words[1 + has_flag], words[2 + has_flag], has_flag);
+
+    if (!strcmp(cmd, "rm") && num_words == 2 + has_flag && 
+            (!has_flag || !strcmp(words[1], "-r")))
+        return cmd_rm(fs, words[1 + has_flag], has_flag);
+
+    if (!strcmp(cmd, "restore") && num_words == 2 + has_flag && 
+            (!has_flag || !strcmp(words[1], "-r")))
+        return cmd_restore(fs, words[1 + has_flag], has_flag);
+
+    if (!strcmp(cmd, "compact_dir") && (num_words == 2 || 
+            (num_words == 3 && !strcmp(words[2], "-r"))))
+        return cmd_compact_dir(fs, words[1], num_words == 3);
+
+    fprintf(stderr, "ERROR: Unknown or malformed command %s\n", cmd);
+    return EINVAL;
+}
+
+int main (int argc, char **argv) 
+{
+    if (argc != 3) {
+        fprintf(stderr, 
+            "Usage: %s <image file path> <command script, or - for standard input>\n", 
+            argv[0]);
+        exit(1);
+    }
+
+    FILE *script = (strcmp(argv[2], "-")) ? fopen(argv[2], "r") : stdin;
+    if (!script) {
+        perror(argv[2]);
+        return ENOENT;
+    }
+
+    struct ext2_fs *fs = open_disk(argv[1]);
+    if (!fs)
+        exit(1);
+
+    char *line = NULL;
+    size_t line_size = 0;
+    unsigned long line_num = 0;
+
+    char *words[MAX_COMMAND_WORDS + 1];
+    int num_words;
+    int cmd_ret_val;
+    int ret_val = 0;
+    int num_uncommitted = 0;
+
+    /* Every command runs against the same mapping of the image, so the 
+     * caches and allocation state built up by one carry over to the next.
+     * Each command's status is reported on standard output as it finishes,
+     * and the status of the first one to fail is the batch's own. If the
+     * image has a journal, the commands are committed in groups, so they
+     * share the cost of getting to the disk, and a group is cut short once
+     * its changes could overflow the journal. */
+    while (getline(&line, &line_size, script) >= 0) {
+        line_num++;
+
+        num_words = split_words(line, words, MAX_COMMAND_WORDS);
+        if (!num_words)
+            continue;
+
+        if (num_words > MAX_COMMAND_WORDS) {
+            fprintf(stderr, "ERROR: Too many arguments to %s\n", words[0]);
+            cmd_ret_val = EINVAL;
+        } else {
+            cmd_ret_val = run_command(fs, num_words, words);
+        }
+
+        printf("%lu %s %d\n", line_num, words[0], cmd_ret_val);
+        if (cmd_ret_val && !ret_val)
+            ret_val = cmd_ret_val;
+
+        if (++num_uncommitted == COMMANDS_PER_COMMIT || is_journal_filling(fs)) {
+            num_uncommitted = 0;
+            if (commit_journal(fs) < 0) {
+                ret_val = EIO;
+                break;
+            }
+        }
+    }
+
+    free(line);
+    if (script != stdin)
+        fclose(script);
+
+    if (close_disk(fs) < 0 && !ret_val)
+        ret_val = EIO;
+    return ret_val;
+}
@@ -0,0 +1,224 @@
+#include <stdint.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "ext2_bitmap.h"
+
+#define WORD_BITS 64
+#define WORD_BYTES (WORD_BITS / 8)
+#define ALL_ONES (~(uint64_t) 0)
+
+/*
+ * Return the 64-bit word holding bits [WORD_BITS * word, WORD_BITS * word + 63]
+ * of a bitmap of num_bits bits, with bit i of the word being bit i of the
+ * range. The bitmap is never read past its last byte, and any bits past the
+ * end of the bitmap are taken from fill.
+ */
+static uint64_t load_word (const unsigned char *bitmap, unsigned int word,
+        unsigned int num_bits, uint64_t fill)
+{
+    uint64_t value = 0;
+    uint64_t valid_mask;
+    unsigned int bits_left = num_bits - word * WORD_BITS;
+
+    if (bits_left >= WORD_BITS) {
+        memcpy(&value, bitmap + word * WORD_BYTES, WORD_BYTES);
+    } else {
+        memcpy(&value, bitmap + word * WORD_BYTES, (bits_left + 7) / 8);
+    }
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    /* Bitmaps are little-endian on disk */
+    value = __builtin_bswap64(value);
+#endif
+
+    if (bits_left < WORD_BITS) {
+        valid_mask = ((uint64_t) 1 << bits_left) - 1;
+        value = (value & valid_mask) | (fill & ~valid_mask);
+    }
+
+    return value;
+}
+
+#ifdef __SSE2__
+/*
+ * Return the first word at or after word, stepping a full 128-bit vector at
+ * a time, whose vector is not entirely equal to the byte pattern given by
+ * skip (0xFF to skip fully set regions, 0x00 to skip fully clear ones).
+ * Only whole vectors lying within the bitmap are skipped.
+ */
+static unsigned int skip_vectors (const unsigned char *bitmap, unsigned int word,
+        unsigned int num_bits, unsigned char skip)
+{
+    __m128i pattern = _mm_set1_epi8((char) skip);
+    __m128i chunk;
+
+    while ((word + 2) * WORD_BITS <= num_bits) {
+        chunk = _mm_loadu_si128((const __m128i *) (bitmap + word * WORD_BYTES));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, pattern)) != 0xFFFF)
+            break;
+        word += 2;
+    }
+
+    return word;
+}
+#endif
+
+/*
+ * Return the index of the first clear bit at or after start among the first
+ * num_bits bits of the bitmap, or num_bits if there is none.
+ */
+unsigned int bitmap_find_first_zero (const unsigned char *bitmap, unsigned int start,
+        unsigned int num_bits)
+{
+    unsigned int word = start / WORD_BITS;
+    uint64_t value;
+
+    if (start >= num_bits)
+        return num_bits;
+
+    /* Ignore the bits of the first word preceding start */
+    value = ~load_word(bitmap, word, num_bits, ALL_ONES) & (ALL_ONES << (start % WORD_BITS));
+
+    while (!value) {
+        word++;
+
+#ifdef __SSE2__
+        word = skip_vectors(bitmap, word, num_bits, 0xFF);
+#endif
+        if (word * WORD_BITS >= num_bits)
+            return num_bits;
+
+        value = ~load_word(bitmap, word, num_bits, ALL_ONES);
+    }
+
+    return word * WORD_BITS + __builtin_ctzll(value);
+}
+
+/*
+ * Return the index of the first set bit at or after start among the first
+ * num_bits bits of the bitmap, or num_bits if there is none.
+ */
+unsigned int bitmap_find_first_set (const unsigned char *bitmap, unsigned int start,
+        unsigned int num_bits)
+{
+    unsigned int word = start / WORD_BITS;
+    uint64_t value;
+
+    if (start >= num_bits)
+        return num_bits;
+
+    /* Ignore the bits of the first word preceding start */
+    value = load_word(bitmap, word, num_bits, 0) & (ALL_ONES << (start % WORD_BITS));
+
+    while (!value) {
+        word++;
+
+#ifdef __SSE2__
+        word = skip_vectors(bitmap, word, num_bits, 0x00);
+#endif
+        if (word * WORD_BITS >= num_bits)
+            return num_bits;
+
+        value = load_word(bitmap, word, num_bits, 0);
+    }
+
+    return word * WORD_BITS + __builtin_ctzll(value);
+}
+
+/*
+ * Return the index of the first run of at least run_len consecutive clear
+ * bits starting at or after start among the first num_bits bits of the
+ * bitmap, or num_bits if there is none.
+ */
+unsigned int bitmap_find_zero_run (const unsigned char *bitmap, unsigned int start,
+        unsigned int num_bits, unsigned int run_len)
+{
+    unsigned int run_start = start;
+    unsigned int run_end;
+
+    while ((run_start = bitmap_find_first_zero(bitmap, run_start, num_bits)) < num_bits) {
+        run_end = bitmap_find_first_set(bitmap, run_start, num_bits);
+        if (run_end - run_start >= run_len)
+            return run_start;
+
+        run_start = run_end;
+    }
+
+    return num_bits;
+}
+
+/*
+ * Return whether none of the first num_bits bits of the bitmap are set. This
+ * doubles as a fast test for a block of memory that is entirely zero.
+ */
+int bitmap_is_clear (const unsigned char *bitmap, unsigned int num_bits)
+{
+    return bitmap_find_first_set(bitmap, 0, num_bits) >= num_bits;
+}
+
+/*
+ * Return the number of set bits at or after start among the first num_bits
+ * bits of the bitmap.
+ */
+unsigned int bitmap_count_set (const unsigned char *bitmap, unsigned int start,
+        unsigned int num_bits)
+{
+    unsigned int word = start / WORD_BITS;
+    unsigned int count;
+
+    if (start >= num_bits)
+        return 0;
+
+    /* Ignore the bits of the first word preceding start */
+    count = __builtin_popcountll(load_word(bitmap, word, num_bits, 0) &
+        (ALL_ONES << (start % WORD_BITS)));
+
+    for (word++; word * WORD_BITS < num_bits; word++)
+        count += __builtin_popcountll(load_word(bitmap, word, num_bits, 0));
+
+    return count;
+}
+
+/*
+ * Set the len bits of the bitmap starting at start.
+ */
+void bitmap_set_range (unsigned char *bitmap, unsigned int start, unsigned int len)
+{
+    unsigned int end = start + len;
+
+    /* Set individual bits up to the first byte boundary, then whole bytes,
+     * then whatever is left over */
+    for (; start < end && start % 8; start++)
+        BITMAP_SET(bitmap, start);
+
+    if (end - start >= 8) {
+        memset(bitmap + start / 8, 0xFF, (end - start) / 8);
+        start += (end - start) & ~7U;
+    }
+
+    for (; start < end; start++)
+        BITMAP_SET(bitmap, start);
+}
+
+/*
+ * Clear the len bits of the bitmap starting at start.
+ */
+void bitmap_clear_range (unsigned char *bitmap, unsigned int start, unsigned int len)
+{
+    unsigned int end = start + len;
+
+    /* Clear individual bits up to the first byte boundary, then whole bytes,
+     * then whatever is left over */
+    for (; start < end && start % 8; start++)
+        BITMAP_CLEAR(bitmap, start);
+
+    if (end - start >= 8) {
+        memset(bitmap + start / 8, 0, (end - start) / 8);
+        start += (end - start) & ~7U;
+    }
+
+    for (; start < end; start++)
+        BITMAP_CLEAR(bitmap, start);
+}
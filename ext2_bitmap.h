@@ -0,0 +1,29 @@
+#ifndef CSC369_EXT2_BITMAP_H
+#define CSC369_EXT2_BITMAP_H
+
+/*
+ * Bitmap scanning kernels shared by the allocators and the checker. Bit i of
+ * a bitmap is bit (i % 8) of byte (i / 8), as in the on-disk ext2 block and
+ * inode bitmaps. Scans work a machine word (or SSE2 vector) at a time rather
+ * than bit by bit.
+ */
+
+/* Single bit operations */
+#define BITMAP_TEST(BITMAP, INDEX) (((BITMAP)[(INDEX) / 8] >> ((INDEX) % 8)) & 1)
+#define BITMAP_SET(BITMAP, INDEX) ((BITMAP)[(INDEX) / 8] |= (1 << ((INDEX) % 8)))
+#define BITMAP_CLEAR(BITMAP, INDEX) ((BITMAP)[(INDEX) / 8] &= ~(1 << ((INDEX) % 8)))
+
+/* Bitmap kernel declarations */
+unsigned int bitmap_find_first_zero (const unsigned char *bitmap, unsigned int start,
+        unsigned int num_bits);
+unsigned int bitmap_find_first_set (const unsigned char *bitmap, unsigned int start,
+        unsigned int num_bits);
+unsigned int bitmap_find_zero_run (const unsigned char *bitmap, unsigned int start,
+        unsigned int num_bits, unsigned int run_len);
+int bitmap_is_clear (const unsigned char *bitmap, unsigned int num_bits);
+unsigned int bitmap_count_set (const unsigned char *bitmap, unsigned int start,
+        unsigned int num_bits);
+void bitmap_set_range (unsigned char *bitmap, unsigned int start, unsigned int len);
+void bitmap_clear_range (unsigned char *bitmap, unsigned int start, unsigned int len);
+
+#endif
@@ -1,100 +1,306 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
 #include "ext2_utils.h"
 
-unsigned char *disk = NULL;
+#define MAX_CHECK_THREADS 64
+#define MAX_CHECK_PHASES 8
+#define BLOCK_OWNER_METADATA (~0U)
+#define NO_LOCATION (-1L)
 
+/* A live entry found in a directory by the scan of the inode table */
+struct dir_ref 
+{
+    unsigned int parent_inode;
+    struct ext2_dir_entry *entry;
+};
+
+/* The share of the work of one checking thread. The scan fills refs with 
+ * the entries of the directories among the inodes of groups [first, end),
+ * and the repair fixes the block bitmap for inodes[first, end), counting 
+ * the fixes in num_fixes. The link count sweep adds the references made by
+ * the directories of groups [first, end) to link_counts. */
+struct check_share 
+{
+    struct ext2_fs *fs;
+    unsigned int first;
+    unsigned int end;
+    struct dir_ref *refs;
+    unsigned long num_refs;
+    unsigned long capacity;
+    unsigned int *inodes;
+    unsigned short *link_counts;
+    int num_fixes;
+    int failed;
+};
+
+/* Who maps each block of the file system: owners holds the first inode 
+ * found mapping each block (BLOCK_OWNER_METADATA for the blocks holding the
+ * file system's own structures, 0 for none). dups marks the blocks mapped
+ * more than once and kept those that their first owner has already been 
+ * found still mapping, while has_dups marks the inodes mapping a block of 
+ * dups. inode is the inode whose block map is being walked. */
+struct block_owners 
+{
+    unsigned int *owners;
+    unsigned char *dups;
+    unsigned char *kept;
+    unsigned char *has_dups;
+    unsigned int inode;
+};
+
+/* A growing list of inode or block numbers, see add_to_list() */
+struct num_list 
+{
+    unsigned int *nums;
+    unsigned long len;
+    unsigned long capacity;
+};
+
+/* How long one phase of the check took */
+struct phase_time 
+{
+    const char *name;
+    double seconds;
+};
+
+/* Where repairs are reported, see report_fix(). Normally each is printed 
+ * as it is made. With is_json set, they are instead written as JSON 
+ * objects to items (a memory stream over items_buf), to be printed with 
+ * the time taken by each phase once the check is over. */
+struct check_report 
+{
+    int is_json;
+    FILE *items;
+    char *items_buf;
+    size_t items_len;
+    unsigned long num_items;
+    struct phase_time phases[MAX_CHECK_PHASES];
+    int num_phases;
+    struct timespec phase_start;
+    pthread_mutex_t lock;
+};
+
+static struct check_report report = { .lock = PTHREAD_MUTEX_INITIALIZER };
 
 /*
- * Repair any initial inconsistencies between the block and inode bitmaps
- * and their respective free block and inode counters in the superblock and
- * block group descriptor, trusting the bitmaps. Note that these bitmaps may
- * be corrupted, in which case they will be fixed and the counters will be 
- * re-updated in a later step. Return the number of fixes in this step.
+ * Write the given string to out as a JSON string literal.
  */
-int initial_counter_fix () 
+void print_json_string (FILE *out, const char *str) 
 {
-    struct ext2_super_block *sb = get_super_block();
-    struct ext2_group_desc *gd = get_group_desc();
-    unsigned char *block_bitmap = get_block_bitmap();
-    unsigned char *inode_bitmap = get_inode_bitmap();
+    fputc('"', out);
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\')
+            fprintf(out, "\\%c", *str);
+        else if ((unsigned char) *str < 0x20)
+            fprintf(out, "\\u%04x", *str);
+        else 
+            fputc(*str, out);
+    }
+    fputc('"', out);
+}
 
-    int bit, byte, num_bytes;
-    int diff; 
-    int free_blocks = 0;
-    int free_inodes = 0;
-    int num_fixes = 0;
+/*
+ * Report a repair of the given type that accounts for count fixes, made at
+ * the given inode, block and group (each NO_LOCATION if it does not apply).
+ * The problem is described by the printf-style fmt, and action says what
+ * was done about it. Normally, only the description is printed, after 
+ * "Fixed: ". Safe to call from several threads at once.
+ */
+void report_fix (const char *type, const char *action, long inode, long block, 
+        long group, int count, const char *fmt, ...) 
+{
+    char problem[256];
+    va_list args;
+    int len;
 
-    /* Get actual number of blocks marked as free in bitmap */
-    num_bytes = sb->s_blocks_count / NUM_BITS;
-    bit = 0; byte = 0;
+    va_start(args, fmt);
+    len = vsnprintf(problem, sizeof(problem), fmt, args);
+    va_end(args);
 
-    while (byte < num_bytes) {
-        while (bit < NUM_BITS) {
-            if (!IN_USE(block_bitmap, byte, bit))
-                free_blocks++;
-            bit++;
-        }
+    /* A single call keeps the lines of several threads from interleaving */
+    if (!report.is_json) {
+        printf("Fixed: %s", problem);
+        return;
+    }
+
+    if (len > 0 && len < (int) sizeof(problem) && problem[len - 1] == '\n')
+        problem[len - 1] = '\0';
 
-        bit = 0;
-        byte++;
+    pthread_mutex_lock(&report.lock);
+    fprintf(report.items, "%s\n    {\"type\": ", (report.num_items) ? "," : "");
+    print_json_string(report.items, type);
+    if (inode != NO_LOCATION)
+        fprintf(report.items, ", \"inode\": %ld", inode);
+    if (block != NO_LOCATION)
+        fprintf(report.items, ", \"block\": %ld", block);
+    if (group != NO_LOCATION)
+        fprintf(report.items, ", \"group\": %ld", group);
+    fprintf(report.items, ", \"count\": %d, \"problem\": ", count);
+    print_json_string(report.items, problem);
+    fprintf(report.items, ", \"fix\": ");
+    print_json_string(report.items, action);
+    fputc('}', report.items);
+    report.num_items++;
+    pthread_mutex_unlock(&report.lock);
+}
+
+/*
+ * Start timing the phase of the check with the given name, ending the one
+ * before it, if any.
+ */
+void begin_phase (const char *name) 
+{
+    struct timespec now;
+    struct phase_time *phase;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (report.num_phases) {
+        phase = &report.phases[report.num_phases - 1];
+        phase->seconds = (now.tv_sec - report.phase_start.tv_sec) + 
+            (now.tv_nsec - report.phase_start.tv_nsec) / 1e9;
     }
+
+    if (name && report.num_phases < MAX_CHECK_PHASES) {
+        report.phases[report.num_phases].name = name;
+        report.phases[report.num_phases].seconds = 0;
+        report.num_phases++;
+    }
+    report.phase_start = now;
+}
+
+/*
+ * Print the JSON report of a check of the image at diskpath in the given 
+ * mode, which made total_fixes repairs, once its last phase has ended. 
+ */
+void print_json_report (const char *diskpath, const char *mode, int is_dry_run, 
+        int total_fixes) 
+{
+    int k;
+
+    fclose(report.items);
+    printf("{\n  \"image\": ");
+    print_json_string(stdout, diskpath);
+    printf(",\n  \"mode\": ");
+    print_json_string(stdout, mode);
+    printf(",\n  \"dry_run\": %s,\n  \"phases\": [", (is_dry_run) ? "true" : "false");
+    for (k = 0; k < report.num_phases; k++) {
+        printf("%s\n    {\"name\": ", (k) ? "," : "");
+        print_json_string(stdout, report.phases[k].name);
+        printf(", \"seconds\": %.6f}", report.phases[k].seconds);
+    }
+    printf("\n  ],\n  \"inconsistencies\": [%s\n  ],\n  \"total_fixes\": %d\n}\n",
+        report.items_buf, total_fixes);
+    free(report.items_buf);
+}
+
+/*
+ * Repair the free block and inode counters of the given group's descriptor,
+ * if necessary, trusting its bitmaps, and add the numbers of blocks and 
+ * inodes its bitmaps have free to free_blocks and free_inodes. Return the 
+ * number of fixes.
+ */
+int fix_group_counters (struct ext2_fs *fs, unsigned int group, 
+        unsigned int *free_blocks, unsigned int *free_inodes) 
+{
+    struct ext2_super_block *sb = get_super_block(fs);
+    struct ext2_group_desc *gd = get_group_desc(fs, group);
+    unsigned int group_free_blocks, group_free_inodes;
+    int diff; 
+    int num_fixes = 0;
+
+    /* Get actual number of blocks and inodes marked as free in this 
+     * group's bitmaps */
+    group_free_blocks = get_blocks_in_group(fs, group) - 
+        bitmap_count_set(get_block_bitmap(fs, group), 0, get_blocks_in_group(fs, group));
+    group_free_inodes = sb->s_inodes_per_group - 
+        bitmap_count_set(get_inode_bitmap(fs, group), 0, sb->s_inodes_per_group);
     
-    /* Repair free block counters, if necessary */
-    if (free_blocks != sb->s_free_blocks_count) {
-        diff = abs(free_blocks - sb->s_free_blocks_count);
-        sb->s_free_blocks_count = free_blocks;
+    /* Repair this group's free block and inode counters, if necessary */
+    if (group_free_blocks != gd->bg_free_blocks_count) {
+        diff = abs((int) group_free_blocks - gd->bg_free_blocks_count);
+        gd->bg_free_blocks_count = group_free_blocks;
 
-        printf("Fixed: superblock's free blocks counter was off by %d compared to the bitmap\n",
-            diff);
+        report_fix("group_free_blocks", "set the counter from the bitmap", NO_LOCATION, 
+            NO_LOCATION, group, diff, 
+            "block group %u's free blocks counter was off by %d compared to the bitmap\n",
+            group, diff);
         num_fixes += diff;
     }
 
-    if (free_blocks != gd->bg_free_blocks_count) {
-        diff = abs(free_blocks - gd->bg_free_blocks_count);
-        gd->bg_free_blocks_count = free_blocks;
+    if (group_free_inodes != gd->bg_free_inodes_count) {
+        diff = abs((int) group_free_inodes - gd->bg_free_inodes_count);
+        gd->bg_free_inodes_count = group_free_inodes;
 
-        printf("Fixed: block group's free blocks counter was off by %d compared to the bitmap\n",
-            diff);
+        report_fix("group_free_inodes", "set the counter from the bitmap", NO_LOCATION, 
+            NO_LOCATION, group, diff, 
+            "block group %u's free inodes counter was off by %d compared to the bitmap\n",
+            group, diff);
         num_fixes += diff;
     }
 
-    /* Get actual number of inodes marked as free in bitmap */
-    num_bytes = sb->s_inodes_count / NUM_BITS;
-    bit = 0; byte = 0;
+    *free_blocks += group_free_blocks;
+    *free_inodes += group_free_inodes;
+    return num_fixes;
+}
 
-    while (byte < num_bytes) {
-        while (bit < NUM_BITS) {
-            if (!IN_USE(inode_bitmap, byte, bit))
-                free_inodes++;
-            bit++;
-        }
+/*
+ * Repair the superblock's free block and inode counters, if they differ 
+ * from the given totals over all groups. Return the number of fixes.
+ */
+int fix_super_counters (struct ext2_fs *fs, unsigned int free_blocks, 
+        unsigned int free_inodes) 
+{
+    struct ext2_super_block *sb = get_super_block(fs);
+    int diff; 
+    int num_fixes = 0;
+
+    if (free_blocks != sb->s_free_blocks_count) {
+        diff = abs((int) (free_blocks - sb->s_free_blocks_count));
+        sb->s_free_blocks_count = free_blocks;
 
-        bit = 0;
-        byte++;
+        report_fix("super_free_blocks", "set the counter from the bitmaps", NO_LOCATION, 
+            NO_LOCATION, NO_LOCATION, diff, 
+            "superblock's free blocks counter was off by %d compared to the bitmap\n", diff);
+        num_fixes += diff;
     }
 
-    /* Repair free inode counters, if necessary */
     if (free_inodes != sb->s_free_inodes_count) {
-        diff = abs(free_inodes - sb->s_free_inodes_count);
+        diff = abs((int) (free_inodes - sb->s_free_inodes_count));
         sb->s_free_inodes_count = free_inodes;
 
-        printf("Fixed: superblock's free inodes counter was off by %d compared to the bitmap\n",
-            diff);
+        report_fix("super_free_inodes", "set the counter from the bitmaps", NO_LOCATION, 
+            NO_LOCATION, NO_LOCATION, diff, 
+            "superblock's free inodes counter was off by %d compared to the bitmap\n", diff);
         num_fixes += diff;
     }
 
-    if (free_inodes != gd->bg_free_inodes_count) {
-        diff = abs(free_inodes - gd->bg_free_inodes_count);
-        gd->bg_free_inodes_count = free_inodes;
+    return num_fixes;
+}
 
-        printf("Fixed: block group's free inodes counter was off by %d compared to the bitmap\n",
-            diff);
-        num_fixes += diff;
-    }
+/*
+ * Repair any initial inconsistencies between the block and inode bitmaps
+ * and their respective free block and inode counters in the superblock and
+ * each block group descriptor, trusting the bitmaps. Note that these bitmaps
+ * may be corrupted, in which case they will be fixed and the counters will be 
+ * re-updated in a later step. Return the number of fixes in this step.
+ */
+int initial_counter_fix (struct ext2_fs *fs) 
+{
+    unsigned int group;
+    unsigned int num_groups = get_num_groups(fs);
+    unsigned int free_blocks = 0;
+    unsigned int free_inodes = 0;
+    int num_fixes = 0;
 
-    return num_fixes;
+    for (group = 0; group < num_groups; group++)
+        num_fixes += fix_group_counters(fs, group, &free_blocks, &free_inodes);
+    
+    return num_fixes + fix_super_counters(fs, free_blocks, free_inodes);
 }
 
 /*
@@ -102,14 +308,15 @@ int initial_counter_fix ()
  * corresponding inode's mode, update the file type and return 1. Otherwise,
  * return 0.
  */
-int fix_file_type (struct ext2_dir_entry *entry) 
+int fix_file_type (struct ext2_fs *fs, struct ext2_dir_entry *entry) 
 {
-    struct ext2_inode *ino = get_inode(entry->inode);
+    struct ext2_inode *ino = get_inode(fs, entry->inode);
 
     if (TYPE_MASK(ino->i_mode) != get_imode(entry->file_type)) {
         entry->file_type = get_file_type(ino->i_mode);
-        printf("Fixed: Entry type vs inode mismatch: inode [%d]\n", 
-            entry->inode);
+        report_fix("file_type", "set the entry's file type from the inode's mode", 
+            entry->inode, GET_BLOCK_OF(fs, entry), NO_LOCATION, 1, 
+            "Entry type vs inode mismatch: inode [%d]\n", entry->inode);
         return 1;
     }
 
@@ -117,40 +324,42 @@ int fix_file_type (struct ext2_dir_entry *entry)
 }
 
 /*
- * If the given entry's inode is not marked as allocated in the inode bitmap,
- * set it, update the free inode counters and return 1. Otherwise, return 0.
+ * If the given inode is not marked as allocated in the inode bitmap, set 
+ * it, update the free inode counters and return 1. Otherwise, return 0.
  */
-int fix_inode_bitmap (struct ext2_dir_entry *entry) 
+int fix_inode_bitmap (struct ext2_fs *fs, unsigned int inode) 
 {
-    unsigned char *inode_bitmap = get_inode_bitmap();
-    int bit = GET_BIT(entry->inode);
-    int byte = GET_BYTE(entry->inode);
+    unsigned int group = get_inode_group(fs, inode);
+    unsigned char *inode_bitmap = get_inode_bitmap(fs, group);
+    unsigned int index = get_inode_index(fs, inode);
+    int is_fixed = 0;
 
-    if (!IN_USE(inode_bitmap, byte, bit)) {
-        MARK_AS_USED(inode_bitmap, byte, bit);
-        get_super_block()->s_free_inodes_count--;
-        get_group_desc()->bg_free_inodes_count--;
-
-        printf("Fixed: inode [%d] not marked as in-use\n",
-            entry->inode);
-        return 1;
+    lock_group(fs, group);
+    if (!BITMAP_TEST(inode_bitmap, index)) {
+        BITMAP_SET(inode_bitmap, index);
+        adjust_free_inodes(fs, group, -1);
+        is_fixed = 1;
     }
+    unlock_group(fs, group);
 
-    return 0;
+    if (is_fixed)
+        report_fix("inode_bitmap", "mark the inode as in use", inode, NO_LOCATION, group, 1, 
+            "inode [%d] not marked as in-use\n", inode);
+    return is_fixed;
 }
 
 /*
- * If the given entry's inode has its deletion time set to a value
- * greater than 0, reset it and return 1. Otherwise, return 0.
+ * If the given inode has its deletion time set to a value greater than 0,
+ * reset it and return 1. Otherwise, return 0.
  */
-int fix_deletion_time (struct ext2_dir_entry *entry) 
+int fix_deletion_time (struct ext2_fs *fs, unsigned int inode) 
 {
-    struct ext2_inode *ino = get_inode(entry->inode);
+    struct ext2_inode *ino = get_inode(fs, inode);
 
     if (ino->i_dtime) {
         ino->i_dtime = 0;
-        printf("Fixed: valid inode marked for deletion [%d]\n",
-            entry->inode);
+        report_fix("deletion_time", "clear the deletion time", inode, NO_LOCATION, 
+            NO_LOCATION, 1, "valid inode marked for deletion [%d]\n", inode);
         return 1;
     }
 
@@ -161,59 +370,52 @@ int fix_deletion_time (struct ext2_dir_entry *entry)
  * If the given block is not marked as allocated in the data block
  * bitmap, set it and return 1. Otherwise, return 0.
  */
-int fix_block (unsigned int block) 
+int fix_block (struct ext2_fs *fs, unsigned int block) 
 {
-    unsigned char *block_bitmap = get_block_bitmap();
-    int bit = GET_BIT(block);
-    int byte = GET_BYTE(block);
+    unsigned int group = get_block_group(fs, block);
+    unsigned char *block_bitmap = get_block_bitmap(fs, group);
+    unsigned int index = get_block_index(fs, block);
+    int is_fixed = 0;
 
-    if (!IN_USE(block_bitmap, byte, bit)) {
-        MARK_AS_USED(block_bitmap, byte, bit);
-        get_super_block()->s_free_blocks_count--;
-        get_group_desc()->bg_free_blocks_count--;
-        return 1;
+    /* Threads repairing different inodes may share a group */
+    lock_group(fs, group);
+    if (!BITMAP_TEST(block_bitmap, index)) {
+        BITMAP_SET(block_bitmap, index);
+        adjust_free_blocks(fs, group, -1);
+        is_fixed = 1;
     }
+    unlock_group(fs, group);
+
+    return is_fixed;
+}
 
+/*
+ * Block map visitor that fixes the given block's bitmap entry and adds the
+ * number of fixes to the counter pointed to by arg.
+ */
+int fix_block_visitor (struct ext2_fs *fs, unsigned int block, int level, void *arg) 
+{
+    *(int *) arg += fix_block(fs, block);
     return 0;
 }
 
 /*
- * If any of the given entry's data blocks are not marked as allocated 
- * in the data block bitmap, set it and update the free block counters.
- * Return the number of blocks fixed.
+ * If any of the given inode's data blocks (or the indirect blocks mapping 
+ * them) are not marked as allocated in the data block bitmap, set it and
+ * update the free block counters. Return the number of blocks fixed.
  */
-int fix_block_bitmap (struct ext2_dir_entry *entry) 
+int fix_block_bitmap (struct ext2_fs *fs, unsigned int inode) 
 {
-    struct ext2_inode *ino = get_inode(entry->inode);
-    unsigned int *block_pos;
-    unsigned int *block_end;
-    
-    int k = 0; 
+    struct ext2_inode *ino = get_inode(fs, inode);
     int blocks_fixed = 0;
 
-    while (k < NUM_INITIAL_DIRECT_BLOCKS && ino->i_block[k]) {
-        blocks_fixed += fix_block(ino->i_block[k]);
-        k++;
-    }
-
-    /* If the current entry is a file large enough to require a single
-     * indirect block, we must check all the data blocks the indirect
-     * block points to as well */
-    if (k == NUM_INITIAL_DIRECT_BLOCKS && ino->i_block[k]) {
-        block_pos = (unsigned int *) get_block(ino->i_block[k]);
-        block_end = block_pos + (EXT2_BLOCK_SIZE / sizeof(unsigned int));
-
-        /* Every nonzero entry in the indirect block is a direct block number
-         * that should be allocated in the block bitmap */
-        while (*block_pos && block_pos < block_end) {
-            blocks_fixed += fix_block(*block_pos);
-            block_pos++;
-        }
-    }
+    walk_block_map(fs, ino, fix_block_visitor, &blocks_fixed);
 
     if (blocks_fixed)
-        printf("Fixed: %d in-use data blocks not marked in data bitmap for inode [%d]\n",
-            blocks_fixed, entry->inode);
+        report_fix("block_bitmap", "mark the blocks as in use", inode, NO_LOCATION, 
+            NO_LOCATION, blocks_fixed, 
+            "%d in-use data blocks not marked in data bitmap for inode [%d]\n",
+            blocks_fixed, inode);
 
     return blocks_fixed;
 }
@@ -224,64 +426,1074 @@ int fix_block_bitmap (struct ext2_dir_entry *entry)
  * number of repairs. The second argument notes whether or not this is the 
  * first recursion.
  */
-int recursively_fix_dir_entries (struct ext2_dir_entry *entry, int is_first) 
+int recursively_fix_dir_entries (struct ext2_fs *fs, struct ext2_dir_entry *entry,
+        int is_first) 
 {
-    int num_fixes = fix_file_type(entry);
-    num_fixes += fix_inode_bitmap(entry);
-    num_fixes += fix_deletion_time(entry);
-    num_fixes += fix_block_bitmap(entry);
+    int num_fixes = fix_file_type(fs, entry);
+    num_fixes += fix_inode_bitmap(fs, entry->inode);
+    num_fixes += fix_deletion_time(fs, entry->inode);
+    num_fixes += fix_block_bitmap(fs, entry->inode);
 
-    struct ext2_inode *inode = get_inode(entry->inode);
-    char name[EXT2_NAME_LEN + 1];
-    memcpy(name, entry->name, entry->name_len);
-    name[entry->name_len] = '\0';
-
-    int k; 
+    struct ext2_inode *inode = get_inode(fs, entry->inode);
     int is_dir = entry->file_type == EXT2_FT_DIR;
-    unsigned long block_pos;
-    struct ext2_dir_entry *cur_entry;
+    struct dir_iter it;
 
     /* We only need to recurse on entries that are directories and not .
      * or .., unless it is the . entry in the root at the very beginning */
-    if (is_dir && (!IS_DOT_ENTRY(name) || is_first)) {
-        k = 0;
+    if (is_dir && (!IS_DOT_NAME(entry->name, entry->name_len) || is_first)) {
+        dir_iter_init(&it, inode, 0);
+        while (dir_iter_next(fs, &it))
+            num_fixes += recursively_fix_dir_entries(fs, it.entry, FALSE);
+    }
+
+    return num_fixes;
+}
+
+/*
+ * Return whether the given inode is one the scan of the inode table walks:
+ * a directory that still has links to it.
+ */
+int is_scanned_dir (struct ext2_inode *ino) 
+{
+    return TYPE_MASK(ino->i_mode) == EXT2_S_IFDIR && ino->i_links_count;
+}
+
+/*
+ * Append a reference from the directory parent_inode to the given entry to 
+ * the share's table, growing it as needed. Return 0 on success, or -1 if 
+ * there is no memory left.
+ */
+int add_dir_ref (struct check_share *share, unsigned int parent_inode,
+        struct ext2_dir_entry *entry) 
+{
+    struct dir_ref *refs;
+
+    if (share->num_refs == share->capacity) {
+        share->capacity = (share->capacity) ? share->capacity * 2 : 1024;
+        if (!(refs = realloc(share->refs, share->capacity * sizeof(struct dir_ref))))
+            return -1;
+        share->refs = refs;
+    }
 
-        while (k < NUM_INITIAL_DIRECT_BLOCKS && inode->i_block[k]) {
-            block_pos = 0;
+    share->refs[share->num_refs].parent_inode = parent_inode;
+    share->refs[share->num_refs].entry = entry;
+    share->num_refs++;
+    return 0;
+}
+
+/*
+ * Thread body of the scan phase. Read the inode table of the share's groups
+ * in order and, for each directory found, collect the references made by 
+ * its live entries into the share's table, in the order they are laid out.
+ */
+void *scan_groups (void *arg) 
+{
+    struct check_share *share = arg;
+    struct ext2_fs *fs = share->fs;
+    struct ext2_super_block *sb = get_super_block(fs);
+    struct ext2_inode *ino;
+    struct dir_iter it;
+    unsigned int group, index, inode;
 
-            while (block_pos < EXT2_BLOCK_SIZE) {
-                cur_entry = get_entry(inode->i_block[k], block_pos);
-                if (cur_entry->inode)
-                    num_fixes += recursively_fix_dir_entries(cur_entry, FALSE);
-                block_pos += cur_entry->rec_len;
+    for (group = share->first; group < share->end && !share->failed; group++) {
+        for (index = 0; index < sb->s_inodes_per_group; index++) {
+            inode = group * sb->s_inodes_per_group + index + 1;
+            if (inode > sb->s_inodes_count)
+                break;
+
+            ino = get_inode(fs, inode);
+            if (!is_scanned_dir(ino))
+                continue;
+
+            dir_iter_init(&it, ino, 0);
+            while (dir_iter_next(fs, &it)) {
+                if (it.entry->inode > sb->s_inodes_count)
+                    continue;
+                if (add_dir_ref(share, inode, it.entry)) {
+                    share->failed = TRUE;
+                    break;
+                }
             }
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Thread body of the repair phase. Fix the block bitmap for each inode in
+ * the share's slice of the list of reachable inodes, counting the fixes.
+ */
+void *repair_inodes (void *arg) 
+{
+    struct check_share *share = arg;
+    unsigned int k;
+
+    for (k = share->first; k < share->end; k++)
+        share->num_fixes += fix_block_bitmap(share->fs, share->inodes[k]);
+
+    return NULL;
+}
+
+/*
+ * Run body on each of the num shares in a thread of its own and wait for
+ * them all. A share whose thread cannot be started is run by the caller.
+ */
+void run_shares (struct check_share *shares, int num, void *(*body) (void *)) 
+{
+    pthread_t threads[MAX_CHECK_THREADS];
+    int is_started[MAX_CHECK_THREADS];
+    int k;
+
+    for (k = 1; k < num; k++)
+        is_started[k] = !pthread_create(&threads[k], NULL, body, &shares[k]);
+
+    body(&shares[0]);
+    for (k = 1; k < num; k++) {
+        if (is_started[k])
+            pthread_join(threads[k], NULL);
+        else 
+            body(&shares[k]);
+    }
+}
+
+/*
+ * Fix the file type of the given entry of a reachable directory. If its 
+ * inode has not been seen yet, mark it in checked; if it is a directory 
+ * other than . or .. that has not been reached yet, mark it in visited and 
+ * add it to the queue. Return the number of fixes.
+ */
+int check_entry (struct ext2_fs *fs, struct ext2_dir_entry *entry, 
+        unsigned char *checked, unsigned char *visited, unsigned int *queue, 
+        unsigned int *queue_len) 
+{
+    int num_fixes = fix_file_type(fs, entry);
 
-            k++;
+    BITMAP_SET(checked, entry->inode);
+    if (entry->file_type == EXT2_FT_DIR && !IS_DOT_NAME(entry->name, entry->name_len) &&
+            !BITMAP_TEST(visited, entry->inode)) {
+        BITMAP_SET(visited, entry->inode);
+        queue[(*queue_len)++] = entry->inode;
+    }
+
+    return num_fixes;
+}
+
+/*
+ * Multi-threaded counterpart of recursively_fix_dir_entries() for the root
+ * entry, with the same repairs, using num_threads threads. Directory blocks
+ * are first read by scanning the inode table in order, split by groups 
+ * among the threads. The references found are then walked breadth first 
+ * from the root to find the reachable inodes, and those inodes are repaired
+ * in inode order, their block maps split among the threads. The fixes are 
+ * reported in no particular order. Return the number of repairs, or -1 if 
+ * there is not enough memory.
+ */
+int parallel_fix_dir_entries (struct ext2_fs *fs, struct ext2_dir_entry *root_entry,
+        int num_threads) 
+{
+    struct ext2_super_block *sb = get_super_block(fs);
+    struct check_share shares[MAX_CHECK_THREADS];
+    unsigned int num_groups = get_num_groups(fs);
+    unsigned int num_inodes = sb->s_inodes_count;
+    unsigned int bitmap_len = num_inodes / 8 + 1;
+
+    struct dir_ref *refs = NULL;
+    unsigned long *first_ref = NULL;
+    unsigned char *checked = NULL, *visited = NULL;
+    unsigned int *queue = NULL;
+    unsigned long num_refs = 0, ref;
+    unsigned int queue_head = 0, queue_len = 0;
+    unsigned int inode, num_checked;
+    struct dir_iter it;
+    int num_fixes = -1;
+    int k;
+
+    if ((unsigned int) num_threads > num_groups)
+        num_threads = num_groups;
+
+    /* Phase 1: collect the entries of every directory in the inode table */
+    memset(shares, 0, sizeof(shares));
+    for (k = 0; k < num_threads; k++) {
+        shares[k].fs = fs;
+        shares[k].first = num_groups * k / num_threads;
+        shares[k].end = num_groups * (k + 1) / num_threads;
+    }
+    run_shares(shares, num_threads, scan_groups);
+
+    for (k = 0; k < num_threads; k++) {
+        if (shares[k].failed)
+            goto out;
+        num_refs += shares[k].num_refs;
+    }
+
+    /* Phase 2: merge the tables. The shares cover ascending groups, so 
+     * joining them in order leaves the references sorted by parent. */
+    refs = malloc((num_refs + 1) * sizeof(struct dir_ref));
+    first_ref = calloc(num_inodes + 2, sizeof(unsigned long));
+    checked = calloc(bitmap_len, 1);
+    visited = calloc(bitmap_len, 1);
+    queue = malloc((num_inodes + 1) * sizeof(unsigned int));
+    if (!refs || !first_ref || !checked || !visited || !queue)
+        goto out;
+
+    num_refs = 0;
+    for (k = 0; k < num_threads; k++) {
+        memcpy(refs + num_refs, shares[k].refs, shares[k].num_refs * sizeof(struct dir_ref));
+        num_refs += shares[k].num_refs;
+    }
+
+    for (ref = 0; ref < num_refs; ref++)
+        first_ref[refs[ref].parent_inode + 1]++;
+    for (inode = 1; inode <= num_inodes + 1; inode++)
+        first_ref[inode] += first_ref[inode - 1];
+
+    /* Walk the reachable directories breadth first from the root */
+    num_fixes = fix_file_type(fs, root_entry);
+    BITMAP_SET(checked, root_entry->inode);
+    BITMAP_SET(visited, root_entry->inode);
+    queue[queue_len++] = root_entry->inode;
+
+    while (queue_head < queue_len) {
+        inode = queue[queue_head++];
+
+        if (is_scanned_dir(get_inode(fs, inode))) {
+            for (ref = first_ref[inode]; ref < first_ref[inode + 1]; ref++)
+                num_fixes += check_entry(fs, refs[ref].entry, checked, visited, 
+                    queue, &queue_len);
+            continue;
+        }
+
+        /* Not in the tables, as it has no links; read it on the spot */
+        dir_iter_init(&it, get_inode(fs, inode), 0);
+        while (dir_iter_next(fs, &it)) {
+            if (it.entry->inode <= num_inodes)
+                num_fixes += check_entry(fs, it.entry, checked, visited, 
+                    queue, &queue_len);
         }
     }
 
+    /* Phase 3: repair the reachable inodes in inode order, reusing the 
+     * queue for the list */
+    num_checked = 0;
+    for (inode = 1; inode <= num_inodes; inode++) {
+        if (BITMAP_TEST(checked, inode))
+            queue[num_checked++] = inode;
+    }
+
+    for (k = 0; k < (int) num_checked; k++) {
+        num_fixes += fix_inode_bitmap(fs, queue[k]);
+        num_fixes += fix_deletion_time(fs, queue[k]);
+    }
+
+    for (k = 0; k < num_threads; k++) {
+        shares[k].inodes = queue;
+        shares[k].first = (unsigned long) num_checked * k / num_threads;
+        shares[k].end = (unsigned long) num_checked * (k + 1) / num_threads;
+        shares[k].num_fixes = 0;
+    }
+    run_shares(shares, num_threads, repair_inodes);
+
+    for (k = 0; k < num_threads; k++)
+        num_fixes += shares[k].num_fixes;
+
+out:
+    for (k = 0; k < num_threads; k++)
+        free(shares[k].refs);
+    free(refs);
+    free(first_ref);
+    free(checked);
+    free(visited);
+    free(queue);
     return num_fixes;
 }
 
+/*
+ * Thread body of the link count sweep. Read the inode table of the share's
+ * groups in order and, for each directory in use, add one to the shared 
+ * counter of every inode referenced by one of its live entries.
+ */
+void *count_links (void *arg) 
+{
+    struct check_share *share = arg;
+    struct ext2_fs *fs = share->fs;
+    struct ext2_super_block *sb = get_super_block(fs);
+    struct ext2_inode *ino;
+    struct dir_iter it;
+    unsigned char *inode_bitmap;
+    unsigned int group, index, inode;
+
+    for (group = share->first; group < share->end; group++) {
+        inode_bitmap = get_inode_bitmap(fs, group);
+
+        for (index = 0; index < sb->s_inodes_per_group; index++) {
+            inode = group * sb->s_inodes_per_group + index + 1;
+            if (inode > sb->s_inodes_count)
+                break;
+
+            ino = get_inode(fs, inode);
+            if (!BITMAP_TEST(inode_bitmap, index) || ino->i_dtime || 
+                    TYPE_MASK(ino->i_mode) != EXT2_S_IFDIR)
+                continue;
+
+            dir_iter_init(&it, ino, 0);
+            while (dir_iter_next(fs, &it)) {
+                if (it.entry->inode <= sb->s_inodes_count)
+                    __atomic_fetch_add(&share->link_counts[it.entry->inode], 1,
+                        __ATOMIC_RELAXED);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Count the entries referring to each inode in one sweep over the 
+ * directories in use, split by groups among num_threads threads, then set 
+ * the link count of every referenced inode whose count differs to the 
+ * number of entries found. Inodes with no entries are left alone. Return 
+ * the number of repairs, or -1 if there is not enough memory.
+ */
+int fix_link_counts (struct ext2_fs *fs, int num_threads) 
+{
+    struct ext2_super_block *sb = get_super_block(fs);
+    struct check_share shares[MAX_CHECK_THREADS];
+    unsigned int num_groups = get_num_groups(fs);
+    unsigned short *link_counts;
+    struct ext2_inode *ino;
+    unsigned int inode;
+    int num_fixes = 0;
+    int k;
+
+    if (!(link_counts = calloc(sb->s_inodes_count + 1, sizeof(unsigned short))))
+        return -1;
+
+    if ((unsigned int) num_threads > num_groups)
+        num_threads = num_groups;
+
+    memset(shares, 0, sizeof(shares));
+    for (k = 0; k < num_threads; k++) {
+        shares[k].fs = fs;
+        shares[k].first = num_groups * k / num_threads;
+        shares[k].end = num_groups * (k + 1) / num_threads;
+        shares[k].link_counts = link_counts;
+    }
+    run_shares(shares, num_threads, count_links);
+
+    for (inode = 1; inode <= sb->s_inodes_count; inode++) {
+        ino = get_inode(fs, inode);
+        if (!link_counts[inode] || ino->i_links_count == link_counts[inode])
+            continue;
+
+        report_fix("link_count", "set the link count to the number of entries", inode, 
+            NO_LOCATION, NO_LOCATION, 1, 
+            "inode [%d] had %d links but %d directory entries refer to it\n",
+            inode, ino->i_links_count, link_counts[inode]);
+        ino->i_links_count = link_counts[inode];
+        num_fixes++;
+    }
+
+    free(link_counts);
+    return num_fixes;
+}
+
+/*
+ * Set the link count of the given directory, which was found to have 
+ * num_subdirs subdirectories, to the number of entries referring to it: 
+ * the one in its parent (its own .. for the root), its own . entry and the
+ * .. entry of each subdirectory. Unlike fix_link_counts(), this needs no
+ * sweep over the other directories. Return the number of repairs.
+ */
+int fix_dir_link_count (struct ext2_fs *fs, unsigned int dir_inode, unsigned int num_subdirs) 
+{
+    struct ext2_inode *dir = get_inode(fs, dir_inode);
+    unsigned int num_links = 2 + num_subdirs;
+
+    if (dir->i_links_count == num_links)
+        return 0;
+
+    report_fix("link_count", "set the link count to the number of entries", dir_inode, 
+        NO_LOCATION, NO_LOCATION, 1, 
+        "inode [%d] had %d links but %d directory entries refer to it\n",
+        dir_inode, dir->i_links_count, num_links);
+    dir->i_links_count = num_links;
+    return 1;
+}
+
+/*
+ * Return whether the given inode's i_block holds a block map. Device files,
+ * pipes and sockets have none, and neither do symlinks whose target is 
+ * stored in i_block itself.
+ */
+int has_block_map (struct ext2_inode *ino) 
+{
+    switch (TYPE_MASK(ino->i_mode)) {
+    case EXT2_S_IFREG:
+    case EXT2_S_IFDIR:
+        return TRUE;
+    case EXT2_S_IFLNK:
+        return ino->i_blocks != 0;
+    default:
+        return FALSE;
+    }
+}
+
+/*
+ * Record that the given block is mapped by owner, noting it as a duplicate
+ * if something else already maps it.
+ */
+void claim_block (struct ext2_fs *fs, struct block_owners *map, unsigned int block,
+        unsigned int owner) 
+{
+    unsigned int prev_owner = map->owners[block];
+
+    if (!prev_owner) {
+        map->owners[block] = owner;
+        return;
+    }
+
+    BITMAP_SET(map->dups, block);
+    if (prev_owner != BLOCK_OWNER_METADATA)
+        BITMAP_SET(map->has_dups, prev_owner);
+    if (owner != BLOCK_OWNER_METADATA)
+        BITMAP_SET(map->has_dups, owner);
+}
+
+/*
+ * Block map visitor that claims the given block for the inode being walked.
+ */
+int claim_visitor (struct ext2_fs *fs, unsigned int block, int level, void *arg) 
+{
+    struct block_owners *map = arg;
+    claim_block(fs, map, block, map->inode);
+    return 0;
+}
+
+/*
+ * Claim the blocks holding the file system's own structures: in each group,
+ * the copy of the superblock and group descriptor table (with the blocks 
+ * reserved for it to grow) if there is one there, the bitmaps and the inode
+ * table. The resize inode's block map points into the reserved descriptor
+ * blocks, so only its top-level block is claimed, for the resize inode.
+ */
+void claim_metadata (struct ext2_fs *fs, struct block_owners *map) 
+{
+    struct ext2_super_block *sb = get_super_block(fs);
+    struct ext2_group_desc *gd;
+    unsigned int num_groups = get_num_groups(fs);
+    unsigned int table_blocks = (sb->s_inodes_per_group * get_inode_size(fs) + 
+        EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+    unsigned int super_blocks = 1 + get_num_gdt_blocks(fs) + sb->s_reserved_gdt_blocks;
+    unsigned int group, block, k;
+    struct ext2_inode *resize_ino;
+
+    for (group = 0; group < num_groups; group++) {
+        gd = get_group_desc(fs, group);
+
+        if (group_has_super(fs, group)) {
+            block = get_group_first_block(fs, group);
+            for (k = 0; k < super_blocks && is_valid_block(fs, block + k); k++)
+                claim_block(fs, map, block + k, BLOCK_OWNER_METADATA);
+        }
+
+        if (is_valid_block(fs, gd->bg_block_bitmap))
+            claim_block(fs, map, gd->bg_block_bitmap, BLOCK_OWNER_METADATA);
+        if (is_valid_block(fs, gd->bg_inode_bitmap))
+            claim_block(fs, map, gd->bg_inode_bitmap, BLOCK_OWNER_METADATA);
+        for (k = 0; k < table_blocks && is_valid_block(fs, gd->bg_inode_table + k); k++)
+            claim_block(fs, map, gd->bg_inode_table + k, BLOCK_OWNER_METADATA);
+    }
+
+    if (sb->s_feature_compat & EXT2_FEATURE_COMPAT_RESIZE_INO) {
+        resize_ino = get_inode(fs, EXT2_RESIZE_INO);
+        if (is_valid_block(fs, resize_ino->i_block[NUM_INITIAL_DIRECT_BLOCKS + 1]))
+            claim_block(fs, map, resize_ino->i_block[NUM_INITIAL_DIRECT_BLOCKS + 1], EXT2_RESIZE_INO);
+    }
+}
+
+/*
+ * Block map visitor that counts the blocks visited in the counter pointed 
+ * to by arg.
+ */
+int count_visitor (struct ext2_fs *fs, unsigned int block, int level, void *arg) 
+{
+    (*(unsigned int *) arg)++;
+    return 0;
+}
+
+/*
+ * Give the inode whose block map is being walked a block of its own for the
+ * block of the given level that slot points to, if it is a duplicate that 
+ * the inode is not the keeper of: the first owner keeps the block the first
+ * time its walk reaches it, and every other mapping of it gets a copy of 
+ * its contents in a newly allocated block. If no block is left, the slot is
+ * cleared and the blocks it mapped are dropped from ino's count. Then do 
+ * the same for the blocks mapped by an indirect block. Return the number 
+ * of repairs.
+ */
+int separate_slot (struct ext2_fs *fs, struct block_owners *map, struct ext2_inode *ino,
+        unsigned int *slot, int level) 
+{
+    unsigned int block = *slot;
+    unsigned int copy, num_dropped;
+    unsigned int *pos;
+    int num_fixes = 0;
+    int k;
+
+    if (!is_valid_block(fs, block))
+        return 0;
+
+    if (BITMAP_TEST(map->dups, block)) {
+        if (map->owners[block] == map->inode && !BITMAP_TEST(map->kept, block)) {
+            BITMAP_SET(map->kept, block);
+        } else {
+            /* A free block may still be mapped by an inode that nothing 
+             * links to; such a block stays in use and the search goes on */
+            while ((copy = allocate_block(fs, block)) && map->owners[copy])
+                ;
+
+            if (copy) {
+                memcpy(get_block(fs, copy), get_block(fs, block), EXT2_BLOCK_SIZE);
+                map->owners[copy] = map->inode;
+                *slot = copy;
+                report_fix("shared_block", "give the later inode a copy of the block", 
+                    map->inode, block, NO_LOCATION, 1, 
+                    "block [%u] mapped by inode [%u] was also mapped by inode [%u], copied to block [%u]\n",
+                    block, map->owners[block], map->inode, copy);
+            } else {
+                num_dropped = 1;
+                if (level)
+                    walk_indirect_block(fs, block, level, count_visitor, &num_dropped);
+                ino->i_blocks -= num_dropped * (EXT2_BLOCK_SIZE / DISK_SECTOR_SIZE);
+                *slot = 0;
+                report_fix("shared_block", "unmap the block from the later inode", 
+                    map->inode, block, NO_LOCATION, 1, 
+                    "block [%u] mapped by inode [%u] was also mapped by inode [%u], unmapped from the latter\n",
+                    block, map->owners[block], map->inode);
+            }
+            num_fixes++;
+        }
+    }
+
+    if (level && *slot) {
+        pos = (unsigned int *) get_block(fs, *slot);
+        for (k = 0; k < NUM_INDIRECT_POINTERS; k++)
+            num_fixes += separate_slot(fs, map, ino, &pos[k], level - 1);
+    }
+
+    return num_fixes;
+}
+
+/*
+ * Check that every block is mapped by at most one inode in use, and that 
+ * every block marked as in use is mapped by one. The owner of each block 
+ * is found in one pass over the block maps of the inodes in use, in inode 
+ * order. The blocks marked as in use that nothing maps are then freed, and
+ * blocks mapped more than once are given to the first inode found mapping 
+ * them, the others each getting a copy of their own. Return the number of
+ * repairs, or -1 if there is not enough memory.
+ */
+int fix_block_owners (struct ext2_fs *fs) 
+{
+    struct ext2_super_block *sb = get_super_block(fs);
+    struct block_owners map;
+    struct ext2_inode *ino;
+    unsigned int num_groups = get_num_groups(fs);
+    unsigned int group, index, block, inode;
+    int num_fixes = 0;
+    int group_fixes;
+    int k;
+
+    map.owners = calloc(sb->s_blocks_count, sizeof(unsigned int));
+    map.dups = calloc(sb->s_blocks_count / 8 + 1, 1);
+    map.kept = calloc(sb->s_blocks_count / 8 + 1, 1);
+    map.has_dups = calloc(sb->s_inodes_count / 8 + 1, 1);
+    if (!map.owners || !map.dups || !map.kept || !map.has_dups) {
+        num_fixes = -1;
+        goto out;
+    }
+
+    /* Find the owner of every block */
+    claim_metadata(fs, &map);
+    for (inode = 1; inode <= sb->s_inodes_count; inode++) {
+        ino = get_inode(fs, inode);
+        if (!is_inode_in_use(fs, inode) || ino->i_dtime || !has_block_map(ino))
+            continue;
+        if (inode == EXT2_RESIZE_INO && (sb->s_feature_compat & EXT2_FEATURE_COMPAT_RESIZE_INO))
+            continue;
+
+        map.inode = inode;
+        walk_block_map(fs, ino, claim_visitor, &map);
+    }
+
+    /* Free the blocks marked as in use that nothing maps first, so that
+     * they are available for the copies */
+    for (group = 0; group < num_groups; group++) {
+        group_fixes = 0;
+        for (index = 0; index < get_blocks_in_group(fs, group); index++) {
+            block = get_group_first_block(fs, group) + index;
+            if (map.owners[block] || !BITMAP_TEST(get_block_bitmap(fs, group), index))
+                continue;
+
+            deallocate_block(fs, block);
+            group_fixes++;
+        }
+
+        if (group_fixes)
+            report_fix("unowned_blocks", "free the blocks", NO_LOCATION, NO_LOCATION, group, 
+                group_fixes, 
+                "%d blocks in block group %u marked as in use but not mapped by any inode\n",
+                group_fixes, group);
+        num_fixes += group_fixes;
+    }
+
+    /* Separate the inodes sharing blocks */
+    for (inode = 1; inode <= sb->s_inodes_count; inode++) {
+        if (!BITMAP_TEST(map.has_dups, inode))
+            continue;
+
+        ino = get_inode(fs, inode);
+        map.inode = inode;
+        for (k = 0; k < NUM_INITIAL_DIRECT_BLOCKS; k++)
+            num_fixes += separate_slot(fs, &map, ino, &ino->i_block[k], 0);
+        for (k = 0; k < 3; k++)
+            num_fixes += separate_slot(fs, &map, ino, 
+                &ino->i_block[NUM_INITIAL_DIRECT_BLOCKS + k], k + 1);
+    }
+
+out:
+    free(map.owners);
+    free(map.dups);
+    free(map.kept);
+    free(map.has_dups);
+    return num_fixes;
+}
+
+/*
+ * Append num to the given list, growing it as needed. Return 0 on success,
+ * or -1 if there is no memory left.
+ */
+int add_to_list (struct num_list *list, unsigned int num) 
+{
+    unsigned int *nums;
+
+    if (list->len == list->capacity) {
+        list->capacity = (list->capacity) ? list->capacity * 2 : 256;
+        if (!(nums = realloc(list->nums, list->capacity * sizeof(unsigned int))))
+            return -1;
+        list->nums = nums;
+    }
+
+    list->nums[list->len++] = num;
+    return 0;
+}
+
+/*
+ * qsort() and bsearch() comparator for unsigned int numbers.
+ */
+int compare_nums (const void *a, const void *b) 
+{
+    unsigned int x = *(const unsigned int *) a;
+    unsigned int y = *(const unsigned int *) b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Sort the given list in ascending order and drop any repeated numbers.
+ */
+void sort_list (struct num_list *list) 
+{
+    unsigned long k, len = 0;
+
+    if (!list->len)
+        return;
+
+    qsort(list->nums, list->len, sizeof(unsigned int), compare_nums);
+    for (k = 1; k < list->len; k++) {
+        if (list->nums[k] != list->nums[len])
+            list->nums[++len] = list->nums[k];
+    }
+    list->len = len + 1;
+}
+
+/*
+ * Return whether num is in the given sorted list.
+ */
+int is_in_list (struct num_list *list, unsigned int num) 
+{
+    return list->len && bsearch(&num, list->nums, list->len, sizeof(unsigned int), 
+        compare_nums) != NULL;
+}
+
+/*
+ * Return whether the given block holds part of the file system's own 
+ * structures, as described for claim_metadata().
+ */
+int is_metadata_block (struct ext2_fs *fs, unsigned int block) 
+{
+    struct ext2_super_block *sb = get_super_block(fs);
+    unsigned int group = get_block_group(fs, block);
+    struct ext2_group_desc *gd = get_group_desc(fs, group);
+    unsigned int table_blocks = (sb->s_inodes_per_group * get_inode_size(fs) + 
+        EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+    unsigned int super_blocks = 1 + get_num_gdt_blocks(fs) + sb->s_reserved_gdt_blocks;
+
+    if (group_has_super(fs, group) && get_block_index(fs, block) < super_blocks)
+        return TRUE;
+    if (block == gd->bg_block_bitmap || block == gd->bg_inode_bitmap)
+        return TRUE;
+    if (block >= gd->bg_inode_table && block < gd->bg_inode_table + table_blocks)
+        return TRUE;
+
+    return (sb->s_feature_compat & EXT2_FEATURE_COMPAT_RESIZE_INO) && 
+        block == get_inode(fs, EXT2_RESIZE_INO)->i_block[NUM_INITIAL_DIRECT_BLOCKS + 1];
+}
+
+/*
+ * Return whether the given inode number refers to a directory that has 
+ * links to it and is not deleted.
+ */
+int is_live_dir (struct ext2_fs *fs, unsigned int inode) 
+{
+    struct ext2_inode *ino;
+
+    if (!inode || inode > get_super_block(fs)->s_inodes_count)
+        return FALSE;
+
+    ino = get_inode(fs, inode);
+    return TYPE_MASK(ino->i_mode) == EXT2_S_IFDIR && ino->i_links_count && !ino->i_dtime;
+}
+
+/*
+ * Block map visitor that adds each block to the list pointed to by arg, 
+ * stopping the walk with -1 if there is no memory left.
+ */
+int list_visitor (struct ext2_fs *fs, unsigned int block, int level, void *arg) 
+{
+    return add_to_list(arg, block);
+}
+
+/*
+ * Add the given directory to the list of directories to check, unless it 
+ * has already been added, as noted in the bitmap queued. Return 0 on 
+ * success, or -1 if there is no memory left.
+ */
+int queue_dir (struct num_list *dirs, unsigned char *queued, unsigned int dir_inode) 
+{
+    if (BITMAP_TEST(queued, dir_inode))
+        return 0;
+
+    BITMAP_SET(queued, dir_inode);
+    return add_to_list(dirs, dir_inode);
+}
+
+/*
+ * Check only what the changes recorded in the given dirty log can have 
+ * affected, and return the number of repairs, or -1 if there is not enough
+ * memory. The counters are checked for the groups holding the logged 
+ * inodes and blocks. The entries of the logged directories that are in use
+ * or that a checked directory refers to, and those of their parents, are 
+ * checked, and the inodes they refer to get the repairs made to every 
+ * entry by recursively_fix_dir_entries(). The blocks of those inodes and of
+ * the other logged inodes in use are marked in the block bitmap, and the 
+ * logged blocks that are marked as in use while none of them maps them 
+ * are freed. The link counts of the checked directories are set from the 
+ * subdirectories found in them. The link counts of other inodes, and blocks
+ * shared between inodes, are only checked by a full check.
+ */
+int incremental_fix (struct ext2_fs *fs, struct dirty_log *log) 
+{
+    struct ext2_super_block *sb = get_super_block(fs);
+    struct num_list groups = { 0 }, logged = { 0 }, dirs = { 0 }, inodes = { 0 }, 
+        blocks = { 0 }, referred = { 0 }, mapped = { 0 };
+    struct ext2_inode *ino;
+    struct ext2_dir_entry *entry;
+    struct dir_iter it;
+    unsigned char *queued;
+    unsigned int num_groups = get_num_groups(fs);
+    unsigned int free_blocks = 0, free_inodes = 0;
+    unsigned int group, inode, block, last_group;
+    unsigned int num_subdirs;
+    unsigned long k, n;
+    int num_fixes = -1;
+    int group_fixes;
+
+    if (!(queued = calloc(sb->s_inodes_count / 8 + 1, 1)))
+        return -1;
+
+    /* Gather the logged inodes and blocks, and the groups they are in */
+    for (k = 0; k < log->num_inodes; k++) {
+        inode = log->inodes[k];
+        if (!inode || inode > sb->s_inodes_count)
+            continue;
+        if (add_to_list(&logged, inode) || add_to_list(&groups, get_inode_group(fs, inode)))
+            goto out;
+    }
+
+    for (k = 0; k < log->num_ranges; k++) {
+        for (n = 0; n < log->ranges[k].count; n++) {
+            block = log->ranges[k].first + n;
+            if (!is_valid_block(fs, block))
+                break;
+            if (add_to_list(&blocks, block))
+                goto out;
+        }
+    }
+
+    sort_list(&logged);
+    sort_list(&blocks);
+    for (k = 0; k < blocks.len; k++) {
+        if ((!k || get_block_group(fs, blocks.nums[k]) != get_block_group(fs, blocks.nums[k - 1])) &&
+                add_to_list(&groups, get_block_group(fs, blocks.nums[k])))
+            goto out;
+    }
+
+    /* Repair the counters of the groups touched, trusting the others */
+    sort_list(&groups);
+    num_fixes = 0;
+    for (group = 0; group < num_groups; group++) {
+        if (is_in_list(&groups, group)) {
+            num_fixes += fix_group_counters(fs, group, &free_blocks, &free_inodes);
+        } else {
+            free_blocks += get_group_desc(fs, group)->bg_free_blocks_count;
+            free_inodes += get_group_desc(fs, group)->bg_free_inodes_count;
+        }
+    }
+    num_fixes += fix_super_counters(fs, free_blocks, free_inodes);
+
+    /* Start from the logged directories in use and the parents of all the
+     * logged directories */
+    for (k = 0; k < logged.len; k++) {
+        ino = get_inode(fs, logged.nums[k]);
+        if (TYPE_MASK(ino->i_mode) != EXT2_S_IFDIR)
+            continue;
+        if (is_live_dir(fs, logged.nums[k]) && queue_dir(&dirs, queued, logged.nums[k]))
+            goto fail;
+
+        /* The blocks of a removed directory may have been reused, so its 
+         * .. only counts if it leads to a directory in use */
+        dir_iter_init(&it, ino, 0);
+        while (dir_iter_next(fs, &it)) {
+            if (!ENTRY_HAS_NAME(it.entry, "..", 2))
+                continue;
+            if (is_live_dir(fs, it.entry->inode) && queue_dir(&dirs, queued, it.entry->inode))
+                goto fail;
+            break;
+        }
+    }
+
+    /* Check the entries of those directories, along with the other logged 
+     * directories they lead to */
+    for (k = 0; k < dirs.len; k++) {
+        num_subdirs = 0;
+        dir_iter_init(&it, get_inode(fs, dirs.nums[k]), 0);
+        while (dir_iter_next(fs, &it)) {
+            entry = it.entry;
+            if (entry->inode > sb->s_inodes_count)
+                continue;
+
+            num_fixes += fix_file_type(fs, entry);
+            if (add_to_list(&referred, entry->inode))
+                goto fail;
+            if (entry->file_type != EXT2_FT_DIR || IS_DOT_NAME(entry->name, entry->name_len))
+                continue;
+
+            num_subdirs++;
+            if (is_in_list(&logged, entry->inode) && queue_dir(&dirs, queued, entry->inode))
+                goto fail;
+        }
+
+        num_fixes += fix_dir_link_count(fs, dirs.nums[k], num_subdirs);
+    }
+
+    /* The inodes referred to must be in use */
+    sort_list(&referred);
+    for (k = 0; k < referred.len; k++) {
+        num_fixes += fix_inode_bitmap(fs, referred.nums[k]);
+        num_fixes += fix_deletion_time(fs, referred.nums[k]);
+    }
+
+    /* Mark the blocks of those inodes and of the logged ones still in use,
+     * noting which blocks they map */
+    for (k = 0; k < referred.len; k++) {
+        if (add_to_list(&inodes, referred.nums[k]))
+            goto fail;
+    }
+    for (k = 0; k < logged.len; k++) {
+        if (add_to_list(&inodes, logged.nums[k]))
+            goto fail;
+    }
+
+    sort_list(&inodes);
+    for (k = 0; k < inodes.len; k++) {
+        inode = inodes.nums[k];
+        ino = get_inode(fs, inode);
+        if (!ino->i_links_count || ino->i_dtime || !has_block_map(ino))
+            continue;
+
+        num_fixes += fix_block_bitmap(fs, inode);
+        if (walk_block_map(fs, ino, list_visitor, &mapped))
+            goto fail;
+    }
+    sort_list(&mapped);
+
+    /* Free the logged blocks that are marked as in use but mapped by none
+     * of the inodes that can have been given them */
+    group_fixes = 0;
+    last_group = 0;
+    for (k = 0; k <= blocks.len; k++) {
+        if (k == blocks.len || get_block_group(fs, blocks.nums[k]) != last_group) {
+            if (group_fixes)
+                report_fix("unowned_blocks", "free the blocks", NO_LOCATION, NO_LOCATION, 
+                    last_group, group_fixes, 
+                    "%d blocks in block group %u marked as in use but not mapped by any inode\n",
+                    group_fixes, last_group);
+            num_fixes += group_fixes;
+            group_fixes = 0;
+            if (k == blocks.len)
+                break;
+            last_group = get_block_group(fs, blocks.nums[k]);
+        }
+
+        block = blocks.nums[k];
+        if (!is_block_in_use(fs, block) || is_in_list(&mapped, block) || 
+                is_metadata_block(fs, block))
+            continue;
+
+        deallocate_block(fs, block);
+        group_fixes++;
+    }
+    goto out;
+
+fail:
+    num_fixes = -1;
+out:
+    free(queued);
+    free(groups.nums);
+    free(logged.nums);
+    free(dirs.nums);
+    free(inodes.nums);
+    free(blocks.nums);
+    free(referred.nums);
+    free(mapped.nums);
+    return num_fixes;
+}
+
+/*
+ * Check the whole file system, using num_threads threads if it is nonzero,
+ * and return the number of repairs, or -1 if there is not enough memory.
+ */
+int fix_all (struct ext2_fs *fs, int num_threads) 
+{
+    struct ext2_inode *root_ino = get_inode(fs, EXT2_ROOT_INO);
+    struct ext2_dir_entry *root_entry = get_entry(fs, root_ino->i_block[0], 0);
+    int num_fixes, dir_fixes, link_fixes, block_fixes;
+
+    begin_phase("counters");
+    num_fixes = initial_counter_fix(fs);
+
+    begin_phase("directories");
+    if (num_threads)
+        dir_fixes = parallel_fix_dir_entries(fs, root_entry, num_threads);
+    else
+        dir_fixes = recursively_fix_dir_entries(fs, root_entry, TRUE);
+    if (dir_fixes < 0)
+        return -1;
+
+    /* Link counts are checked once every directory in the tree is marked 
+     * as in use */
+    begin_phase("link_counts");
+    link_fixes = fix_link_counts(fs, (num_threads) ? num_threads : 1);
+    if (link_fixes < 0)
+        return -1;
+
+    begin_phase("block_owners");
+    block_fixes = fix_block_owners(fs);
+    if (block_fixes < 0)
+        return -1;
+
+    return num_fixes + dir_fixes + link_fixes + block_fixes;
+}
+
 int main (int argc, char **argv) 
 {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <image file path>\n", argv[0]);
+    struct dirty_log log;
+    struct ext2_fs *fs;
+    const char *mode = "full";
+    int num_threads = 0;
+    int is_incremental = FALSE;
+    int is_dry_run = FALSE;
+    int is_usage_ok = argc >= 2;
+    int total_fixes;
+    int k;
+
+    for (k = 2; k < argc && is_usage_ok; k++) {
+        if (!strcmp(argv[k], "--incremental"))
+            is_incremental = TRUE;
+        else if (!strcmp(argv[k], "-n"))
+            is_dry_run = TRUE;
+        else if (!strcmp(argv[k], "-j") && k + 1 < argc)
+            is_usage_ok = (num_threads = atoi(argv[++k])) >= 1;
+        else 
+            is_usage_ok = FALSE;
+    }
+
+    if (!is_usage_ok) {
+        fprintf(stderr, "Usage: %s <image file path> [-j <number of threads>] [--incremental] [-n]\n", 
+            argv[0]);
         exit(1);
     }
 
-    init_disk(argv[1]);
+    if (num_threads > MAX_CHECK_THREADS)
+        num_threads = MAX_CHECK_THREADS;
 
-    struct ext2_inode *root_ino = get_inode(EXT2_ROOT_INO);
-    struct ext2_dir_entry *root_entry = get_entry(root_ino->i_block[0], 0);
-    
-    int total_fixes = initial_counter_fix() + 
-        recursively_fix_dir_entries(root_entry, TRUE);
+    /* A dry run repairs a private copy of the image and reports in JSON */
+    if (is_dry_run) {
+        report.is_json = TRUE;
+        report.items = open_memstream(&report.items_buf, &report.items_len);
+        if (!report.items) {
+            perror("open_memstream");
+            exit(1);
+        }
+    }
+
+    fs = open_disk_flags(argv[1], (is_dry_run) ? OPEN_DISK_PRIVATE : 0);
+    if (!fs)
+        exit(1);
+
+    /* Without a dirty log to go by, everything has to be checked */
+    if (is_incremental && !read_dirty_log(fs, &log)) {
+        mode = "incremental";
+        begin_phase("incremental");
+        total_fixes = incremental_fix(fs, &log);
+        free_dirty_log(&log);
+    } else {
+        if (is_incremental && errno != ENOENT)
+            perror(fs->dirty_log_path);
+        else if (is_incremental && !is_dry_run)
+            printf("No dirty log found, checking the whole image\n");
+        total_fixes = fix_all(fs, num_threads);
+    }
+    begin_phase(NULL);
+
+    if (total_fixes < 0) {
+        fprintf(stderr, "Not enough memory to check the file system\n");
+        close_disk(fs);
+        exit(1);
+    }
+
+    /* Everything logged so far, including the repairs just made, has been 
+     * checked. An incremental check starts logging if it was not already. */
+    if (!is_dry_run)
+        reset_dirty_log(fs, is_incremental);
 
-    if (total_fixes)
+    if (is_dry_run)
+        print_json_report(argv[1], mode, is_dry_run, total_fixes);
+    else if (total_fixes)
         printf("%d file system inconsistencies repaired!\n", total_fixes);
     else 
         printf("No file system inconsistencies detected!\n");
 
-    return 0;
+    return (close_disk(fs) < 0) ? EIO : 0;
 }
@@ -0,0 +1,554 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libgen.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include "ext2_utils.h"
+
+/*
+ * The operations behind each of the tools, run against the disk image
+ * referred to by fs, as opened by open_disk(). Each prints its errors to 
+ * stderr and returns the tool's exit status: 0 on success, or an errno 
+ * value.
+ */
+
+/*
+ * Create a new directory at the given absolute path, as ext2_mkdir does.
+ */
+int cmd_mkdir (struct ext2_fs *fs, char *path)
+{
+    char *new_dir;
+    char parent_dir[strlen(path) + 1];
+    char path_copy[strlen(path) + 1];
+
+    unsigned int parent_inode = 0;
+    unsigned int new_inode;
+    int ret_val;
+
+    /* User should not be able to pass in a relative path
+     * on the disk image */
+    if (IS_ABSOLUTE(path)) {
+
+        /* Get the inode of the parent directory, if it exists */
+        memcpy(parent_dir, path, strlen(path));
+        parent_dir[strlen(path)] = '\0';
+
+        memcpy(parent_dir, dirname(parent_dir), strlen(path));
+        parent_dir[strlen(parent_dir)] = '\0';
+
+        parent_inode = get_inode_at_path(fs, parent_dir);
+    }
+
+    if (parent_inode && is_dir(fs, parent_inode)) {
+        /* If the desired parent is a valid directory, and none of the errors
+         * below apply, we may proceed */
+        memcpy(path_copy, path, strlen(path));
+        path_copy[strlen(path)] = '\0';
+        new_dir = basename(path_copy);
+
+        if (strlen(new_dir) > EXT2_NAME_LEN) {
+            fprintf(stderr, "ERROR: Directory name too long\n");
+            return ENAMETOOLONG;
+        }
+
+        if (find_entry(fs, parent_inode, new_dir)) {
+            fprintf(stderr, "ERROR: Directory already exists\n");
+            return EEXIST;
+        }
+
+        new_inode = allocate_inode(fs, parent_inode, EXT2_FT_DIR);
+        if (!new_inode) {
+            fprintf(stderr, "ERROR: No free inodes left\n");
+            return ENOSPC;
+        }
+
+        /* Another thread may have taken the name or removed the parent in 
+         * the meantime */
+        ret_val = create_entry(fs, parent_inode, new_inode, new_dir, EXT2_FT_DIR);
+        if (ret_val == EEXIST) {
+            fprintf(stderr, "ERROR: Directory already exists\n");
+            return EEXIST;
+        } else if (ret_val == ENOENT) {
+            fprintf(stderr, "ERROR: Parent path must be absolute and valid\n");
+            return ENOENT;
+        } else if (ret_val) {
+            fprintf(stderr, "ERROR: No space left for directory\n");
+            return ENOSPC;
+        }
+
+    } else {
+        fprintf(stderr, "ERROR: Parent path must be absolute and valid\n");
+        return ENOENT;
+    }
+
+    return 0;
+}
+
+/*
+ * Copy the file at src_path on the native file system to dest_path on the
+ * disk image, as ext2_cp does.
+ */
+int cmd_cp (struct ext2_fs *fs, char *src_path, char *dest_path)
+{
+    int src_fd;
+    int ret_val;
+
+    if ((src_fd = open(src_path, O_RDONLY)) < 0) {
+        fprintf(stderr, "ERROR: Source file does not exist\n");
+        return ENOENT;
+    }
+
+    ret_val = copy_from_fd(fs, src_fd, src_path, dest_path);
+    close(src_fd);
+    return ret_val;
+}
+
+/*
+ * Copy the contents of the open file src_fd, found at src_path on the
+ * native file system, to dest_path on the disk image. Helper of cmd_cp(),
+ * which owns the file descriptor.
+ */
+int copy_from_fd (struct ext2_fs *fs, int src_fd, char *src_path, char *dest_path)
+{
+    char *src_file_name;
+    char *base_copy;
+    char dest_file_name[strlen(dest_path) + 1];
+
+    unsigned int parent_inode;
+    unsigned int dest_inode;
+
+    struct ext2_inode *dest_ino;
+
+    /* Get the name of the source file */
+    char src_copy[strlen(src_path) + 1];
+    memcpy(src_copy, src_path, strlen(src_path));
+    src_copy[strlen(src_path)] = '\0';
+    src_file_name = basename(src_copy);
+
+    char dest_copy[strlen(dest_path) + 1];
+    dest_inode = get_inode_at_path(fs, dest_path);
+
+    if (dest_inode) {
+
+        if (HAS_TRAILING_SLASH(dest_path) && !is_dir(fs, dest_inode)) {
+            fprintf(stderr,
+                "ERROR: Destination with trailing slash is not a directory\n");
+            return ENOENT;
+        }
+
+        dest_ino = get_inode(fs, dest_inode);
+
+        switch (TYPE_MASK(dest_ino->i_mode)) {
+            case EXT2_S_IFLNK:
+                /* If the destination path is a link we exit with an error */
+                fprintf(stderr, "ERROR: Destination path is a symlink\n");
+                return -1;
+
+            case EXT2_S_IFDIR:
+                /* If the destination path is a directory, then it is the parent
+                 * directory of our desired link location, and we need to ensure
+                 * that it does not already include an entry with the source
+                 * file's name */
+                parent_inode = dest_inode;
+                memcpy(dest_file_name, src_file_name, strlen(src_file_name));
+                dest_file_name[strlen(src_file_name)] = '\0';
+
+                if (find_entry(fs, parent_inode, dest_file_name)) {
+                    fprintf(stderr,
+                        "ERROR: File name already exists in destination directory\n");
+                    return EEXIST;
+                }
+                break;
+
+            default:
+                /* If the destination path is an existing file, return EEXIST */
+                fprintf(stderr, "ERROR: Destination file already exists\n");
+                return EEXIST;
+        }
+
+    } else {
+        /* In this case, the destination directory of our copied file is the parent
+         * directory of the given destination path, if it exists */
+        char parent_dir[strlen(dest_path) + 1];
+
+        memcpy(parent_dir, dest_path, strlen(dest_path));
+        parent_dir[strlen(dest_path)] = '\0';
+        memcpy(parent_dir, dirname(parent_dir), strlen(parent_dir));
+        parent_dir[strlen(parent_dir)] = '\0';
+
+        parent_inode = get_inode_at_path(fs, parent_dir);
+        if (!parent_inode) {
+            fprintf(stderr,
+                "ERROR: Parent directory for destination path is invalid\n");
+            return ENOENT;
+        }
+
+        /* A trailing slash in the dest_path is not allowed, since it implies
+         * that the source file is a directory */
+        if (HAS_TRAILING_SLASH(dest_path)) {
+            fprintf(stderr,
+                "ERROR: Destination file to create cannot be a directory\n");
+            return ENOENT;
+        }
+
+        /* The destination file name in this case is the final segment of the
+         * destination path */
+        memcpy(dest_copy, dest_path, strlen(dest_path));
+        dest_copy[strlen(dest_path)] = '\0';
+        base_copy = basename(dest_copy);
+        memcpy(dest_file_name, base_copy, strlen(base_copy));
+        dest_file_name[strlen(base_copy)] = '\0';
+
+        /* Ensure that the file name isn't already taken */
+        if (find_entry(fs, parent_inode, dest_file_name)) {
+            fprintf(stderr,
+                "ERROR: File name already exists in destination directory\n");
+            return EEXIST;
+        }
+    }
+
+    if (strlen(dest_file_name) > EXT2_NAME_LEN) {
+        fprintf(stderr, "ERROR: Destination file name too long\n");
+        return ENAMETOOLONG;
+    }
+
+    /* Get size of source file */
+    struct stat st;
+    if (fstat(src_fd, &st) < 0) {
+        fprintf(stderr, "ERROR: Failed to stat source file\n");
+        return -1;
+    }
+    off_t src_size = st.st_size;
+    unsigned long long src_blocks = (src_size + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+
+    /* Holes in the source are not allocated, so only the blocks the source
+     * actually occupies count against the free space */
+    unsigned long long data_blocks = ((unsigned long long) st.st_blocks * 512 +
+        EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+    if (data_blocks > src_blocks)
+        data_blocks = src_blocks;
+
+    /* Ensure that the source file can be represented by an inode, i.e. that
+     * its contents fit in the 12 standard direct blocks plus the blocks
+     * accessible through the single, double and triple indirect blocks */
+    if (src_blocks > MAX_FILE_BLOCKS) {
+        fprintf(stderr, "Source file too large to copy\n");
+        return EFBIG;
+    }
+
+    /* Ensure that source file is not too large for our filesystem, i.e. if its allocated
+     * contents, along with the indirect blocks needed to map them, cannot fit in the
+     * remaining free blocks on the system. */
+    if (get_blocks_needed(data_blocks) > get_super_block(fs)->s_free_blocks_count) {
+        fprintf(stderr, "Source file too large to copy\n");
+        return ENOSPC;
+    }
+
+    /* If none of the above error cases apply, we can safely allocate a new inode for
+     * the destination file */
+    dest_inode = allocate_inode(fs, parent_inode, EXT2_FT_REG_FILE);
+    if (!dest_inode) {
+        fprintf(stderr, "ERROR: No free inodes left\n");
+        return ENOSPC;
+    }
+
+    /* Create directory entry for the destination file and stream the source
+     * file's contents into its inode */
+    switch (create_entry(fs, parent_inode, dest_inode, dest_file_name, EXT2_FT_REG_FILE)) {
+        case 0:
+            break;
+        case EEXIST:
+            fprintf(stderr, "ERROR: File name already exists in destination directory\n");
+            return EEXIST;
+        case ENOENT:
+            fprintf(stderr, "ERROR: Parent directory for destination path is invalid\n");
+            return ENOENT;
+        default:
+            fprintf(stderr, "ERROR: No space left for destination file\n");
+            return ENOSPC;
+    }
+
+    dest_ino = get_inode(fs, dest_inode);
+    set_file_size(fs, dest_ino, src_size);
+    struct ext2_source src = { read_from_file, skip_file_hole, &src_fd };
+
+    /* Never leave a half-copied file behind */
+    if (write_to_inode(fs, dest_inode, &src, data_blocks) < 0) {
+        fprintf(stderr, "ERROR: Failed to copy source file contents\n");
+        remove_entry(fs, parent_inode, dest_file_name);
+        return EIO;
+    }
+
+    return 0;
+}
+
+/*
+ * Create a link at dest_path to the file at src_path, a symbolic one if
+ * is_symlink is set and a hard one otherwise, as ext2_ln does.
+ */
+int cmd_ln (struct ext2_fs *fs, char *src_path, char *dest_path, int is_symlink)
+{
+    char *link_name;
+    char parent_dir[strlen(dest_path) + 1];
+    char dest_copy[strlen(dest_path) + 1];
+
+    unsigned int src_inode;
+    unsigned int parent_inode;
+    unsigned int dest_inode;
+    struct ext2_inode *dest_ino;
+    int ret_val;
+
+    src_inode = get_inode_at_path(fs, src_path);
+
+    /* Ensure that the file we are linking to exists and is in fact a file */
+    if (!src_inode) {
+        fprintf(stderr, "ERROR: Source file %s does not exist\n", src_path);
+        return ENOENT;
+    } else if (is_dir(fs, src_inode)) {
+        fprintf(stderr, "ERROR: Source file %s is a directory\n", src_path);
+        return EISDIR;
+    }
+
+    /* A trailing slash in the dest_path is not allowed, since it implies
+     * that the source file is a directory */
+    if (HAS_TRAILING_SLASH(dest_path)) {
+        fprintf(stderr, "ERROR: Link cannot be a directory\n");
+        return ENOENT;
+    }
+
+    memcpy(parent_dir, dest_path, strlen(dest_path));
+    parent_dir[strlen(dest_path)] = '\0';
+    memcpy(parent_dir, dirname(parent_dir), strlen(parent_dir));
+    parent_dir[strlen(parent_dir)] = '\0';
+
+    /* Ensure that the parent directory exists */
+    parent_inode = get_inode_at_path(fs, parent_dir);
+    if (!parent_inode) {
+        fprintf(stderr, "ERROR: Parent directory %s for destination path is invalid\n",
+            parent_dir);
+        return ENOENT;
+    }
+
+    memcpy(dest_copy, dest_path, strlen(dest_path));
+    dest_copy[strlen(dest_path)] = '\0';
+    link_name = basename(dest_copy);
+
+    /* Ensure that the link name is not too long and does not already exist */
+    if (strlen(link_name) > EXT2_NAME_LEN) {
+        fprintf(stderr, "ERROR: Link name too long\n");
+        return ENAMETOOLONG;
+    }
+
+    if (find_entry(fs, parent_inode, link_name)) {
+        fprintf(stderr, "ERROR: Link name already exists\n");
+        return EEXIST;
+    }
+
+    if (!is_symlink) {
+        /* For hard links, we simply create a new entry, since the inode
+         * already exists */
+        ret_val = create_entry(fs, parent_inode, src_inode, link_name, EXT2_FT_REG_FILE);
+    } else {
+        /* For symlinks, we do need to allocate a new inode, since it is
+         * considered a new file */
+        dest_inode = allocate_inode(fs, parent_inode, EXT2_FT_SYMLINK);
+        if (!dest_inode) {
+            fprintf(stderr, "ERROR: No free inodes left\n");
+            return ENOSPC;
+        }
+
+        ret_val = create_entry(fs, parent_inode, dest_inode, link_name, EXT2_FT_SYMLINK);
+    }
+
+    /* Another thread may have taken the name, or removed the source or the
+     * parent, in the meantime */
+    if (ret_val == EEXIST) {
+        fprintf(stderr, "ERROR: Link name already exists\n");
+        return EEXIST;
+    } else if (ret_val == ENOENT) {
+        fprintf(stderr, "ERROR: Source file or destination directory was removed\n");
+        return ENOENT;
+    } else if (ret_val) {
+        fprintf(stderr, "ERROR: No space left for link\n");
+        return ENOSPC;
+    }
+
+    if (is_symlink) {
+        /* A symlink simply contains the path to the file it is linking to,
+         * so the size of the symlink is simply the length of this path */
+        dest_ino = get_inode(fs, dest_inode);
+        dest_ino->i_size = strlen(src_path);
+
+        struct buffer_source buffer = { src_path, strlen(src_path), 0 };
+        struct ext2_source src = { read_from_buffer, NULL, &buffer };
+
+        /* Never leave a symlink without its target behind */
+        if (write_to_inode(fs, dest_inode, &src,
+                (buffer.len + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE) < 0) {
+            fprintf(stderr, "ERROR: No space left for symlink\n");
+            remove_entry(fs, parent_inode, link_name);
+            return ENOSPC;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Remove the file or link at target_path, or the directory there along with
+ * everything in it if is_recursive is set, as ext2_rm and ext2_rm_bonus do.
+ */
+int cmd_rm (struct ext2_fs *fs, char *target_path, int is_recursive)
+{
+    char *target_name;
+    char parent_dir[strlen(target_path) + 1];
+    char path_copy[strlen(target_path) + 1];
+
+    unsigned int target_inode;
+    unsigned int parent_inode;
+
+    /* Ensure that target entry exists and is a file */
+    target_inode = get_inode_at_path(fs, target_path);
+    if (!target_inode) {
+        fprintf(stderr, "ERROR: Target file does not exist\n");
+        return ENOENT;
+    }
+
+    /* If the recursive flag has not been entered and the target is a
+     * directory, return EISDIR */
+    if (!is_recursive && is_dir(fs, target_inode)) {
+        fprintf(stderr, "ERROR: Target is a directory\n");
+        return EISDIR;
+    }
+
+    /* Get inode of parent directory */
+    memcpy(parent_dir, target_path, strlen(target_path));
+    parent_dir[strlen(target_path)] = '\0';
+    memcpy(parent_dir, dirname(parent_dir), strlen(parent_dir));
+    parent_dir[strlen(parent_dir)] = '\0';
+
+    parent_inode = get_inode_at_path(fs, parent_dir);
+
+    /* Get filename of target entry */
+    memcpy(path_copy, target_path, strlen(target_path));
+    path_copy[strlen(target_path)] = '\0';
+    target_name = basename(path_copy);
+
+    /* Another thread may have removed it in the meantime */
+    if (remove_entry(fs, parent_inode, target_name)) {
+        fprintf(stderr, "ERROR: Target file does not exist\n");
+        return ENOENT;
+    }
+
+    return 0;
+}
+
+/*
+ * Restore the previously removed file or link at target_path, or the
+ * directory there along with as much of its contents as possible if
+ * is_recursive is set, as ext2_restore and ext2_restore_bonus do.
+ */
+int cmd_restore (struct ext2_fs *fs, char *target_path, int is_recursive)
+{
+    int ret_val;
+
+    char *target_name;
+    char parent_dir[strlen(target_path) + 1];
+    char path_copy[strlen(target_path) + 1];
+
+    unsigned int parent_inode;
+    unsigned int target_inode;
+
+    /* Ensure that the parent directory exists */
+    memcpy(parent_dir, target_path, strlen(target_path));
+    parent_dir[strlen(target_path)] = '\0';
+    memcpy(parent_dir, dirname(parent_dir), strlen(parent_dir));
+    parent_dir[strlen(parent_dir)] = '\0';
+
+    parent_inode = get_inode_at_path(fs, parent_dir);
+    if (!parent_inode || !is_dir(fs, parent_inode)) {
+        fprintf(stderr, "ERROR: Invalid parent directory\n");
+        return ENOENT;
+    }
+
+    /* Ensure that the requested entry is in fact a previously removed
+     * (using ext2_rm) entry in the parent directory, and is not itself
+     * a directory */
+    memcpy(path_copy, target_path, strlen(target_path));
+    path_copy[strlen(target_path)] = '\0';
+    target_name = basename(path_copy);
+
+    target_inode = find_removed_entry(fs, parent_inode, target_name);
+
+    /* If the target entry is not found, we cannot continue and immediately
+     * return ENOENT */
+    if (!target_inode) {
+        fprintf(stderr, "ERROR: Target entry not found\n");
+        return ENOENT;
+    }
+
+    /* If the recursive flag has not been entered and the target is a
+     * directory, return EISDIR */
+    if (!is_recursive && is_dir(fs, target_inode)) {
+        fprintf(stderr, "ERROR: Target entry is a directory\n");
+        return EISDIR;
+    }
+
+    ret_val = is_recoverable(fs, target_inode, TRUE);
+
+    if (ret_val < 0) {
+        /* In this case, the entry is a directory that itself can be restored
+         * but not all of its entries can, so we will still exit with ENOENT
+         * but first we will attempt to restore it and as many of its entries
+         * as possible. */
+        fprintf(stderr, "ERROR: Target directory only partially restored\n");
+        ret_val = ENOENT;
+    } else if (!ret_val) {
+        /* In this case, the entry is not recoverable at all, so we
+         * immediately return ENOENT. */
+        fprintf(stderr, "ERROR: Target entry could not be restored\n");
+        return ENOENT;
+    } else {
+        /* Otherwise, we know the entry is fully recoverable, so we will
+         * exit with 0. */
+        ret_val = 0;
+    }
+
+    restore_entry(fs, parent_inode, target_name);
+
+    return ret_val;
+}
+
+/*
+ * Compact the directory at target_path, and every directory below it if
+ * is_recursive is set, as ext2_compact_dir does.
+ */
+int cmd_compact_dir (struct ext2_fs *fs, char *target_path, int is_recursive)
+{
+    unsigned int target_inode;
+    int num_freed;
+
+    /* Ensure that the target exists and is a directory */
+    target_inode = get_inode_at_path(fs, target_path);
+    if (!target_inode) {
+        fprintf(stderr, "ERROR: Target directory does not exist\n");
+        return ENOENT;
+    }
+
+    if (!is_dir(fs, target_inode)) {
+        fprintf(stderr, "ERROR: Target is not a directory\n");
+        return ENOTDIR;
+    }
+
+    num_freed = compact_dir(fs, target_inode, is_recursive);
+    if (num_freed < 0) {
+        fprintf(stderr, "ERROR: Not enough memory to compact the directory\n");
+        return ENOMEM;
+    }
+
+    printf("%d directory blocks freed\n", num_freed);
+    return 0;
+}
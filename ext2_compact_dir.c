@@ -0,0 +1,26 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "ext2_utils.h"
+
+int main (int argc, char **argv) 
+{
+    if (argc < 3 || argc > 4 || (argc == 4 && strcmp(argv[3], "-r"))) {
+        fprintf(stderr, 
+            "Usage: %s <image file path> <absolute path on disk image> [-r]\n", 
+            argv[0]);
+        exit(1);
+    }
+
+    struct ext2_fs *fs = open_disk(argv[1]);
+    if (!fs)
+        exit(1);
+
+    int ret_val;
+    ret_val = cmd_compact_dir(fs, argv[2], argc == 4);
+
+    if (close_disk(fs) < 0 && !ret_val)
+        ret_val = EIO;
+    return ret_val;
+}
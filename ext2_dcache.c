@@ -0,0 +1,228 @@
+#include <stdlib.h>
+#include <string.h>
+#include "ext2_utils.h"
+
+/* A cached result of looking up a name in a directory. An inode of 0 means
+ * the directory is known to have no entry with that name. The dentries of
+ * an image are kept in a hash table in its handle, chained through next, see
+ * dcache_lookup(). */
+struct dentry
+{
+    unsigned int parent_inode;
+    unsigned int inode;
+    unsigned int hash;
+    unsigned char name_len;
+    struct dentry *next;
+    char name[];
+};
+
+/*
+ * Return the hash of the name_len character name in the given directory.
+ */
+static unsigned int dcache_hash (unsigned int parent_inode, const char *name, int name_len)
+{
+    unsigned int hash = 2166136261U ^ parent_inode;
+    int k;
+
+    /* FNV-1a */
+    for (k = 0; k < name_len; k++) {
+        hash ^= (unsigned char) name[k];
+        hash *= 16777619U;
+    }
+
+    return hash;
+}
+
+/*
+ * Return a pointer to the link that points to the dentry for the name_len
+ * character name in the given directory, or to the NULL link at the end of
+ * its bucket if there is none.
+ */
+static struct dentry **dcache_find (struct ext2_fs *fs, unsigned int parent_inode,
+        const char *name, int name_len, unsigned int hash)
+{
+    struct dentry **link = &fs->dcache_buckets[hash & (fs->dcache_num_buckets - 1)];
+
+    for (; *link; link = &(*link)->next) {
+        if ((*link)->hash == hash && (*link)->parent_inode == parent_inode &&
+                (*link)->name_len == name_len && !memcmp((*link)->name, name, name_len))
+            break;
+    }
+
+    return link;
+}
+
+/*
+ * Take the dentry pointed to by link out of the cache and free it.
+ */
+static void dcache_remove (struct ext2_fs *fs, struct dentry **link)
+{
+    struct dentry *dentry = *link;
+
+    *link = dentry->next;
+    free(dentry);
+    fs->dcache_num_entries--;
+}
+
+/*
+ * Double the number of buckets once the chains get long, so lookups stay
+ * constant time however many names a process resolves. Return 0 on
+ * success, or -1 if memory is short, in which case the table is unchanged.
+ */
+static int dcache_grow (struct ext2_fs *fs)
+{
+    unsigned int num_buckets = (fs->dcache_num_buckets) ? fs->dcache_num_buckets * 2 :
+        DCACHE_INITIAL_BUCKETS;
+    struct dentry **buckets = calloc(num_buckets, sizeof(struct dentry *));
+    struct dentry *dentry;
+    unsigned int k;
+
+    if (!buckets)
+        return -1;
+
+    for (k = 0; k < fs->dcache_num_buckets; k++) {
+        while ((dentry = fs->dcache_buckets[k])) {
+            fs->dcache_buckets[k] = dentry->next;
+            dentry->next = buckets[dentry->hash & (num_buckets - 1)];
+            buckets[dentry->hash & (num_buckets - 1)] = dentry;
+        }
+    }
+
+    free(fs->dcache_buckets);
+    fs->dcache_buckets = buckets;
+    fs->dcache_num_buckets = num_buckets;
+    return 0;
+}
+
+/*
+ * Look up the name_len character name in the directory referred to by
+ * parent_inode. Return 1 and store the entry's inode number (0 if there is
+ * no such entry) in inode if the answer is cached. Otherwise, return 0.
+ * Like the other dcache functions, this may be called from any thread.
+ */
+int dcache_lookup (struct ext2_fs *fs, unsigned int parent_inode, const char *name,
+        int name_len, unsigned int *inode)
+{
+    unsigned int hash = dcache_hash(parent_inode, name, name_len);
+    struct dentry *dentry = NULL;
+
+    pthread_mutex_lock(&fs->dcache_lock);
+    if (fs->dcache_num_entries)
+        dentry = *dcache_find(fs, parent_inode, name, name_len, hash);
+    if (dentry)
+        *inode = dentry->inode;
+    pthread_mutex_unlock(&fs->dcache_lock);
+
+    return dentry != NULL;
+}
+
+/*
+ * Record that the name_len character name in the directory referred to by
+ * parent_inode refers to the given inode (or to nothing, if inode is 0),
+ * replacing whatever was cached for it before. The cache is only an aid, so
+ * if memory is short the name is simply left uncached.
+ */
+void dcache_insert (struct ext2_fs *fs, unsigned int parent_inode, const char *name,
+        int name_len, unsigned int inode)
+{
+    unsigned int hash = dcache_hash(parent_inode, name, name_len);
+    struct dentry **link;
+    struct dentry *dentry;
+
+    pthread_mutex_lock(&fs->dcache_lock);
+    if (fs->dcache_num_entries >= fs->dcache_num_buckets * DCACHE_MAX_CHAIN && dcache_grow(fs) < 0) {
+        link = dcache_find(fs, parent_inode, name, name_len, hash);
+        if (*link)
+            dcache_remove(fs, link);
+        pthread_mutex_unlock(&fs->dcache_lock);
+        return;
+    }
+
+    link = dcache_find(fs, parent_inode, name, name_len, hash);
+    if (*link) {
+        (*link)->inode = inode;
+        pthread_mutex_unlock(&fs->dcache_lock);
+        return;
+    }
+
+    if (!(dentry = malloc(sizeof(struct dentry) + name_len))) {
+        pthread_mutex_unlock(&fs->dcache_lock);
+        return;
+    }
+
+    dentry->parent_inode = parent_inode;
+    dentry->inode = inode;
+    dentry->hash = hash;
+    dentry->name_len = name_len;
+    dentry->next = NULL;
+    memcpy(dentry->name, name, name_len);
+
+    *link = dentry;
+    fs->dcache_num_entries++;
+    pthread_mutex_unlock(&fs->dcache_lock);
+}
+
+/*
+ * Forget whatever is cached for the name_len character name in the
+ * directory referred to by parent_inode.
+ */
+void dcache_invalidate (struct ext2_fs *fs, unsigned int parent_inode, const char *name,
+        int name_len)
+{
+    unsigned int hash = dcache_hash(parent_inode, name, name_len);
+    struct dentry **link;
+
+    pthread_mutex_lock(&fs->dcache_lock);
+    if (fs->dcache_num_entries) {
+        link = dcache_find(fs, parent_inode, name, name_len, hash);
+        if (*link)
+            dcache_remove(fs, link);
+    }
+    pthread_mutex_unlock(&fs->dcache_lock);
+}
+
+/*
+ * Forget everything cached for names in the directory referred to by
+ * dir_inode, which is being freed, so its inode number can be reused.
+ */
+void dcache_purge_dir (struct ext2_fs *fs, unsigned int dir_inode)
+{
+    struct dentry **link;
+    struct dentry *dentry;
+    unsigned int k;
+
+    pthread_mutex_lock(&fs->dcache_lock);
+    for (k = 0; k < fs->dcache_num_buckets && fs->dcache_num_entries; k++) {
+        link = &fs->dcache_buckets[k];
+
+        while ((dentry = *link)) {
+            if (dentry->parent_inode == dir_inode)
+                dcache_remove(fs, link);
+            else
+                link = &dentry->next;
+        }
+    }
+    pthread_mutex_unlock(&fs->dcache_lock);
+}
+
+/*
+ * Free every dentry cached for the image referred to by fs, which is being
+ * closed.
+ */
+void dcache_destroy (struct ext2_fs *fs)
+{
+    struct dentry *dentry;
+    unsigned int k;
+
+    for (k = 0; k < fs->dcache_num_buckets; k++) {
+        while ((dentry = fs->dcache_buckets[k])) {
+            fs->dcache_buckets[k] = dentry->next;
+            free(dentry);
+        }
+    }
+
+    free(fs->dcache_buckets);
+    fs->dcache_buckets = NULL;
+    fs->dcache_num_buckets = 0;
+    fs->dcache_num_entries = 0;
+}
@@ -0,0 +1,228 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "ext2_utils.h"
+
+/*
+ * The dirty log of an image is kept in a file next to it, named after the
+ * image with DIRTY_LOG_SUFFIX appended. While that file exists, every
+ * change made through the library appends the inodes and blocks it touched
+ * to it, one per line: "i <inode>" for an inode and "b <first> <count>" for
+ * a run of blocks. Lines are gathered in the handle's buffer and written
+ * when it fills up, and when the image is closed. If the file does not
+ * exist, nothing is logged.
+ */
+
+/*
+ * Open the dirty log of the image at diskpath for appending, if it has one
+ * and is_logging is set; otherwise, the log can only be read. Return 0 on 
+ * success (whether or not there is a log), or -1 (after printing why) if 
+ * memory is short or the log cannot be opened.
+ */
+int open_dirty_log (struct ext2_fs *fs, const char *diskpath, int is_logging)
+{
+    fs->dirty_log_fd = -1;
+    fs->dirty_log_len = 0;
+
+    fs->dirty_log_path = malloc(strlen(diskpath) + strlen(DIRTY_LOG_SUFFIX) + 1);
+    if (!fs->dirty_log_path) {
+        perror("malloc");
+        return -1;
+    }
+    strcpy(fs->dirty_log_path, diskpath);
+    strcat(fs->dirty_log_path, DIRTY_LOG_SUFFIX);
+
+    if (pthread_mutex_init(&fs->dirty_log_lock, NULL)) {
+        fprintf(stderr, "ERROR: Failed to set up the dirty log lock\n");
+        free(fs->dirty_log_path);
+        return -1;
+    }
+
+    if (!is_logging)
+        return 0;
+
+    fs->dirty_log_fd = open(fs->dirty_log_path, O_WRONLY | O_APPEND);
+    if (fs->dirty_log_fd < 0 && errno != ENOENT) {
+        perror(fs->dirty_log_path);
+        pthread_mutex_destroy(&fs->dirty_log_lock);
+        free(fs->dirty_log_path);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Write out the lines gathered in the handle's buffer. The dirty log's lock
+ * must be held. If the log cannot be written to, logging stops, as the log
+ * can no longer be trusted to be complete; the next full check starts it
+ * over.
+ */
+static void write_dirty_log (struct ext2_fs *fs)
+{
+    size_t written = 0;
+    ssize_t ret_val;
+
+    while (fs->dirty_log_fd >= 0 && written < fs->dirty_log_len) {
+        ret_val = write(fs->dirty_log_fd, fs->dirty_log_buf + written,
+            fs->dirty_log_len - written);
+        if (ret_val < 0 && errno == EINTR)
+            continue;
+
+        if (ret_val <= 0) {
+            perror(fs->dirty_log_path);
+            close(fs->dirty_log_fd);
+            fs->dirty_log_fd = -1;
+            unlink(fs->dirty_log_path);
+            break;
+        }
+        written += ret_val;
+    }
+
+    fs->dirty_log_len = 0;
+}
+
+/*
+ * Add the given line to the dirty log, if the image has one.
+ */
+static void append_dirty_log (struct ext2_fs *fs, const char *line, int len)
+{
+    pthread_mutex_lock(&fs->dirty_log_lock);
+    if (fs->dirty_log_fd >= 0) {
+        if (fs->dirty_log_len + len > DIRTY_LOG_BUF_SIZE)
+            write_dirty_log(fs);
+        memcpy(fs->dirty_log_buf + fs->dirty_log_len, line, len);
+        fs->dirty_log_len += len;
+    }
+    pthread_mutex_unlock(&fs->dirty_log_lock);
+}
+
+/*
+ * Record in the dirty log that the given inode was touched.
+ */
+void log_dirty_inode (struct ext2_fs *fs, unsigned int inode)
+{
+    char line[32];
+
+    if (fs->dirty_log_fd < 0)
+        return;
+    append_dirty_log(fs, line, snprintf(line, sizeof(line), "i %u\n", inode));
+}
+
+/*
+ * Record in the dirty log that the count blocks from first were touched.
+ */
+void log_dirty_blocks (struct ext2_fs *fs, unsigned int first, unsigned int count)
+{
+    char line[32];
+
+    if (fs->dirty_log_fd < 0 || !count)
+        return;
+    append_dirty_log(fs, line, snprintf(line, sizeof(line), "b %u %u\n", first, count));
+}
+
+/*
+ * Write out any lines still in the handle's buffer and close the dirty log.
+ */
+void close_dirty_log (struct ext2_fs *fs)
+{
+    pthread_mutex_lock(&fs->dirty_log_lock);
+    write_dirty_log(fs);
+    if (fs->dirty_log_fd >= 0)
+        close(fs->dirty_log_fd);
+    fs->dirty_log_fd = -1;
+    pthread_mutex_unlock(&fs->dirty_log_lock);
+
+    pthread_mutex_destroy(&fs->dirty_log_lock);
+    free(fs->dirty_log_path);
+}
+
+/*
+ * Empty the dirty log, dropping anything not yet written out, once the
+ * image has been checked. If the image has no log, one is created if
+ * is_create is set, so that changes are logged from now on. Return 0 on
+ * success, or -1 (after printing why) on failure.
+ */
+int reset_dirty_log (struct ext2_fs *fs, int is_create)
+{
+    int ret_val = 0;
+
+    pthread_mutex_lock(&fs->dirty_log_lock);
+    fs->dirty_log_len = 0;
+
+    if (fs->dirty_log_fd >= 0) {
+        ret_val = ftruncate(fs->dirty_log_fd, 0);
+    } else if (is_create) {
+        fs->dirty_log_fd = open(fs->dirty_log_path, O_WRONLY | O_APPEND | O_CREAT | O_TRUNC,
+            0644);
+        ret_val = (fs->dirty_log_fd < 0) ? -1 : 0;
+    }
+
+    if (ret_val < 0)
+        perror(fs->dirty_log_path);
+    pthread_mutex_unlock(&fs->dirty_log_lock);
+    return ret_val;
+}
+
+/*
+ * Read the image's dirty log into log, whose arrays are to be freed with
+ * free_dirty_log(). The inodes and block runs are listed in the order they
+ * were logged, and may repeat. Return 0 on success, or -1 if there is no
+ * log (with errno set to ENOENT), it cannot be read or memory is short.
+ */
+int read_dirty_log (struct ext2_fs *fs, struct dirty_log *log)
+{
+    unsigned long inodes_capacity = 0, ranges_capacity = 0;
+    unsigned int first, count;
+    void *grown;
+    char line[64];
+    FILE *file;
+
+    memset(log, 0, sizeof(struct dirty_log));
+    if (!(file = fopen(fs->dirty_log_path, "r")))
+        return -1;
+
+    while (fgets(line, sizeof(line), file)) {
+        if (sscanf(line, "i %u", &first) == 1) {
+            if (log->num_inodes == inodes_capacity) {
+                inodes_capacity = (inodes_capacity) ? inodes_capacity * 2 : 256;
+                if (!(grown = realloc(log->inodes, inodes_capacity * sizeof(unsigned int))))
+                    goto fail;
+                log->inodes = grown;
+            }
+            log->inodes[log->num_inodes++] = first;
+        } else if (sscanf(line, "b %u %u", &first, &count) == 2) {
+            if (log->num_ranges == ranges_capacity) {
+                ranges_capacity = (ranges_capacity) ? ranges_capacity * 2 : 256;
+                if (!(grown = realloc(log->ranges, ranges_capacity * sizeof(struct dirty_range))))
+                    goto fail;
+                log->ranges = grown;
+            }
+            log->ranges[log->num_ranges].first = first;
+            log->ranges[log->num_ranges].count = count;
+            log->num_ranges++;
+        }
+    }
+
+    fclose(file);
+    return 0;
+
+fail:
+    fclose(file);
+    free_dirty_log(log);
+    errno = ENOMEM;
+    return -1;
+}
+
+/*
+ * Free the arrays filled in by read_dirty_log().
+ */
+void free_dirty_log (struct dirty_log *log)
+{
+    free(log->inodes);
+    free(log->ranges);
+    memset(log, 0, sizeof(struct dirty_log));
+}
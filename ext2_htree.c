@@ -0,0 +1,751 @@
+#include <string.h>
+#include <stdlib.h>
+#include "ext2_utils.h"
+
+/* Offsets of the index within root and interior index blocks */
+#define DX_ROOT_INFO_OFFSET 24
+#define DX_ROOT_ENTRIES_OFFSET (DX_ROOT_INFO_OFFSET + sizeof(struct dx_root_info))
+#define DX_NODE_ENTRIES_OFFSET 8
+#define DX_ROOT_LIMIT ((EXT2_BLOCK_SIZE - DX_ROOT_ENTRIES_OFFSET) / sizeof(struct dx_entry))
+#define DX_NODE_LIMIT ((EXT2_BLOCK_SIZE - DX_NODE_ENTRIES_OFFSET) / sizeof(struct dx_entry))
+
+#define DX_COUNT_LIMIT(ENTRIES) ((struct dx_countlimit *) (ENTRIES))
+#define DX_HASH_CONTINUED 1
+
+#define TEA_DELTA 0x9E3779B9
+#define MD4_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define MD4_G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define MD4_H(x, y, z) ((x) ^ (y) ^ (z))
+#define MD4_ROUND(f, a, b, c, d, x, s) \
+    (a += f(b, c, d) + (x), a = (a << (s)) | (a >> (32 - (s))))
+#define MD4_K1 0
+#define MD4_K2 013240474631U
+#define MD4_K3 015666365641U
+
+/* A directory entry that is being moved during a leaf split */
+struct dx_map_entry
+{
+    unsigned int hash;
+    struct ext2_dir_entry *entry;
+};
+
+/*
+ * The legacy hash of the first len characters of name.
+ */
+static unsigned int dx_hack_hash (const char *name, int len, int is_unsigned)
+{
+    unsigned int hash;
+    unsigned int hash0 = 0x12A3FE2D;
+    unsigned int hash1 = 0x37ABE8F9;
+    int c;
+
+    while (len--) {
+        c = (is_unsigned) ? (int) (unsigned char) *name : (int) (signed char) *name;
+        name++;
+
+        hash = hash1 + (hash0 ^ (c * 7152373));
+        if (hash & 0x80000000)
+            hash -= 0x7FFFFFFF;
+        hash1 = hash0;
+        hash0 = hash;
+    }
+
+    return hash0 << 1;
+}
+
+/*
+ * Pack up to num * 4 characters of the len character string msg into the
+ * num words of buf, padding with a value derived from len.
+ */
+static void str2hashbuf (const char *msg, int len, unsigned int *buf, int num,
+        int is_unsigned)
+{
+    unsigned int pad = (unsigned int) len | ((unsigned int) len << 8);
+    unsigned int val;
+    int i;
+    int c;
+
+    pad |= pad << 16;
+    val = pad;
+
+    if (len > num * 4)
+        len = num * 4;
+
+    for (i = 0; i < len; i++) {
+        c = (is_unsigned) ? (int) (unsigned char) msg[i] : (int) (signed char) msg[i];
+        val = c + (val << 8);
+
+        if ((i % 4) == 3) {
+            *buf++ = val;
+            val = pad;
+            num--;
+        }
+    }
+
+    if (--num >= 0)
+        *buf++ = val;
+    while (--num >= 0)
+        *buf++ = pad;
+}
+
+/*
+ * Mix the 8 words of in into buf, as done by the half MD4 hash.
+ */
+static void half_md4_transform (unsigned int buf[4], const unsigned int in[8])
+{
+    unsigned int a = buf[0];
+    unsigned int b = buf[1];
+    unsigned int c = buf[2];
+    unsigned int d = buf[3];
+
+    MD4_ROUND(MD4_F, a, b, c, d, in[0] + MD4_K1, 3);
+    MD4_ROUND(MD4_F, d, a, b, c, in[1] + MD4_K1, 7);
+    MD4_ROUND(MD4_F, c, d, a, b, in[2] + MD4_K1, 11);
+    MD4_ROUND(MD4_F, b, c, d, a, in[3] + MD4_K1, 19);
+    MD4_ROUND(MD4_F, a, b, c, d, in[4] + MD4_K1, 3);
+    MD4_ROUND(MD4_F, d, a, b, c, in[5] + MD4_K1, 7);
+    MD4_ROUND(MD4_F, c, d, a, b, in[6] + MD4_K1, 11);
+    MD4_ROUND(MD4_F, b, c, d, a, in[7] + MD4_K1, 19);
+
+    MD4_ROUND(MD4_G, a, b, c, d, in[1] + MD4_K2, 3);
+    MD4_ROUND(MD4_G, d, a, b, c, in[3] + MD4_K2, 5);
+    MD4_ROUND(MD4_G, c, d, a, b, in[5] + MD4_K2, 9);
+    MD4_ROUND(MD4_G, b, c, d, a, in[7] + MD4_K2, 13);
+    MD4_ROUND(MD4_G, a, b, c, d, in[0] + MD4_K2, 3);
+    MD4_ROUND(MD4_G, d, a, b, c, in[2] + MD4_K2, 5);
+    MD4_ROUND(MD4_G, c, d, a, b, in[4] + MD4_K2, 9);
+    MD4_ROUND(MD4_G, b, c, d, a, in[6] + MD4_K2, 13);
+
+    MD4_ROUND(MD4_H, a, b, c, d, in[3] + MD4_K3, 3);
+    MD4_ROUND(MD4_H, d, a, b, c, in[7] + MD4_K3, 9);
+    MD4_ROUND(MD4_H, c, d, a, b, in[2] + MD4_K3, 11);
+    MD4_ROUND(MD4_H, b, c, d, a, in[6] + MD4_K3, 15);
+    MD4_ROUND(MD4_H, a, b, c, d, in[1] + MD4_K3, 3);
+    MD4_ROUND(MD4_H, d, a, b, c, in[5] + MD4_K3, 9);
+    MD4_ROUND(MD4_H, c, d, a, b, in[0] + MD4_K3, 11);
+    MD4_ROUND(MD4_H, b, c, d, a, in[4] + MD4_K3, 15);
+
+    buf[0] += a;
+    buf[1] += b;
+    buf[2] += c;
+    buf[3] += d;
+}
+
+/*
+ * Mix the 4 words of in into the first two words of buf, as done by the TEA
+ * hash.
+ */
+static void tea_transform (unsigned int buf[4], const unsigned int in[4])
+{
+    unsigned int sum = 0;
+    unsigned int b0 = buf[0];
+    unsigned int b1 = buf[1];
+    int n = 16;
+
+    do {
+        sum += TEA_DELTA;
+        b0 += ((b1 << 4) + in[0]) ^ (b1 + sum) ^ ((b1 >> 5) + in[1]);
+        b1 += ((b0 << 4) + in[2]) ^ (b0 + sum) ^ ((b0 >> 5) + in[3]);
+    } while (--n);
+
+    buf[0] += b0;
+    buf[1] += b1;
+}
+
+/*
+ * Return the hash of the first len characters of name under the given hash
+ * version (one of EXT2_HASH_*), seeded with the 4 words of seed unless they
+ * are all zero. The low bit of the hash is always clear, since the index
+ * uses it to mark hash collisions that span leaf blocks.
+ */
+unsigned int dx_hash (const char *name, int len, int version, const unsigned int *seed)
+{
+    unsigned int buf[4] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476 };
+    unsigned int in[8];
+    unsigned int hash;
+    int is_unsigned = version >= EXT2_HASH_LEGACY_UNSIGNED;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        if (seed[i]) {
+            memcpy(buf, seed, sizeof(buf));
+            break;
+        }
+    }
+
+    switch (version) {
+        case EXT2_HASH_LEGACY:
+        case EXT2_HASH_LEGACY_UNSIGNED:
+            hash = dx_hack_hash(name, len, is_unsigned);
+            break;
+
+        case EXT2_HASH_HALF_MD4:
+        case EXT2_HASH_HALF_MD4_UNSIGNED:
+            for (; len > 0; len -= 32, name += 32) {
+                str2hashbuf(name, len, in, 8, is_unsigned);
+                half_md4_transform(buf, in);
+            }
+            hash = buf[1];
+            break;
+
+        case EXT2_HASH_TEA:
+        case EXT2_HASH_TEA_UNSIGNED:
+            for (; len > 0; len -= 16, name += 16) {
+                str2hashbuf(name, len, in, 4, is_unsigned);
+                tea_transform(buf, in);
+            }
+            hash = buf[0];
+            break;
+
+        default:
+            hash = 0;
+    }
+
+    return hash & ~DX_HASH_CONTINUED;
+}
+
+/*
+ * Return whether the file system allows directories to be indexed.
+ */
+int can_index_dirs (struct ext2_fs *fs)
+{
+    return (get_super_block(fs)->s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX) != 0;
+}
+
+/*
+ * Return whether the given directory inode has a hash index.
+ */
+int is_indexed_dir (struct ext2_fs *fs, struct ext2_inode *dir)
+{
+    return can_index_dirs(fs) && (dir->i_flags & EXT2_INDEX_FL);
+}
+
+/*
+ * Return the hash info block of the given indexed directory, or NULL if it
+ * is not in a format we understand, in which case the directory should be
+ * treated as unindexed.
+ */
+struct dx_root_info *get_dx_root_info (struct ext2_fs *fs, struct ext2_inode *dir)
+{
+    unsigned int root_block = get_block_num(fs, dir, 0);
+    struct dx_root_info *info;
+    struct dx_countlimit *countlimit;
+
+    if (!is_valid_block(fs, root_block))
+        return NULL;
+
+    info = (struct dx_root_info *) (get_block(fs, root_block) + DX_ROOT_INFO_OFFSET);
+    countlimit = DX_COUNT_LIMIT((unsigned char *) info + info->info_length);
+
+    if (info->reserved_zero || info->info_length != sizeof(struct dx_root_info) ||
+            info->hash_version > EXT2_HASH_TEA || info->indirect_levels >= DX_MAX_LEVELS ||
+            countlimit->limit != DX_ROOT_LIMIT || !countlimit->count ||
+            countlimit->count > countlimit->limit)
+        return NULL;
+
+    return info;
+}
+
+/*
+ * Return the hash of the name_len character name under the hash version used
+ * by the index of the given directory, whose hash info is info.
+ */
+unsigned int get_dx_name_hash (struct ext2_fs *fs, struct dx_root_info *info,
+        const char *name, int name_len)
+{
+    struct ext2_super_block *sb = get_super_block(fs);
+    int version = info->hash_version;
+
+    if (sb->s_flags & EXT2_FLAGS_UNSIGNED_HASH)
+        version += EXT2_HASH_LEGACY_UNSIGNED;
+
+    return dx_hash(name, name_len, version, sb->s_hash_seed);
+}
+
+/*
+ * Return the dx_entry array of the index block at the given logical block of
+ * the given directory, or NULL if it is not a valid interior index block.
+ */
+struct dx_entry *get_dx_node_entries (struct ext2_fs *fs, struct ext2_inode *dir,
+        unsigned int lblock)
+{
+    unsigned int block = get_block_num(fs, dir, lblock);
+    struct dx_entry *entries;
+
+    if (!lblock || !is_valid_block(fs, block) || lblock >= dir->i_size / EXT2_BLOCK_SIZE)
+        return NULL;
+
+    entries = (struct dx_entry *) (get_block(fs, block) + DX_NODE_ENTRIES_OFFSET);
+    if (DX_COUNT_LIMIT(entries)->limit != DX_NODE_LIMIT || !DX_COUNT_LIMIT(entries)->count ||
+            DX_COUNT_LIMIT(entries)->count > DX_NODE_LIMIT)
+        return NULL;
+
+    return entries;
+}
+
+/*
+ * Return the entry of the given dx_entry array that covers hash, i.e. the
+ * last one whose hash is at most hash, using a binary search. The first
+ * entry covers everything below the second one's hash.
+ */
+struct dx_entry *dx_search_entries (struct dx_entry *entries, unsigned int hash)
+{
+    int low = 1;
+    int high = DX_COUNT_LIMIT(entries)->count - 1;
+    int mid;
+
+    while (low <= high) {
+        mid = (low + high) / 2;
+        if (entries[mid].hash > hash)
+            high = mid - 1;
+        else
+            low = mid + 1;
+    }
+
+    return &entries[low - 1];
+}
+
+/*
+ * Walk the index of the given directory from the root down to the leaf
+ * block that covers hash, recording in frames the dx_entry array and the
+ * entry followed at each level. Return the number of levels walked, or 0 if
+ * the index is damaged.
+ */
+int dx_probe (struct ext2_fs *fs, struct ext2_inode *dir, unsigned int hash,
+        struct dx_frame *frames)
+{
+    struct dx_root_info *info = get_dx_root_info(fs, dir);
+    struct dx_entry *entries;
+    int level;
+
+    if (!info)
+        return 0;
+
+    entries = (struct dx_entry *) ((unsigned char *) info + info->info_length);
+
+    for (level = 0; ; level++) {
+        frames[level].entries = entries;
+        frames[level].at = dx_search_entries(entries, hash);
+
+        if (level == info->indirect_levels)
+            return level + 1;
+
+        entries = get_dx_node_entries(fs, dir, frames[level].at->block);
+        if (!entries)
+            return 0;
+    }
+}
+
+/*
+ * Advance frames, filled in by dx_probe(), to the next leaf block of the
+ * given directory if names with the given hash may continue into it, and
+ * return that leaf's logical block number. Otherwise, return 0.
+ */
+unsigned int dx_next_leaf (struct ext2_fs *fs, struct ext2_inode *dir,
+        struct dx_frame *frames, int num_frames, unsigned int hash)
+{
+    struct dx_entry *at = NULL;
+    int level;
+
+    /* Find the lowest level that has an entry after the current one */
+    for (level = num_frames - 1; level >= 0; level--) {
+        at = frames[level].at + 1;
+        if (at < frames[level].entries + DX_COUNT_LIMIT(frames[level].entries)->count)
+            break;
+    }
+
+    if (level < 0 || (at->hash & ~DX_HASH_CONTINUED) != hash)
+        return 0;
+
+    /* Follow the first entry of each index block below that one */
+    frames[level].at = at;
+    for (level++; level < num_frames; level++) {
+        frames[level].entries = get_dx_node_entries(fs, dir, frames[level - 1].at->block);
+        if (!frames[level].entries)
+            return 0;
+        frames[level].at = frames[level].entries;
+    }
+
+    return frames[num_frames - 1].at->block;
+}
+
+/*
+ * Return whether the given logical block of the given indexed directory
+ * holds part of its index rather than directory entries.
+ */
+int is_dx_node (struct ext2_fs *fs, struct ext2_inode *dir, unsigned int lblock)
+{
+    struct dx_root_info *info = get_dx_root_info(fs, dir);
+    struct dx_entry *entries;
+    int k;
+
+    if (!lblock)
+        return TRUE;
+    if (!info || !info->indirect_levels)
+        return FALSE;
+
+    entries = (struct dx_entry *) ((unsigned char *) info + info->info_length);
+    for (k = 0; k < DX_COUNT_LIMIT(entries)->count; k++) {
+        if (entries[k].block == lblock)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+/*
+ * Search the indexed directory referred to by parent_inode for a live entry
+ * with the given name, looking only in the leaf blocks its hash leads to.
+ * Return the entry, or NULL if there is none. If prev is not NULL, the entry
+ * preceding it in its block (or NULL if it is the first) is stored there.
+ * Return DX_BAD_INDEX if the index is damaged.
+ */
+struct ext2_dir_entry *dx_find_entry (struct ext2_fs *fs, unsigned int parent_inode,
+        const char *name, int name_len, struct ext2_dir_entry **prev)
+{
+    struct ext2_inode *dir = get_inode(fs, parent_inode);
+    struct dx_root_info *info = get_dx_root_info(fs, dir);
+    struct dx_frame frames[DX_MAX_LEVELS];
+    struct ext2_dir_entry *entry;
+
+    unsigned int hash;
+    unsigned int lblock;
+    int num_frames;
+
+    if (!info)
+        return DX_BAD_INDEX;
+
+    /* The dot entries live in the root block, outside of the hash order */
+    if (IS_DOT_NAME(name, name_len))
+        return search_dir_block(fs, get_block_num(fs, dir, 0), name, name_len, prev);
+
+    hash = get_dx_name_hash(fs, info, name, name_len);
+    num_frames = dx_probe(fs, dir, hash, frames);
+    if (!num_frames)
+        return DX_BAD_INDEX;
+
+    lblock = frames[num_frames - 1].at->block;
+    while (lblock) {
+        entry = search_dir_block(fs, get_block_num(fs, dir, lblock), name, name_len, prev);
+        if (entry)
+            return entry;
+
+        lblock = dx_next_leaf(fs, dir, frames, num_frames, hash);
+    }
+
+    return NULL;
+}
+
+/*
+ * Insert an entry pointing to the given logical block, with the given hash,
+ * after the entry at in the dx_entry array entries, which must have room.
+ */
+void dx_insert_entry (struct dx_entry *entries, struct dx_entry *at, unsigned int hash,
+        unsigned int lblock)
+{
+    struct dx_entry *end = entries + DX_COUNT_LIMIT(entries)->count;
+
+    memmove(at + 2, at + 1, (end - (at + 1)) * sizeof(struct dx_entry));
+    at[1].hash = hash;
+    at[1].block = lblock;
+    DX_COUNT_LIMIT(entries)->count++;
+}
+
+/*
+ * Append a new, empty interior index block to the given directory and return
+ * its dx_entry array, or NULL if there are no free blocks left. Its logical
+ * block number is stored in lblock.
+ */
+struct dx_entry *dx_add_node (struct ext2_fs *fs, unsigned int dir_inode,
+        unsigned int *lblock)
+{
+    unsigned int block;
+    struct dx_entry *entries;
+
+    *lblock = get_inode(fs, dir_inode)->i_size / EXT2_BLOCK_SIZE;
+    block = add_dir_block(fs, dir_inode);
+    if (!block)
+        return NULL;
+
+    /* The block is already a single empty entry spanning the whole block */
+    entries = (struct dx_entry *) (get_block(fs, block) + DX_NODE_ENTRIES_OFFSET);
+    DX_COUNT_LIMIT(entries)->limit = DX_NODE_LIMIT;
+    DX_COUNT_LIMIT(entries)->count = 0;
+    return entries;
+}
+
+/*
+ * Make room for one more entry in the lowest index block on the path given
+ * by frames, either by adding a level of interior index blocks under the
+ * root or by splitting the interior block in two. Return the new number of
+ * frames, or 0 if the index is full or there are no free blocks left.
+ */
+int dx_make_room (struct ext2_fs *fs, unsigned int dir_inode, struct dx_frame *frames,
+        int num_frames)
+{
+    struct ext2_inode *dir = get_inode(fs, dir_inode);
+    struct dx_root_info *info = get_dx_root_info(fs, dir);
+    struct dx_frame *frame = &frames[num_frames - 1];
+    struct dx_entry *node;
+    struct dx_countlimit *countlimit = DX_COUNT_LIMIT(frame->entries);
+
+    unsigned int node_lblock;
+    unsigned int count = countlimit->count;
+    unsigned int split;
+
+    if (count < countlimit->limit)
+        return num_frames;
+
+    if (num_frames == 1) {
+        /* The root is full, so move all its entries into a new interior block
+         * and have the root point to that instead */
+        if (!(node = dx_add_node(fs, dir_inode, &node_lblock)))
+            return 0;
+
+        memcpy(node + 1, frame->entries + 1, (count - 1) * sizeof(struct dx_entry));
+        node[0].block = frame->entries[0].block;
+        DX_COUNT_LIMIT(node)->count = count;
+
+        frames[1].entries = node;
+        frames[1].at = node + (frame->at - frame->entries);
+
+        frame->entries[0].block = node_lblock;
+        countlimit->count = 1;
+        frame->at = frame->entries;
+        info->indirect_levels = 1;
+        return 2;
+    }
+
+    /* An interior block is full, so split it in two, if the root has room for
+     * a pointer to the new half */
+    if (DX_COUNT_LIMIT(frames[0].entries)->count >= DX_COUNT_LIMIT(frames[0].entries)->limit)
+        return 0;
+    if (!(node = dx_add_node(fs, dir_inode, &node_lblock)))
+        return 0;
+
+    split = count / 2;
+    memcpy(node, frame->entries + split, (count - split) * sizeof(struct dx_entry));
+    DX_COUNT_LIMIT(node)->limit = DX_NODE_LIMIT;
+    DX_COUNT_LIMIT(node)->count = count - split;
+    countlimit->count = split;
+
+    dx_insert_entry(frames[0].entries, frames[0].at, frame->entries[split].hash, node_lblock);
+
+    /* Keep following whichever half now holds the entry we were at */
+    if (frame->at >= frame->entries + split) {
+        frame->at = node + (frame->at - (frame->entries + split));
+        frame->entries = node;
+        frames[0].at++;
+    }
+
+    return num_frames;
+}
+
+/*
+ * Compare the hashes of two dx_map_entry structures, for qsort().
+ */
+static int compare_dx_map_entries (const void *a, const void *b)
+{
+    unsigned int hash_a = ((const struct dx_map_entry *) a)->hash;
+    unsigned int hash_b = ((const struct dx_map_entry *) b)->hash;
+
+    return (hash_a > hash_b) - (hash_a < hash_b);
+}
+
+/*
+ * Split the full leaf block followed by the last of the given frames in two,
+ * moving the entries with the higher hashes into a new block and adding it
+ * to the index. The index block must have room for another entry. Return
+ * the number of whichever of the two blocks hash now belongs in, or 0 if
+ * there are no free blocks left. A damaged leaf is left as it is, and the 
+ * directory's index is dropped.
+ */
+unsigned int dx_split_leaf (struct ext2_fs *fs, unsigned int dir_inode,
+        struct dx_root_info *info, struct dx_frame *frames, int num_frames, unsigned int hash)
+{
+    struct dx_frame *frame = &frames[num_frames - 1];
+    struct ext2_inode *dir = get_inode(fs, dir_inode);
+    struct ext2_dir_entry *entry;
+    struct ext2_dir_entry *list[EXT2_BLOCK_SIZE / 8];
+    struct dx_map_entry map[EXT2_BLOCK_SIZE / 8];
+
+    unsigned char old_copy[EXT2_BLOCK_SIZE];
+    unsigned int old_block = get_block_num(fs, dir, frame->at->block);
+    unsigned int new_lblock = dir->i_size / EXT2_BLOCK_SIZE;
+    unsigned int new_block;
+    unsigned int split_hash;
+    unsigned long block_pos;
+    unsigned int moved_size = 0;
+    int count = 0;
+    int split;
+    int k;
+
+    /* Work from a copy of the leaf, since it is rewritten in place */
+    memcpy(old_copy, get_block(fs, old_block), EXT2_BLOCK_SIZE);
+    for (block_pos = 0; block_pos < EXT2_BLOCK_SIZE; block_pos += entry->rec_len) {
+        entry = (struct ext2_dir_entry *) (old_copy + block_pos);
+        if (!is_valid_dir_record(entry, block_pos)) {
+            dir->i_flags &= ~EXT2_INDEX_FL;
+            return 0;
+        }
+        if (!entry->inode)
+            continue;
+
+        map[count].hash = get_dx_name_hash(fs, info, entry->name, entry->name_len);
+        map[count].entry = entry;
+        count++;
+    }
+
+    if (count < 2 || !(new_block = add_dir_block(fs, dir_inode)))
+        return 0;
+
+    qsort(map, count, sizeof(struct dx_map_entry), compare_dx_map_entries);
+
+    /* Move the entries with the highest hashes, up to half a block's worth */
+    for (split = count - 1; split > 0; split--) {
+        moved_size += PAD_REC_LEN(sizeof(struct ext2_dir_entry) + map[split].entry->name_len);
+        if (moved_size > EXT2_BLOCK_SIZE / 2)
+            break;
+    }
+    split++;
+    if (split >= count)
+        split = count - 1;
+
+    /* Names with the same hash as the last one left behind continue into
+     * the new block */
+    split_hash = map[split].hash;
+    if (split_hash == map[split - 1].hash)
+        split_hash |= DX_HASH_CONTINUED;
+
+    for (k = 0; k < split; k++)
+        list[k] = map[k].entry;
+    pack_dir_block(get_block(fs, old_block), list, split);
+
+    for (k = split; k < count; k++)
+        list[k - split] = map[k].entry;
+    pack_dir_block(get_block(fs, new_block), list, count - split);
+
+    dx_insert_entry(frame->entries, frame->at, split_hash, new_lblock);
+
+    return (hash >= (split_hash & ~DX_HASH_CONTINUED)) ? new_block : old_block;
+}
+
+/*
+ * Make room for a new entry with the given name in the indexed directory
+ * referred to by parent_inode, in the leaf block that the name's hash
+ * belongs to, splitting that block if it is full. Return the new entry,
+ * whose rec_len is set but whose other fields are not, or NULL if this is
+ * not possible. If the index turns out to be damaged, it is dropped, leaving
+ * an ordinary directory that the caller can add the entry to instead. 
+ * Otherwise the index is kept, and the directory has simply run out of 
+ * room, as there are no free blocks left or the index is full.
+ */
+struct ext2_dir_entry *dx_add_entry (struct ext2_fs *fs, unsigned int parent_inode,
+        const char *name, int name_len)
+{
+    struct ext2_inode *dir = get_inode(fs, parent_inode);
+    struct dx_root_info *info = get_dx_root_info(fs, dir);
+    struct dx_frame frames[DX_MAX_LEVELS];
+    struct ext2_dir_entry *entry;
+
+    unsigned int hash;
+    unsigned int block = 0;
+    int num_frames = 0;
+
+    if (info) {
+        hash = get_dx_name_hash(fs, info, name, name_len);
+        num_frames = dx_probe(fs, dir, hash, frames);
+    }
+
+    if (num_frames)
+        block = get_block_num(fs, dir, frames[num_frames - 1].at->block);
+    if (!is_valid_block(fs, block)) {
+        dir->i_flags &= ~EXT2_INDEX_FL;
+        return NULL;
+    }
+
+    entry = insert_into_dir_block(fs, block, name_len, FALSE);
+
+    if (!entry && (num_frames = dx_make_room(fs, parent_inode, frames, num_frames))) {
+        block = dx_split_leaf(fs, parent_inode, info, frames, num_frames, hash);
+        if (block)
+            entry = insert_into_dir_block(fs, block, name_len, FALSE);
+    }
+
+    return entry;
+}
+
+/*
+ * Add a hash index to the directory referred to by dir_inode, which must
+ * consist of a single block starting with its . and .. entries. The other
+ * entries move to a new leaf block, and the first block becomes the root of
+ * the index. Return 0 on success, or -1 if this is not possible.
+ */
+int dx_make_indexed (struct ext2_fs *fs, unsigned int dir_inode)
+{
+    struct ext2_inode *dir = get_inode(fs, dir_inode);
+    struct ext2_super_block *sb = get_super_block(fs);
+    struct ext2_dir_entry *dot;
+    struct ext2_dir_entry *dotdot;
+    struct ext2_dir_entry *entry;
+    struct ext2_dir_entry *list[EXT2_BLOCK_SIZE / 8];
+    struct dx_root_info *info;
+    struct dx_entry *entries;
+
+    unsigned char root_copy[EXT2_BLOCK_SIZE];
+    unsigned char *root;
+    unsigned int leaf_block;
+    unsigned long block_pos;
+    int count = 0;
+
+    if (dir->i_size != EXT2_BLOCK_SIZE || !is_valid_block(fs, dir->i_block[0]))
+        return -1;
+
+    root = get_block(fs, dir->i_block[0]);
+    memcpy(root_copy, root, EXT2_BLOCK_SIZE);
+
+    dot = (struct ext2_dir_entry *) root_copy;
+    if (!is_valid_dir_record(dot, 0) || dot->rec_len >= EXT2_BLOCK_SIZE)
+        return -1;
+
+    dotdot = (struct ext2_dir_entry *) (root_copy + dot->rec_len);
+    if (dot->name_len != 1 || dot->name[0] != '.' || !is_valid_dir_record(dotdot, dot->rec_len) ||
+            dotdot->name_len != 2 || memcmp(dotdot->name, "..", 2))
+        return -1;
+
+    /* Gather every other entry, giving up on a damaged block before
+     * anything is changed */
+    block_pos = dot->rec_len + dotdot->rec_len;
+    for (; block_pos < EXT2_BLOCK_SIZE; block_pos += entry->rec_len) {
+        entry = (struct ext2_dir_entry *) (root_copy + block_pos);
+        if (!is_valid_dir_record(entry, block_pos))
+            return -1;
+        if (entry->inode)
+            list[count++] = entry;
+    }
+
+    /* Move them into the new leaf */
+    if (!(leaf_block = add_dir_block(fs, dir_inode)))
+        return -1;
+    pack_dir_block(get_block(fs, leaf_block), list, count);
+
+    /* Rebuild the first block as the root of the index, with . and ..
+     * followed by an index whose only entry points to the leaf */
+    memset(root, 0, EXT2_BLOCK_SIZE);
+    list[0] = dot;
+    list[1] = dotdot;
+    pack_dir_block(root, list, 2);
+
+    info = (struct dx_root_info *) (root + DX_ROOT_INFO_OFFSET);
+    info->info_length = sizeof(struct dx_root_info);
+    info->hash_version = (sb->s_def_hash_version <= EXT2_HASH_TEA) ?
+        sb->s_def_hash_version : EXT2_HASH_HALF_MD4;
+
+    entries = (struct dx_entry *) (root + DX_ROOT_ENTRIES_OFFSET);
+    DX_COUNT_LIMIT(entries)->limit = DX_ROOT_LIMIT;
+    DX_COUNT_LIMIT(entries)->count = 1;
+    entries[0].block = 1;
+
+    dir->i_flags |= EXT2_INDEX_FL;
+    return 0;
+}
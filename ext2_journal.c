@@ -0,0 +1,806 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include "ext2_utils.h"
+
+#define JOURNAL_UUID_SIZE 16
+#define JOURNAL_TAG_SIZE sizeof(struct journal_block_tag)
+#define JOURNAL_TAGS_PER_BLOCK ((EXT2_BLOCK_SIZE - sizeof(struct journal_header) - \
+    JOURNAL_UUID_SIZE) / JOURNAL_TAG_SIZE)
+#define SUPER_BLOCK_NUM (EXT2_SUPER_OFFSET / EXT2_BLOCK_SIZE)
+#define PAGEMAP_PRESENT (1ULL << 63)
+#define PAGEMAP_SWAPPED (1ULL << 62)
+#define PAGEMAP_FILE (1ULL << 61)
+
+/*
+ * An image whose superblock names a journal (EXT3_FEATURE_COMPAT_HAS_JOURNAL
+ * and s_journal_inum, as set up by tune2fs -j) has its changes journaled.
+ * Its mapping is then copy-on-write, so nothing changed through the handle
+ * reaches the image until the journal is committed. A commit finds the
+ * blocks that now differ from the image, logs them to the journal as one
+ * transaction in the JBD2 format e2fsck understands, and only once the
+ * transaction is on disk writes them to their home blocks. Everything done
+ * since the previous commit thus reaches the image as a whole or not at
+ * all, and the flushes are shared by every change in the transaction.
+ *
+ * A transaction left behind by a crash is replayed when the image is next
+ * opened. Each one is written to the home blocks as soon as it has been
+ * committed, so the log never holds more than one of ours.
+ *
+ * File contents are not journaled: they are written straight to their new
+ * blocks, which nothing committed refers to yet. Blocks freed since the last
+ * commit are the exception, as a crash would leave them with their old
+ * owner, so they are written through the mapping and journaled like the
+ * rest.
+ */
+
+/*
+ * Return the journal block at the given position in the journal.
+ */
+static unsigned char *get_journal_block (struct ext2_fs *fs, struct ext2_journal *journal,
+        unsigned int pos)
+{
+    return get_block(fs, journal->blocks[pos]);
+}
+
+/*
+ * Return the position in the journal that is num blocks past pos, wrapping
+ * around from the end of the log to its first block.
+ */
+static unsigned int advance_journal_pos (struct ext2_journal *journal, unsigned int pos,
+        unsigned int num)
+{
+    while (num--) {
+        if (++pos == journal->maxlen)
+            pos = journal->first;
+    }
+    return pos;
+}
+
+/*
+ * Write the given block's worth of data to the given block of the image.
+ * Return 0 on success, or -1 with errno set on failure.
+ */
+static int write_image_block (struct ext2_fs *fs, unsigned int block, const void *buf)
+{
+    ssize_t ret_val = pwrite(fs->disk_fd, buf, EXT2_BLOCK_SIZE, (off_t) block * EXT2_BLOCK_SIZE);
+
+    if (ret_val != EXT2_BLOCK_SIZE) {
+        if (ret_val >= 0)
+            errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Record in the journal superblock where the log starts (0 if it is empty)
+ * and the ID of the first transaction in it. Return 0 on success, or -1 with
+ * errno set on failure.
+ */
+static int write_journal_super (struct ext2_fs *fs, struct ext2_journal *journal,
+        unsigned int start, unsigned int sequence)
+{
+    unsigned char buf[EXT2_BLOCK_SIZE];
+    struct journal_superblock *jsb = (struct journal_superblock *) buf;
+
+    memcpy(buf, get_journal_block(fs, journal, 0), EXT2_BLOCK_SIZE);
+    jsb->s_start = htonl(start);
+    jsb->s_sequence = htonl(sequence);
+    return write_image_block(fs, journal->blocks[0], buf);
+}
+
+/*
+ * Set or clear EXT3_FEATURE_INCOMPAT_RECOVER in the image's superblock,
+ * which tells e2fsck that the journal holds transactions to replay. Return
+ * 0 on success, or -1 with errno set on failure.
+ */
+static int set_recover_flag (struct ext2_fs *fs, int is_set)
+{
+    struct ext2_super_block sb;
+
+    if (pread(fs->disk_fd, &sb, sizeof(sb), EXT2_SUPER_OFFSET) != sizeof(sb)) {
+        errno = EIO;
+        return -1;
+    }
+
+    if (is_set)
+        sb.s_feature_incompat |= EXT3_FEATURE_INCOMPAT_RECOVER;
+    else
+        sb.s_feature_incompat &= ~EXT3_FEATURE_INCOMPAT_RECOVER;
+    return write_image_block(fs, SUPER_BLOCK_NUM, &sb);
+}
+
+/*
+ * Return the next tag of the descriptor block desc, whose tags start at
+ * *offset, and move *offset past it, or NULL if the block has no room left
+ * for another tag.
+ */
+static struct journal_block_tag *next_tag (unsigned char *desc, unsigned int *offset)
+{
+    struct journal_block_tag *tag;
+
+    if (*offset + JOURNAL_TAG_SIZE > EXT2_BLOCK_SIZE)
+        return NULL;
+
+    tag = (struct journal_block_tag *) (desc + *offset);
+    *offset += JOURNAL_TAG_SIZE;
+    if (!(ntohs(tag->t_flags) & JBD2_FLAG_SAME_UUID))
+        *offset += JOURNAL_UUID_SIZE;
+    return tag;
+}
+
+/*
+ * Return the number of blocks described by the descriptor block desc.
+ */
+static unsigned int count_tags (unsigned char *desc)
+{
+    unsigned int offset = sizeof(struct journal_header);
+    struct journal_block_tag *tag;
+    unsigned int num_tags = 0;
+
+    while ((tag = next_tag(desc, &offset))) {
+        num_tags++;
+        if (ntohs(tag->t_flags) & JBD2_FLAG_LAST_TAG)
+            break;
+    }
+    return num_tags;
+}
+
+/*
+ * Return the type of the journal block at pos if it belongs to the given
+ * transaction, or 0 if it does not, which marks the end of the log.
+ */
+static unsigned int get_log_block_type (struct ext2_fs *fs, struct ext2_journal *journal,
+        unsigned int pos, unsigned int sequence)
+{
+    struct journal_header *header = (struct journal_header *) get_journal_block(fs, journal, pos);
+
+    if (ntohl(header->h_magic) != JBD2_MAGIC_NUMBER || ntohl(header->h_sequence) != sequence)
+        return 0;
+    return ntohl(header->h_blocktype);
+}
+
+/*
+ * Replay every transaction committed to the log that starts at start with
+ * transaction sequence. With is_journaling set, the blocks are written to
+ * the image and the log is then marked empty; otherwise they are only
+ * copied into the mapping, and the image is left alone. Return the ID of
+ * the transaction after the last one replayed, or -1 (after printing why)
+ * if the log cannot be replayed.
+ */
+static long long replay_journal (struct ext2_fs *fs, struct ext2_journal *journal,
+        unsigned int start, unsigned int sequence, int is_journaling)
+{
+    unsigned int blocks_count = get_super_block(fs)->s_blocks_count;
+    unsigned char buf[EXT2_BLOCK_SIZE];
+    unsigned int pos, end_sequence, type, offset, target;
+    struct journal_block_tag *tag;
+    unsigned char *desc;
+
+    /* Find the last transaction that made it to its commit block. Ours are
+     * always whole, but one left by the kernel may be followed by a torn
+     * one. */
+    pos = start;
+    end_sequence = sequence;
+    while ((type = get_log_block_type(fs, journal, pos, end_sequence))) {
+        if (type == JBD2_DESCRIPTOR_BLOCK) {
+            pos = advance_journal_pos(journal, pos, 1 + count_tags(get_journal_block(fs, journal, pos)));
+        } else if (type == JBD2_COMMIT_BLOCK) {
+            pos = advance_journal_pos(journal, pos, 1);
+            end_sequence++;
+        } else if (type == JBD2_REVOKE_BLOCK) {
+            fprintf(stderr, "ERROR: The journal holds revoke records, run e2fsck to recover it\n");
+            return -1;
+        } else {
+            break;
+        }
+    }
+
+    /* Copy each block logged by those transactions to its home block */
+    pos = start;
+    while (sequence != end_sequence) {
+        type = get_log_block_type(fs, journal, pos, sequence);
+        desc = get_journal_block(fs, journal, pos);
+        pos = advance_journal_pos(journal, pos, 1);
+        if (type == JBD2_COMMIT_BLOCK) {
+            sequence++;
+            continue;
+        }
+
+        offset = sizeof(struct journal_header);
+        while ((tag = next_tag(desc, &offset))) {
+            target = ntohl(tag->t_blocknr);
+            if (!target || target >= blocks_count) {
+                fprintf(stderr, "ERROR: The journal logs invalid block %u\n", target);
+                return -1;
+            }
+
+            memcpy(buf, get_journal_block(fs, journal, pos), EXT2_BLOCK_SIZE);
+            if (ntohs(tag->t_flags) & JBD2_FLAG_ESCAPE)
+                *(unsigned int *) buf = htonl(JBD2_MAGIC_NUMBER);
+
+            if (!is_journaling) {
+                memcpy(get_block(fs, target), buf, EXT2_BLOCK_SIZE);
+            } else if (write_image_block(fs, target, buf) < 0) {
+                perror("ERROR: Failed to replay the journal");
+                return -1;
+            }
+
+            pos = advance_journal_pos(journal, pos, 1);
+            if (ntohs(tag->t_flags) & JBD2_FLAG_LAST_TAG)
+                break;
+        }
+    }
+
+    if (is_journaling && (fdatasync(fs->disk_fd) < 0 ||
+            write_journal_super(fs, journal, 0, end_sequence) < 0 ||
+            set_recover_flag(fs, FALSE) < 0 || fdatasync(fs->disk_fd) < 0)) {
+        perror("ERROR: Failed to replay the journal");
+        return -1;
+    }
+
+    return end_sequence;
+}
+
+/*
+ * Free the in-memory state of the given journal.
+ */
+static void free_journal (struct ext2_journal *journal)
+{
+    if (journal->pagemap_fd >= 0)
+        close(journal->pagemap_fd);
+    free(journal->freed_blocks);
+    free(journal->blocks);
+    free(journal);
+}
+
+/*
+ * Find the journal of the image referred to by fs, if it has one, and
+ * replay whatever a crash left in it. With is_journaling set, the image
+ * must be mapped copy-on-write, and changes are journaled from now on.
+ * Otherwise, the replayed blocks stay in memory. Return 0 on success
+ * (whether or not there is a journal), or -1 (after printing why) if the
+ * journal is damaged or of a kind that is not supported, or memory is short.
+ */
+int open_journal (struct ext2_fs *fs, int is_journaling)
+{
+    struct ext2_super_block *sb = get_super_block(fs);
+    struct journal_superblock *jsb;
+    struct ext2_journal *journal;
+    struct ext2_inode *ino;
+    unsigned int k, block;
+    long long sequence;
+
+    fs->journal = NULL;
+    if (!(sb->s_feature_compat & EXT3_FEATURE_COMPAT_HAS_JOURNAL) || !sb->s_journal_inum)
+        return 0;
+
+    if (sb->s_journal_inum > sb->s_inodes_count) {
+        fprintf(stderr, "ERROR: Invalid journal inode %u\n", sb->s_journal_inum);
+        return -1;
+    }
+
+    ino = get_inode(fs, sb->s_journal_inum);
+    block = get_block_num(fs, ino, 0);
+    if (!is_valid_block(fs, block)) {
+        fprintf(stderr, "ERROR: The journal inode %u has no superblock\n", sb->s_journal_inum);
+        return -1;
+    }
+
+    jsb = (struct journal_superblock *) get_block(fs, block);
+    if (ntohl(jsb->s_header.h_magic) != JBD2_MAGIC_NUMBER ||
+            (ntohl(jsb->s_header.h_blocktype) != JBD2_SUPERBLOCK_V1 &&
+            ntohl(jsb->s_header.h_blocktype) != JBD2_SUPERBLOCK_V2) ||
+            ntohl(jsb->s_blocksize) != EXT2_BLOCK_SIZE ||
+            ntohl(jsb->s_maxlen) > get_file_size(ino) / EXT2_BLOCK_SIZE ||
+            !ntohl(jsb->s_first) || ntohl(jsb->s_first) >= ntohl(jsb->s_maxlen)) {
+        fprintf(stderr, "ERROR: Invalid journal superblock\n");
+        return -1;
+    }
+
+    /* Checksums and 64-bit block numbers change the layout of the log */
+    if (ntohl(jsb->s_header.h_blocktype) == JBD2_SUPERBLOCK_V2 && (jsb->s_feature_compat ||
+            (ntohl(jsb->s_feature_incompat) & ~JBD2_FEATURE_INCOMPAT_REVOKE) ||
+            jsb->s_feature_ro_compat)) {
+        fprintf(stderr, "ERROR: Unsupported journal features\n");
+        return -1;
+    }
+
+    journal = calloc(1, sizeof(struct ext2_journal));
+    if (!journal) {
+        perror("calloc");
+        return -1;
+    }
+
+    journal->pagemap_fd = -1;
+    journal->maxlen = ntohl(jsb->s_maxlen);
+    journal->first = ntohl(jsb->s_first);
+    journal->sequence = ntohl(jsb->s_sequence);
+    memcpy(journal->uuid, jsb->s_uuid, JOURNAL_UUID_SIZE);
+
+    journal->blocks = malloc(journal->maxlen * sizeof(unsigned int));
+    if (!journal->blocks) {
+        perror("malloc");
+        free_journal(journal);
+        return -1;
+    }
+
+    for (k = 0; k < journal->maxlen; k++) {
+        journal->blocks[k] = get_block_num(fs, ino, k);
+        if (!is_valid_block(fs, journal->blocks[k])) {
+            fprintf(stderr, "ERROR: Journal block %u is not mapped\n", k);
+            free_journal(journal);
+            return -1;
+        }
+    }
+
+    if (jsb->s_start) {
+        sequence = replay_journal(fs, journal, ntohl(jsb->s_start), journal->sequence,
+            is_journaling);
+        if (sequence < 0) {
+            free_journal(journal);
+            return -1;
+        }
+        journal->sequence = sequence;
+    }
+
+    if (!is_journaling) {
+        free_journal(journal);
+        return 0;
+    }
+
+    journal->freed_blocks = calloc((sb->s_blocks_count + 7) / 8, 1);
+    if (!journal->freed_blocks) {
+        perror("calloc");
+        free_journal(journal);
+        return -1;
+    }
+
+    /* Without the page map, every page is compared with the image */
+    journal->page_size = sysconf(_SC_PAGESIZE);
+    journal->pagemap_fd = open("/proc/self/pagemap", O_RDONLY);
+
+    fs->journal = journal;
+    return 0;
+}
+
+/*
+ * Fill flags with whether each of the num pages of the mapping from
+ * first_page has been changed through it, that is, has a private copy.
+ * Return 0 on success, or -1 with errno set on failure.
+ */
+static int get_private_pages (struct ext2_fs *fs, unsigned long first_page,
+        unsigned long num, unsigned char *flags)
+{
+    struct ext2_journal *journal = fs->journal;
+    unsigned long long entries[PAGEMAP_CHUNK];
+    unsigned long done, k, n;
+    off_t offset;
+    ssize_t len;
+
+    if (journal->pagemap_fd < 0) {
+        memset(flags, 1, num);
+        return 0;
+    }
+
+    /* A page is only backed by the image until it is first written to */
+    offset = ((uintptr_t) fs->disk / journal->page_size + first_page) * sizeof(entries[0]);
+    for (done = 0; done < num; done += n) {
+        n = MIN(num - done, PAGEMAP_CHUNK);
+        len = pread(journal->pagemap_fd, entries, n * sizeof(entries[0]),
+            offset + done * sizeof(entries[0]));
+        if (len != (ssize_t) (n * sizeof(entries[0]))) {
+            if (len >= 0)
+                errno = EIO;
+            return -1;
+        }
+
+        for (k = 0; k < n; k++)
+            flags[done + k] = (entries[k] & PAGEMAP_SWAPPED) ||
+                ((entries[k] & PAGEMAP_PRESENT) && !(entries[k] & PAGEMAP_FILE));
+    }
+
+    return 0;
+}
+
+/*
+ * Write the given data blocks, which are to go to the num_blocks blocks from
+ * first_block, straight to the image, and to any page of the mapping they
+ * fall on that has a private copy, which would otherwise hide them. Return
+ * 0 on success, or -1 with errno set on failure.
+ */
+static int write_through (struct ext2_fs *fs, unsigned int first_block,
+        const unsigned char *buf, unsigned int num_blocks)
+{
+    long page_size = fs->journal->page_size;
+    unsigned long long start = (unsigned long long) first_block * EXT2_BLOCK_SIZE;
+    unsigned long long end = start + (unsigned long long) num_blocks * EXT2_BLOCK_SIZE;
+    unsigned long first_page = start / page_size;
+    unsigned long num_pages = (end - 1) / page_size - first_page + 1;
+    unsigned char flags[JOURNAL_DATA_CHUNK + 2];
+    unsigned long long from, to;
+    unsigned long written = 0;
+    unsigned long k;
+    ssize_t ret_val;
+
+    while (written < end - start) {
+        ret_val = pwrite(fs->disk_fd, buf + written, end - start - written, start + written);
+        if (ret_val < 0 && errno == EINTR)
+            continue;
+        if (ret_val <= 0) {
+            if (!ret_val)
+                errno = EIO;
+            return -1;
+        }
+        written += ret_val;
+    }
+
+    /* A page is checked after writing, so a copy made in the meantime by
+     * another thread still gets the data */
+    if (get_private_pages(fs, first_page, num_pages, flags) < 0)
+        return -1;
+
+    for (k = 0; k < num_pages; k++) {
+        if (!flags[k])
+            continue;
+        from = MAX((first_page + k) * page_size, start);
+        to = MIN((first_page + k + 1) * page_size, end);
+        memcpy(fs->disk + from, buf + (from - start), to - from);
+    }
+
+    return 0;
+}
+
+/*
+ * Write the num_blocks blocks of file contents in buf to the blocks from
+ * first_block of an image whose changes are journaled. Return 0 on success,
+ * or -1 (after printing why) if the image could not be written to.
+ */
+int write_journaled_blocks (struct ext2_fs *fs, unsigned int first_block,
+        const unsigned char *buf, unsigned int num_blocks)
+{
+    unsigned int k, run;
+
+    /* Blocks freed since the last commit go through the mapping, and runs
+     * of the others straight to the image */
+    for (k = 0; k < num_blocks; k += run) {
+        run = 0;
+        while (k + run < num_blocks && run < JOURNAL_DATA_CHUNK &&
+                !BITMAP_TEST(fs->journal->freed_blocks, first_block + k + run))
+            run++;
+
+        if (!run) {
+            memcpy(get_block(fs, first_block + k), buf + k * EXT2_BLOCK_SIZE, EXT2_BLOCK_SIZE);
+            run = 1;
+        } else if (write_through(fs, first_block + k, buf + k * EXT2_BLOCK_SIZE, run) < 0) {
+            perror("ERROR: Failed to write file contents");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Note that the given block was freed, so that until the next commit,
+ * nothing is written to it behind the journal's back.
+ */
+void journal_free_block (struct ext2_fs *fs, unsigned int block)
+{
+    if (fs->journal)
+        __atomic_fetch_or(&fs->journal->freed_blocks[block / 8], 1 << (block % 8),
+            __ATOMIC_RELAXED);
+}
+
+/*
+ * Return the number of journal blocks a transaction of num_blocks blocks
+ * takes up: each descriptor block is followed by the blocks it describes,
+ * and the transaction ends with a commit block.
+ */
+static unsigned long get_transaction_len (unsigned long num_blocks)
+{
+    return num_blocks + (num_blocks + JOURNAL_TAGS_PER_BLOCK - 1) / JOURNAL_TAGS_PER_BLOCK + 1;
+}
+
+/*
+ * Record that delta blocks or inodes (negative if freed) were just 
+ * allocated, for is_journal_filling().
+ */
+void journal_count_allocs (struct ext2_fs *fs, int delta)
+{
+    if (fs->journal)
+        __atomic_fetch_add(&fs->journal->num_allocs, (delta < 0) ? -delta : delta,
+            __ATOMIC_RELAXED);
+}
+
+/*
+ * Return TRUE if the changes made since the last commit could take up more
+ * than half of the journal, so that committing them now leaves room for the
+ * changes to come, or FALSE otherwise. Every block of a page changed through
+ * the mapping is counted, so this errs on the side of committing, and so 
+ * does a failure to tell which pages have changed. 
+ *
+ * Finding the changed pages takes a pass over the whole page map, so it is
+ * only done every JOURNAL_CHECK_INTERVAL calls, or sooner once enough blocks
+ * and inodes have been allocated or freed to fill a sixteenth of the 
+ * journal, as large changes are made of those. Callers may thus call this
+ * after every change they make, however small.
+ */
+int is_journal_filling (struct ext2_fs *fs)
+{
+    struct ext2_journal *journal = fs->journal;
+    unsigned long num_pages, page, k, n;
+    unsigned long num_blocks = 0;
+    unsigned char flags[PAGEMAP_CHUNK];
+
+    if (!journal)
+        return FALSE;
+
+    if (++journal->num_checks < JOURNAL_CHECK_INTERVAL &&
+            journal->num_allocs < (journal->maxlen - journal->first) / 16)
+        return FALSE;
+    journal->num_checks = 0;
+    journal->num_allocs = 0;
+
+    num_pages = (fs->disk_size + journal->page_size - 1) / journal->page_size;
+    for (page = 0; page < num_pages; page += n) {
+        n = MIN(num_pages - page, PAGEMAP_CHUNK);
+        if (get_private_pages(fs, page, n, flags) < 0)
+            return TRUE;
+
+        for (k = 0; k < n; k++)
+            num_blocks += flags[k];
+    }
+
+    num_blocks *= journal->page_size / EXT2_BLOCK_SIZE;
+    return get_transaction_len(num_blocks) > (journal->maxlen - journal->first) / 2;
+}
+
+/*
+ * Set *blocks to a sorted array, to be freed by the caller, of the blocks
+ * whose contents in the mapping differ from the image, and *num_blocks to
+ * their number. Return 0 on success, or -1 with errno set on failure.
+ */
+static int find_changed_blocks (struct ext2_fs *fs, unsigned int **blocks,
+        unsigned int *num_blocks)
+{
+    long page_size = fs->journal->page_size;
+    unsigned long num_pages = (fs->disk_size + page_size - 1) / page_size;
+    unsigned int blocks_per_page = page_size / EXT2_BLOCK_SIZE;
+    unsigned char flags[PAGEMAP_CHUNK];
+    unsigned long capacity = 0, page, k, n;
+    unsigned int block, end;
+    unsigned char *buf;
+    size_t len;
+    void *grown;
+
+    *blocks = NULL;
+    *num_blocks = 0;
+    if (!(buf = malloc(page_size)))
+        return -1;
+
+    for (page = 0; page < num_pages; page += n) {
+        n = MIN(num_pages - page, PAGEMAP_CHUNK);
+        if (get_private_pages(fs, page, n, flags) < 0)
+            goto fail;
+
+        for (k = 0; k < n; k++) {
+            if (!flags[k])
+                continue;
+
+            len = MIN((size_t) page_size, fs->disk_size - (page + k) * page_size);
+            if (pread(fs->disk_fd, buf, len, (page + k) * page_size) != (ssize_t) len) {
+                errno = EIO;
+                goto fail;
+            }
+
+            block = (page + k) * blocks_per_page;
+            for (end = block + len / EXT2_BLOCK_SIZE; block < end; block++) {
+                if (!memcmp(get_block(fs, block), buf + (block % blocks_per_page) * EXT2_BLOCK_SIZE,
+                        EXT2_BLOCK_SIZE))
+                    continue;
+
+                if (*num_blocks == capacity) {
+                    capacity = (capacity) ? capacity * 2 : 256;
+                    if (!(grown = realloc(*blocks, capacity * sizeof(unsigned int))))
+                        goto fail;
+                    *blocks = grown;
+                }
+                (*blocks)[(*num_blocks)++] = block;
+            }
+        }
+    }
+
+    free(buf);
+    return 0;
+
+fail:
+    free(buf);
+    free(*blocks);
+    *blocks = NULL;
+    return -1;
+}
+
+/*
+ * Log the given blocks to the journal as the next transaction, and wait for
+ * it to reach the disk. Return 0 on success, or -1 with errno set on failure.
+ */
+static int write_transaction (struct ext2_fs *fs, unsigned int *blocks, unsigned int num_blocks)
+{
+    struct ext2_journal *journal = fs->journal;
+    unsigned char desc[EXT2_BLOCK_SIZE], buf[EXT2_BLOCK_SIZE];
+    struct journal_header *header = (struct journal_header *) desc;
+    struct journal_commit_header *commit = (struct journal_commit_header *) desc;
+    struct journal_block_tag *tag;
+    unsigned int pos = journal->first;
+    unsigned int k, i, n, offset;
+    unsigned short flags;
+    time_t now;
+
+    for (k = 0; k < num_blocks; k += n) {
+        n = MIN(num_blocks - k, JOURNAL_TAGS_PER_BLOCK);
+
+        memset(desc, 0, EXT2_BLOCK_SIZE);
+        header->h_magic = htonl(JBD2_MAGIC_NUMBER);
+        header->h_blocktype = htonl(JBD2_DESCRIPTOR_BLOCK);
+        header->h_sequence = htonl(journal->sequence);
+
+        /* Only the first tag of a descriptor block carries the UUID, and a
+         * block that would pass for a journal block is escaped */
+        offset = sizeof(struct journal_header);
+        for (i = 0; i < n; i++) {
+            flags = (i) ? JBD2_FLAG_SAME_UUID : 0;
+            if (i == n - 1)
+                flags |= JBD2_FLAG_LAST_TAG;
+            if (*(unsigned int *) get_block(fs, blocks[k + i]) == htonl(JBD2_MAGIC_NUMBER))
+                flags |= JBD2_FLAG_ESCAPE;
+
+            tag = (struct journal_block_tag *) (desc + offset);
+            tag->t_blocknr = htonl(blocks[k + i]);
+            tag->t_flags = htons(flags);
+            offset += JOURNAL_TAG_SIZE;
+            if (!i) {
+                memcpy(desc + offset, journal->uuid, JOURNAL_UUID_SIZE);
+                offset += JOURNAL_UUID_SIZE;
+            }
+        }
+
+        if (write_image_block(fs, journal->blocks[pos++], desc) < 0)
+            return -1;
+
+        for (i = 0; i < n; i++) {
+            memcpy(buf, get_block(fs, blocks[k + i]), EXT2_BLOCK_SIZE);
+            if (*(unsigned int *) buf == htonl(JBD2_MAGIC_NUMBER))
+                *(unsigned int *) buf = 0;
+            if (write_image_block(fs, journal->blocks[pos++], buf) < 0)
+                return -1;
+        }
+    }
+
+    /* The commit block must not reach the disk before what it commits */
+    if (set_recover_flag(fs, TRUE) < 0 || fdatasync(fs->disk_fd) < 0)
+        return -1;
+
+    memset(desc, 0, EXT2_BLOCK_SIZE);
+    time(&now);
+    commit->h_header.h_magic = htonl(JBD2_MAGIC_NUMBER);
+    commit->h_header.h_blocktype = htonl(JBD2_COMMIT_BLOCK);
+    commit->h_header.h_sequence = htonl(journal->sequence);
+    commit->h_commit_sec = htonl((unsigned int) now);
+
+    if (write_image_block(fs, journal->blocks[pos], desc) < 0 ||
+            write_journal_super(fs, journal, journal->first, journal->sequence) < 0)
+        return -1;
+    return fdatasync(fs->disk_fd);
+}
+
+/*
+ * Write the given blocks, which have been logged to the journal, from the 
+ * mapping to their home blocks in the image, and wait for them to reach the
+ * disk. The superblock keeps saying the journal needs recovery until the 
+ * log is emptied. Return 0 on success, or -1 with errno set on failure.
+ */
+static int checkpoint_blocks (struct ext2_fs *fs, unsigned int *blocks, unsigned int num_blocks)
+{
+    unsigned char buf[EXT2_BLOCK_SIZE];
+    struct ext2_super_block *sb = (struct ext2_super_block *) buf;
+    unsigned int k;
+
+    for (k = 0; k < num_blocks; k++) {
+        memcpy(buf, get_block(fs, blocks[k]), EXT2_BLOCK_SIZE);
+        if (blocks[k] == SUPER_BLOCK_NUM)
+            sb->s_feature_incompat |= EXT3_FEATURE_INCOMPAT_RECOVER;
+        if (write_image_block(fs, blocks[k], buf) < 0)
+            return -1;
+    }
+
+    return fdatasync(fs->disk_fd);
+}
+
+/*
+ * Commit everything changed in the image referred to by fs since the last
+ * commit as a single transaction, and write it to the image. No other thread
+ * may be using the image meanwhile. Changes that do not fit in the journal
+ * are refused rather than written to the image uncommitted; callers making 
+ * many changes should commit whenever is_journal_filling() says so. Return
+ * 0 on success (including when the image has no journal), or -1 (after 
+ * printing why) on failure, in which case nothing has been written to the
+ * home blocks and the changes are kept for the next commit.
+ */
+int commit_journal (struct ext2_fs *fs)
+{
+    struct ext2_journal *journal = fs->journal;
+    unsigned int *blocks, num_blocks;
+    int ret_val;
+
+    if (!journal)
+        return 0;
+
+    if (find_changed_blocks(fs, &blocks, &num_blocks) < 0) {
+        perror("ERROR: Failed to commit the journal");
+        return -1;
+    }
+
+    /* Writing the changes in place without committing them first could 
+     * leave the image half updated */
+    if (get_transaction_len(num_blocks) > journal->maxlen - journal->first) {
+        fprintf(stderr, "ERROR: %u changed blocks do not fit in the journal, not writing them\n",
+            num_blocks);
+        free(blocks);
+        return -1;
+    }
+
+    if (!num_blocks) {
+        ret_val = 0;
+    } else if (!(ret_val = write_transaction(fs, blocks, num_blocks)) &&
+            !(ret_val = checkpoint_blocks(fs, blocks, num_blocks))) {
+        /* Losing this update only means the transaction is replayed again */
+        ret_val = write_journal_super(fs, journal, 0, journal->sequence + 1);
+        if (!ret_val)
+            ret_val = set_recover_flag(fs, FALSE);
+        journal->sequence++;
+    }
+
+    if (ret_val < 0) {
+        perror("ERROR: Failed to commit the journal");
+        free(blocks);
+        return -1;
+    }
+
+    /* The image now matches the mapping, so the private copies of its pages
+     * can go, and the next commit only has to look at pages changed after
+     * this one */
+    if (num_blocks)
+        madvise(fs->disk, fs->disk_size, MADV_DONTNEED);
+    memset(journal->freed_blocks, 0, (get_super_block(fs)->s_blocks_count + 7) / 8);
+    journal->num_checks = 0;
+    journal->num_allocs = 0;
+    free(blocks);
+    return 0;
+}
+
+/*
+ * Commit whatever is left uncommitted, and free the journal's in-memory
+ * state. Return the result of the commit, as for commit_journal().
+ */
+int close_journal (struct ext2_fs *fs)
+{
+    int ret_val;
+
+    if (!fs->journal)
+        return 0;
+
+    ret_val = commit_journal(fs);
+    free_journal(fs->journal);
+    fs->journal = NULL;
+    return ret_val;
+}
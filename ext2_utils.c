@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,151 +11,694 @@
 #include "ext2_utils.h"
 
 /* 
- * Initialize the disk image at diskpath and map it to memory.
+ * Open the disk image at diskpath and map it to memory. The superblock is
+ * read first so that the whole file system it describes can be mapped. 
+ * Return the handle of the image, or NULL (after printing why) if it cannot
+ * be used.
  */
-void init_disk (char *diskpath) 
+struct ext2_fs *open_disk (char *diskpath) 
 {
+    return open_disk_flags(diskpath, 0);
+}
+
+/*
+ * Open the disk image at diskpath as open_disk() does. With OPEN_DISK_PRIVATE
+ * set in flags, the image is opened read-only and mapped copy-on-write, so
+ * changes made through the handle stay in memory and never reach the image,
+ * and nothing is added to its dirty log. Otherwise, if the image has a 
+ * journal, it is also mapped copy-on-write, and changes reach it when the 
+ * journal is committed; see ext2_journal.c.
+ */
+struct ext2_fs *open_disk_flags (char *diskpath, int flags) 
+{
+    struct ext2_super_block sb;
+    struct ext2_fs *fs;
+    struct stat st;
+    off_t image_size;
+    int is_private = flags & OPEN_DISK_PRIVATE;
+    int is_journaled;
+
     /* Open disk image */
-    int fd = open(diskpath, O_RDWR);
+    int fd = open(diskpath, (is_private) ? O_RDONLY : O_RDWR);
     if (fd < 0) {
         perror("open");
-        exit(1);
+        return NULL;
+    }
+
+    /* The superblock always lives 1024 bytes into the image, regardless of
+     * the block size, so read it before deciding how much to map */
+    if (pread(fd, &sb, sizeof(sb), EXT2_SUPER_OFFSET) != sizeof(sb)) {
+        fprintf(stderr, "ERROR: Failed to read superblock\n");
+        close(fd);
+        return NULL;
+    }
+
+    if (sb.s_magic != EXT2_SUPER_MAGIC) {
+        fprintf(stderr, "ERROR: Not an ext2 file system image\n");
+        close(fd);
+        return NULL;
+    }
+
+    /* All of the utilities address the image in EXT2_BLOCK_SIZE units */
+    if ((EXT2_MIN_BLOCK_SIZE << sb.s_log_block_size) != EXT2_BLOCK_SIZE) {
+        fprintf(stderr, "ERROR: Unsupported block size %u, make the image with mke2fs -b %u\n",
+            EXT2_MIN_BLOCK_SIZE << sb.s_log_block_size, EXT2_BLOCK_SIZE);
+        close(fd);
+        return NULL;
+    }
+
+    /* Ensure the file system described by the superblock fits in the file */
+    image_size = (off_t) sb.s_blocks_count << (10 + sb.s_log_block_size);
+    if (fstat(fd, &st) < 0) {
+        perror("fstat");
+        close(fd);
+        return NULL;
+    }
+
+    if (st.st_size < image_size) {
+        fprintf(stderr, "ERROR: Image is smaller than its file system (%lld < %lld bytes)\n",
+            (long long) st.st_size, (long long) image_size);
+        close(fd);
+        return NULL;
     }
 
-    /* Map the disk image into memory */
-    disk = mmap(NULL, DISK_BLOCKS*EXT2_BLOCK_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
-    if (disk == MAP_FAILED) {
+    fs = calloc(1, sizeof(struct ext2_fs));
+    if (!fs) {
+        perror("calloc");
+        close(fd);
+        return NULL;
+    }
+
+    /* The allocation policy may be overridden from the environment */
+    set_alloc_policy(fs, ALLOC_POLICY_LOCALITY);
+    char *policy = getenv("EXT2_ALLOC_POLICY");
+    if (policy && !strcmp(policy, "linear"))
+        set_alloc_policy(fs, ALLOC_POLICY_LINEAR);
+
+    /* Map the disk image into memory. The descriptor is kept to write out
+     * the changes to a journaled image. Only the pages changed through a
+     * copy-on-write mapping get private copies, so no memory is reserved 
+     * for the rest of the image, which may well be larger than memory. */
+    is_journaled = (sb.s_feature_compat & EXT3_FEATURE_COMPAT_HAS_JOURNAL) && sb.s_journal_inum;
+    fs->disk_size = image_size;
+    fs->disk_fd = fd;
+    fs->disk = mmap(NULL, image_size, PROT_READ|PROT_WRITE, 
+        (is_private || is_journaled) ? MAP_PRIVATE|MAP_NORESERVE : MAP_SHARED, fd, 0);
+    if (fs->disk == MAP_FAILED) {
         perror("mmap");
-        exit(1);
+        close(fd);
+        free(fs);
+        return NULL;
+    }
+
+    if (init_locks(fs) < 0) {
+        munmap(fs->disk, fs->disk_size);
+        close(fd);
+        free(fs);
+        return NULL;
+    }
+
+    if (open_dirty_log(fs, diskpath, !is_private) < 0) {
+        destroy_locks(fs);
+        munmap(fs->disk, fs->disk_size);
+        close(fd);
+        free(fs);
+        return NULL;
+    }
+
+    /* Whatever a crash left in the journal is replayed before anything else
+     * looks at the image */
+    if (open_journal(fs, !is_private) < 0) {
+        close_dirty_log(fs);
+        destroy_locks(fs);
+        munmap(fs->disk, fs->disk_size);
+        close(fd);
+        free(fs);
+        return NULL;
+    }
+
+    build_group_summaries(fs);
+    if (!fs->group_summaries) {
+        close_disk(fs);
+        return NULL;
+    }
+
+    return fs;
+}
+
+/*
+ * Commit the journal of the disk image referred to by fs, if it has one,
+ * unmap the image, and free everything built up in memory while working on
+ * it. The handle cannot be used afterwards. Return 0 on success, or -1 
+ * (after printing why) if the final commit failed, in which case nothing 
+ * changed since the previous commit has reached the image.
+ */
+int close_disk (struct ext2_fs *fs) 
+{
+    int ret_val = close_journal(fs);
+
+    while (fs->dir_space_maps)
+        drop_dir_space_map(fs, fs->dir_space_maps->dir_inode);
+
+    dcache_destroy(fs);
+    free(fs->group_summaries);
+    close_dirty_log(fs);
+    destroy_locks(fs);
+    munmap(fs->disk, fs->disk_size);
+    close(fs->disk_fd);
+    free(fs);
+    return ret_val;
+}
+
+/*
+ * Set up the locks that let several threads work on the image referred to
+ * by fs at once, see struct ext2_fs. Return 0 on success, or -1 (after 
+ * printing why) if memory is short.
+ */
+int init_locks (struct ext2_fs *fs) 
+{
+    unsigned int k;
+
+    fs->num_group_locks = get_num_groups(fs);
+    fs->group_locks = malloc(fs->num_group_locks * sizeof(pthread_mutex_t));
+    if (!fs->group_locks) {
+        perror("malloc");
+        return -1;
+    }
+
+    for (k = 0; k < fs->num_group_locks; k++)
+        pthread_mutex_init(&fs->group_locks[k], NULL);
+    for (k = 0; k < INODE_LOCK_STRIPES; k++)
+        pthread_rwlock_init(&fs->inode_locks[k], NULL);
+    pthread_mutex_init(&fs->dcache_lock, NULL);
+    pthread_mutex_init(&fs->space_map_lock, NULL);
+    return 0;
+}
+
+/*
+ * Tear down the locks set up by init_locks(), once no thread uses the image.
+ */
+void destroy_locks (struct ext2_fs *fs) 
+{
+    unsigned int k;
+
+    for (k = 0; k < fs->num_group_locks; k++)
+        pthread_mutex_destroy(&fs->group_locks[k]);
+    for (k = 0; k < INODE_LOCK_STRIPES; k++)
+        pthread_rwlock_destroy(&fs->inode_locks[k]);
+    pthread_mutex_destroy(&fs->dcache_lock);
+    pthread_mutex_destroy(&fs->space_map_lock);
+    free(fs->group_locks);
+}
+
+/*
+ * Take the lock guarding the bitmaps, descriptor and summary of the given 
+ * group. No other lock may be taken while it is held.
+ */
+void lock_group (struct ext2_fs *fs, unsigned int group) 
+{
+    pthread_mutex_lock(&fs->group_locks[group]);
+}
+
+/*
+ * Release the lock taken by lock_group().
+ */
+void unlock_group (struct ext2_fs *fs, unsigned int group) 
+{
+    pthread_mutex_unlock(&fs->group_locks[group]);
+}
+
+/*
+ * Take the lock guarding the given inode, and its entries if it is a 
+ * directory, for writing. Inodes share INODE_LOCK_STRIPES locks, so a 
+ * thread holding one may not take another inode's lock.
+ */
+void lock_inode (struct ext2_fs *fs, unsigned int inode) 
+{
+    pthread_rwlock_wrlock(&fs->inode_locks[inode % INODE_LOCK_STRIPES]);
+}
+
+/*
+ * Take the lock guarding the given inode for reading, as described for 
+ * lock_inode().
+ */
+void lock_inode_shared (struct ext2_fs *fs, unsigned int inode) 
+{
+    pthread_rwlock_rdlock(&fs->inode_locks[inode % INODE_LOCK_STRIPES]);
+}
+
+/*
+ * Release the lock taken by lock_inode() or lock_inode_shared().
+ */
+void unlock_inode (struct ext2_fs *fs, unsigned int inode) 
+{
+    pthread_rwlock_unlock(&fs->inode_locks[inode % INODE_LOCK_STRIPES]);
+}
+
+/*
+ * Build the in-memory allocation summary of every block group from its 
+ * bitmaps. For each group, this records the lowest free inode and block
+ * (below which the allocators never need to search) and the length of the
+ * longest run of free blocks.
+ */
+void build_group_summaries (struct ext2_fs *fs) 
+{
+    unsigned int group;
+    unsigned int num_groups = get_num_groups(fs);
+    unsigned int inodes_per_group = get_super_block(fs)->s_inodes_per_group;
+    
+    free(fs->group_summaries);
+    fs->group_summaries = malloc(num_groups * sizeof(struct group_summary));
+    if (!fs->group_summaries) {
+        perror("malloc");
+        return;
+    }
+
+    for (group = 0; group < num_groups; group++) {
+        fs->group_summaries[group].first_free_inode = bitmap_find_first_zero(
+            get_inode_bitmap(fs, group), 0, inodes_per_group);
+        fs->group_summaries[group].first_free_block = bitmap_find_first_zero(
+            get_block_bitmap(fs, group), 0, get_blocks_in_group(fs, group));
+        fs->group_summaries[group].longest_free_run = find_longest_free_run(fs, group);
+    }
+}
+
+/*
+ * Return the length of the longest run of free blocks in the given group.
+ */
+unsigned int find_longest_free_run (struct ext2_fs *fs, unsigned int group) 
+{
+    unsigned char *block_bitmap = get_block_bitmap(fs, group);
+    unsigned int num_blocks = get_blocks_in_group(fs, group);
+    unsigned int longest_run = 0;
+    unsigned int run_start = fs->group_summaries[group].first_free_block;
+    unsigned int run_end;
+
+    while ((run_start = bitmap_find_first_zero(block_bitmap, run_start, num_blocks)) < num_blocks) {
+        run_end = bitmap_find_first_set(block_bitmap, run_start, num_blocks);
+        if (run_end - run_start > longest_run)
+            longest_run = run_end - run_start;
+
+        run_start = run_end;
     }
+
+    return longest_run;
+}
+
+/*
+ * Return a pointer to the in-memory allocation summary of the given group.
+ */
+struct group_summary *get_group_summary (struct ext2_fs *fs, unsigned int group) 
+{
+    return &fs->group_summaries[group];
 }
 
 /*
  * Return the inode number of the file or directory at the given absolute
  * path on the current disk, or 0 if the path is invalid.
  */
-unsigned int get_inode_at_path (char *path) 
+unsigned int get_inode_at_path (struct ext2_fs *fs, char *path) 
 {
+    /* Starting directory of path walk is always the root */
+    unsigned int inode = EXT2_ROOT_INO;
+    int seg_len;
+
     /* Path passed in must be absolute */
     if (!IS_ABSOLUTE(path))
         return 0;
 
-    /* Remove all leading slashes */
-    while (IS_ABSOLUTE(path))
-        path++;
-
-    /* Starting directory of path walk is always the root */
-    unsigned int inode = EXT2_ROOT_INO;
-    char current_seg[strlen(path) + 1];
+    while (*path) {
+        /* Skip over the slashes before the next path segment, if it exists */
+        while (*path == '/')
+            path++;
+        if (!*path)
+            break;
 
-    while (strlen(path)) {
-        int path_len = strlen(path);
-        int next_slash = strcspn(path, "/");
-        
-        /* Determine the path segment to search for in the current directory 
-         * (i.e. the substring of path prior to the next slash) */
-        memcpy(current_seg, path, next_slash);
-        current_seg[path_len] = '\0';
-
-        /* If the current path segment is not the last one and not a
-         * directory, the path is invalid */
-        if (path_len > next_slash && !is_dir(inode))
+        /* Only directories can hold the next path segment (i.e. the 
+         * substring of path prior to the next slash) */
+        seg_len = strcspn(path, "/");
+        if (seg_len > EXT2_NAME_LEN || !is_dir(fs, inode))
             return 0;
 
         /* We proceed if the desired entry exists, and if it is a non-terminal
          * directory we will search it on the next iteration. If our desired 
          * entry does not exist then the path is invalid. */
-        inode = find_entry(inode, current_seg);
+        inode = lookup_inode(fs, inode, path, seg_len);
         if (!inode) 
             return 0;
         
-        path += next_slash;
+        path += seg_len;
+    }
 
-        /* Skip over any repeated slashes before the next path segment */
-        while (strlen(path) > 1 && path[1] == '/')
-            path++;
+    return inode;
+}
 
-        /* Advance to next path segment, if it exists */
-        if (strlen(path))
-            path++;
+/*
+ * Select the allocation policy used by allocate_inode() and allocate_block().
+ * ALLOC_POLICY_LINEAR always hands out the lowest free inode or block, while
+ * ALLOC_POLICY_LOCALITY places new inodes according to their parent and type
+ * and data blocks as close as possible to the requested goal.
+ */
+void set_alloc_policy (struct ext2_fs *fs, int policy) 
+{
+    fs->alloc_policy = policy;
+}
+
+/*
+ * Allocate a currently unused inode for a new file or directory of the given
+ * type created in the directory referred to by parent_inode, mark it as in
+ * use in its group's inode bitmap and return the number of the newly 
+ * allocated inode, or 0 if there are no free inodes left.
+ */
+unsigned int allocate_inode (struct ext2_fs *fs, unsigned int parent_inode,
+        unsigned char type) 
+{
+    unsigned int i;
+    unsigned int group;
+    unsigned int inode;
+    unsigned int num_groups = get_num_groups(fs);
+    unsigned int first_group = 0;
+
+    if (fs->alloc_policy == ALLOC_POLICY_LOCALITY)
+        first_group = find_inode_group(fs, parent_inode, type);
+
+    /* Search each group, starting with the preferred one, for the lowest 
+     * inode not in use */
+    for (i = 0; i < num_groups; i++) {
+        group = (first_group + i) % num_groups;
+        lock_group(fs, group);
+        inode = allocate_inode_in_group(fs, group);
+        unlock_group(fs, group);
+        if (inode) {
+            log_dirty_inode(fs, inode);
+            return inode;
+        }
     }
 
-    return inode;
+    return 0;
 }
 
 /*
- * Allocate the lowest currently unused inode for a new file or directory, 
- * mark it as in use in the inode bitmap and return the number of the newly
- * allocated inode.
+ * Return the group in which a new inode of the given type should be placed,
+ * given that it is being created in the directory referred to by 
+ * parent_inode. Regular files and symlinks stay with their parent. New 
+ * directories are spread out in the spirit of the Orlov allocator: top-level
+ * directories always go to the least loaded group, and nested ones stay with
+ * their parent unless its group is already busier than average.
  */
-unsigned int allocate_inode () 
+unsigned int find_inode_group (struct ext2_fs *fs, unsigned int parent_inode,
+        unsigned char type) 
 {
-    int found = 0;
-    
-    int byte = 1;
-    int bit = 3;
-    int num_bytes = get_super_block()->s_inodes_count / NUM_BITS;
+    struct ext2_super_block *sb = get_super_block(fs);
+    struct ext2_group_desc *gd;
+
+    unsigned int group;
+    unsigned int best_group;
+    unsigned int parent_group = get_inode_group(fs, parent_inode);
+    unsigned int num_groups = get_num_groups(fs);
+    unsigned int avg_free_inodes = sb->s_free_inodes_count / num_groups;
+    unsigned int avg_free_blocks = sb->s_free_blocks_count / num_groups;
+
+    if (type != EXT2_FT_DIR)
+        return parent_group;
+
+    /* The counters are read without taking any group's lock, since they 
+     * only guide the choice of group and allocate_inode_in_group() checks 
+     * them again under the lock */
+    gd = get_group_desc(fs, parent_group);
+    if (parent_inode != EXT2_ROOT_INO && gd->bg_free_inodes_count >= avg_free_inodes &&
+            gd->bg_free_blocks_count >= avg_free_blocks)
+        return parent_group;
+
+    /* Prefer the group with the fewest directories among those with at 
+     * least an average share of free inodes and blocks, breaking ties by 
+     * the number of free blocks */
+    best_group = parent_group;
+    for (group = 0; group < num_groups; group++) {
+        gd = get_group_desc(fs, group);
+        
+        if (gd->bg_free_inodes_count < avg_free_inodes || !gd->bg_free_inodes_count ||
+                gd->bg_free_blocks_count < avg_free_blocks)
+            continue;
+
+        if (gd->bg_used_dirs_count < get_group_desc(fs, best_group)->bg_used_dirs_count ||
+                (gd->bg_used_dirs_count == get_group_desc(fs, best_group)->bg_used_dirs_count &&
+                 gd->bg_free_blocks_count > get_group_desc(fs, best_group)->bg_free_blocks_count))
+            best_group = group;
+    }
+
+    return best_group;
+}
+
+/*
+ * Allocate the lowest currently unused inode in the given group, mark it as
+ * in use and return its number, or 0 if the group has no free inodes. The 
+ * group's lock must be held.
+ */
+unsigned int allocate_inode_in_group (struct ext2_fs *fs, unsigned int group) 
+{
+    unsigned int index;
+    unsigned int inodes_per_group = get_super_block(fs)->s_inodes_per_group;
+    struct group_summary *summary = get_group_summary(fs, group);
+
+    if (!get_group_desc(fs, group)->bg_free_inodes_count)
+        return 0;
+
+    /* Skip over the reserved inodes preceding the first usable one, and 
+     * start no earlier than the group's lowest free inode */
+    index = (group == 0) ? get_inode_index(fs, get_first_ino(fs) + 1) : 0;
+    if (index < summary->first_free_inode)
+        index = summary->first_free_inode;
+
+    index = bitmap_find_first_zero(get_inode_bitmap(fs, group), index, inodes_per_group);
+    if (index >= inodes_per_group)
+        return 0;
+
+    /* Mark the newly allocated bit as used and update free inode counters */
+    BITMAP_SET(get_inode_bitmap(fs, group), index);
+    adjust_free_inodes(fs, group, -1);
+
+    if (index == summary->first_free_inode)
+        summary->first_free_inode = index + 1;
+
+    return group * inodes_per_group + (index + 1);
+}
+
+/*
+ * Allocate a currently unused block, mark it as in use in its group's block
+ * bitmap and return the number of the newly allocated block, or 0 if there 
+ * are no free blocks left. See allocate_blocks() for the meaning of goal.
+ */
+unsigned int allocate_block (struct ext2_fs *fs, unsigned int goal) 
+{
+    unsigned int got;
+    return allocate_blocks(fs, goal, 1, &got);
+}
+
+/*
+ * Allocate a run of up to n contiguous currently unused blocks, mark them as
+ * in use, update the free block counters once for the whole run, and return
+ * the number of the first block in the run, storing its length in got. If no
+ * blocks are free at all, return 0. 
+ *
+ * Under the locality policy, the run starts at goal if that block is free, 
+ * so that a file grows contiguously, and otherwise at the first run of n 
+ * free blocks after goal (wrapping around the disk). Only if there is no
+ * such run is a shorter one returned. A goal of 0 means there is no 
+ * preference. Under the linear policy, the run starts at the lowest free 
+ * block.
+ */
+unsigned int allocate_blocks (struct ext2_fs *fs, unsigned int goal, unsigned int n,
+        unsigned int *got) 
+{
+    struct ext2_super_block *sb = get_super_block(fs);
     
-    unsigned char *inode_bitmap = get_inode_bitmap();
-
-    /* Locate the next available inode, excluding reserved ones */
-    while (!found && byte < num_bytes) {
-        while (!found && bit < NUM_BITS) {
-            if (!IN_USE(inode_bitmap, byte, bit))
-                found = 1;
-            else bit++;
+    unsigned int i;
+    unsigned int group;
+    unsigned int block;
+    unsigned int num_groups = get_num_groups(fs);
+    unsigned int goal_group = 0;
+    unsigned int goal_index = 0;
+    unsigned int min_len;
+    int is_locality = fs->alloc_policy == ALLOC_POLICY_LOCALITY;
+
+    *got = 0;
+    if (is_locality && goal > sb->s_first_data_block && goal < sb->s_blocks_count) {
+        goal_group = get_block_group(fs, goal);
+        goal_index = get_block_index(fs, goal);
+
+        /* Extend the run the goal belongs to, if the goal itself is free 
+         * (and another thread does not take it first) */
+        if (!is_block_in_use(fs, goal)) {
+            lock_group(fs, goal_group);
+            block = allocate_run_in_group(fs, goal_group, goal_index, n, 1, got);
+            unlock_group(fs, goal_group);
+            if (block)
+                goto found;
+        }
+    }
+
+    /* Look for a run of the full requested length first, then settle for 
+     * whatever free run comes first */
+    for (min_len = (is_locality) ? n : 1; min_len >= 1; min_len = (min_len > 1) ? 1 : 0) {
+        
+        /* Search each group, starting at the goal */
+        for (i = 0; i < num_groups; i++) {
+            group = (goal_group + i) % num_groups;
+            lock_group(fs, group);
+            block = allocate_run_in_group(fs, group, (i == 0) ? goal_index : 0, n, 
+                min_len, got);
+            unlock_group(fs, group);
+            if (block)
+                goto found;
         }
 
-        if (!found) {
-            byte++;
-            bit = 0;
+        /* Finally, try the part of the goal's group preceding the goal itself */
+        if (goal_index) {
+            lock_group(fs, goal_group);
+            block = allocate_run_in_group(fs, goal_group, 0, n, min_len, got);
+            unlock_group(fs, goal_group);
+            if (block)
+                goto found;
         }
     }
 
-    /* Mark the newly allocated bit as used and update free inode counters */
-    MARK_AS_USED(inode_bitmap, byte, bit);
-    get_super_block()->s_free_inodes_count--;
-    get_group_desc()->bg_free_inodes_count--;
-    
-    /* Return the correct inode number given the final byte and bit indices */
-    return byte * NUM_BITS + (bit + 1);
+    return 0;
+
+found:
+    /* Logging may write to the dirty log, so it waits until no group lock
+     * is held */
+    log_dirty_blocks(fs, block, *got);
+    return block;
 }
 
 /*
- * Allocate the lowest currently unused block, mark it as in use in the block
- * bitmap and return the number of the newly allocated block.
+ * Allocate the first run of at least min_len (and at most max_len) free 
+ * blocks in the given group that starts at or after the position start in 
+ * its bitmap, mark it as in use and return the number of its first block, 
+ * storing its length in got. Return 0 if there is no such run. The group's
+ * lock must be held.
  */
-unsigned int allocate_block () 
+unsigned int allocate_run_in_group (struct ext2_fs *fs, unsigned int group,
+        unsigned int start, unsigned int max_len, unsigned int min_len, unsigned int *got)
 {
-    int found = 0;
+    unsigned char *block_bitmap = get_block_bitmap(fs, group);
+    unsigned int num_blocks = get_blocks_in_group(fs, group);
+    struct group_summary *summary = get_group_summary(fs, group);
     
-    int byte = 0;
-    int bit = 0; 
-    int num_bytes = get_super_block()->s_blocks_count / NUM_BITS;
+    unsigned int index;
+    unsigned int end;
+
+    if (!get_group_desc(fs, group)->bg_free_blocks_count)
+        return 0;
+
+    /* Skip the group entirely if it has no long enough free run */
+    if (min_len > 1 && summary->longest_free_run == SUMMARY_RUN_UNKNOWN)
+        summary->longest_free_run = find_longest_free_run(fs, group);
+    if (summary->longest_free_run < min_len)
+        return 0;
+
+    /* There are no free blocks before the group's lowest free one */
+    if (start < summary->first_free_block)
+        start = summary->first_free_block;
+
+    index = (min_len > 1) ? 
+        bitmap_find_zero_run(block_bitmap, start, num_blocks, min_len) :
+        bitmap_find_first_zero(block_bitmap, start, num_blocks);
     
-    unsigned char *block_bitmap = get_block_bitmap();
-
-    /* Locate the next available block */
-    while (!found && byte < num_bytes) {
-        while (!found && bit < NUM_BITS) {
-            if (!IN_USE(block_bitmap, byte, bit)) 
-                found = 1;
-            else bit++;
+    if (index >= num_blocks) {
+        /* If the whole group was searched, we now know it has no free run 
+         * of min_len blocks */
+        if (start == summary->first_free_block) {
+            summary->longest_free_run = min_len - 1;
+            if (min_len == 1)
+                summary->first_free_block = num_blocks;
         }
+        return 0;
+    }
 
-        if (!found) {
-            byte++;
-            bit = 0;
-        }
+    /* The run extends up to the next block in use, or max_len blocks */
+    end = (num_blocks - index > max_len) ? index + max_len : num_blocks;
+    end = bitmap_find_first_set(block_bitmap, index, end);
+
+    /* Mark the newly allocated run as used and update free block counters */
+    bitmap_set_range(block_bitmap, index, end - index);
+    adjust_free_blocks(fs, group, -(int) (end - index));
+
+    if (index == summary->first_free_block)
+        summary->first_free_block = end;
+
+    *got = end - index;
+    return get_group_first_block(fs, group) + index;
+}
+
+/*
+ * Return the next block of the given run, allocating a new run of up to
+ * run->remaining blocks (starting right after the previous one, if possible)
+ * once the current one is used up. Return 0 if there are no free blocks left.
+ */
+unsigned int take_block (struct ext2_fs *fs, struct block_run *run) 
+{
+    unsigned int block;
+    unsigned int got;
+
+    /* Once the expected blocks are used up, any further ones are taken 
+     * one at a time */
+    if (run->next == run->end) {
+        block = allocate_blocks(fs, run->goal, MAX(run->remaining, 1), &got);
+        if (!block)
+            return 0;
+
+        run->next = block;
+        run->end = block + got;
     }
 
-    /* Mark the newly allocated bit as used and update free block counters */
-    MARK_AS_USED(block_bitmap, byte, bit);
-    get_super_block()->s_free_blocks_count--;
-    get_group_desc()->bg_free_blocks_count--;
-    
-    /* Return the correct block number given the final byte and bit indices */
-    return byte * NUM_BITS + (bit + 1);
+    run->goal = run->next + 1;
+    if (run->remaining)
+        run->remaining--;
+    return run->next++;
+}
+
+/*
+ * Return the block allocation goal for a file that has no blocks yet, i.e.
+ * the start of the group holding its inode.
+ */
+unsigned int get_block_goal (struct ext2_fs *fs, unsigned int inode) 
+{
+    return get_group_first_block(fs, get_inode_group(fs, inode));
+}
+
+/*
+ * Add delta to the free block counters of the superblock and the given group,
+ * whose lock must be held. The superblock is shared by all groups, so its
+ * counter is updated atomically.
+ */
+void adjust_free_blocks (struct ext2_fs *fs, unsigned int group, int delta) 
+{
+    __atomic_fetch_add(&get_super_block(fs)->s_free_blocks_count, delta, __ATOMIC_RELAXED);
+    get_group_desc(fs, group)->bg_free_blocks_count += delta;
+    journal_count_allocs(fs, delta);
+}
+
+/*
+ * Add delta to the free inode counters of the superblock and the given group,
+ * as described for adjust_free_blocks().
+ */
+void adjust_free_inodes (struct ext2_fs *fs, unsigned int group, int delta) 
+{
+    __atomic_fetch_add(&get_super_block(fs)->s_free_inodes_count, delta, __ATOMIC_RELAXED);
+    get_group_desc(fs, group)->bg_free_inodes_count += delta;
+    journal_count_allocs(fs, delta);
+}
+
+/*
+ * Add delta to the directory count of the given group.
+ */
+void adjust_used_dirs (struct ext2_fs *fs, unsigned int group, int delta) 
+{
+    lock_group(fs, group);
+    get_group_desc(fs, group)->bg_used_dirs_count += delta;
+    unlock_group(fs, group);
 }
 
 /*
@@ -162,418 +706,1517 @@ unsigned int allocate_block ()
  * the given name, and return its inode number if it is found. Otherwise,
  * return 0.
  */
-unsigned int find_entry (unsigned int parent_inode, char *entry_name) 
+unsigned int find_entry (struct ext2_fs *fs, unsigned int parent_inode, char *entry_name) 
 {
-    int k = 0;
-    unsigned long block_pos;
-    char current_name[EXT2_NAME_LEN + 1];
+    return lookup_inode(fs, parent_inode, entry_name, strlen(entry_name));
+}
 
-    struct ext2_inode *parent_ino = get_inode(parent_inode);
-    struct ext2_dir_entry *cur_entry;
+/*
+ * Return the inode number of the entry of the directory referred to by 
+ * parent_inode with the name_len character name, or 0 if there is none. 
+ * Answers, including negative ones, are kept in the dentry cache, so each
+ * name is only searched for once per process.
+ */
+unsigned int lookup_inode (struct ext2_fs *fs, unsigned int parent_inode,
+        const char *name, int name_len) 
+{
+    unsigned int inode;
+
+    if (dcache_lookup(fs, parent_inode, name, name_len, &inode))
+        return inode;
+
+    lock_inode_shared(fs, parent_inode);
+    inode = lookup_inode_locked(fs, parent_inode, name, name_len);
+    unlock_inode(fs, parent_inode);
+    return inode;
+}
+
+/*
+ * Look up the name_len character name as described for lookup_inode(), with
+ * the directory's lock already held. The answer is cached before the lock is
+ * released, so the cache never goes back to a stale one. A directory being
+ * freed has no entries left to find.
+ */
+unsigned int lookup_inode_locked (struct ext2_fs *fs, unsigned int parent_inode,
+        const char *name, int name_len) 
+{
+    struct ext2_dir_entry *entry;
+    unsigned int inode;
+
+    if (get_inode(fs, parent_inode)->i_dtime)
+        return 0;
+
+    if (dcache_lookup(fs, parent_inode, name, name_len, &inode))
+        return inode;
+
+    entry = lookup_entry(fs, parent_inode, name, name_len, NULL);
+    inode = (entry) ? entry->inode : 0;
+
+    dcache_insert(fs, parent_inode, name, name_len, inode);
+    return inode;
+}
+
+/*
+ * Return the live entry of the directory referred to by parent_inode with 
+ * the name_len character name, or NULL if there is none. If prev is not 
+ * NULL, the entry preceding it in its block (or NULL if it is the first) is
+ * stored there. Indexed directories only have the leaf blocks the name's 
+ * hash leads to searched, and others have every block searched in turn.
+ */
+struct ext2_dir_entry *lookup_entry (struct ext2_fs *fs, unsigned int parent_inode,
+        const char *name, int name_len, struct ext2_dir_entry **prev)
+{
+    struct ext2_inode *parent_ino = get_inode(fs, parent_inode);
+    struct ext2_dir_entry *entry;
+    struct dir_iter it;
+
+    if (is_indexed_dir(fs, parent_ino)) {
+        entry = dx_find_entry(fs, parent_inode, name, name_len, prev);
+        if (entry != DX_BAD_INDEX)
+            return entry;
+    }
 
     /* Iterate through all blocks allocated to this directory */
-    while (k < NUM_INITIAL_DIRECT_BLOCKS && parent_ino->i_block[k]) {
-        block_pos = 0;
+    dir_iter_init(&it, parent_ino, 0);
+    while (dir_iter_next(fs, &it)) {
+        if (ENTRY_HAS_NAME(it.entry, name, name_len)) {
+            if (prev)
+                *prev = it.prev;
+            return it.entry;
+        }
+    }
 
-        /* Iterate through all entries in the current block, checking their names */
-        while (block_pos < EXT2_BLOCK_SIZE) {
-            cur_entry = get_entry(parent_ino->i_block[k], block_pos);
+    return NULL;
+}
 
-            memcpy(current_name, cur_entry->name, cur_entry->name_len);
-            current_name[cur_entry->name_len] = '\0';
+/*
+ * Return the live entry of the given directory block with the name_len 
+ * character name, or NULL if there is none, storing the entry before it in
+ * prev (if not NULL) as described for lookup_entry().
+ */
+struct ext2_dir_entry *search_dir_block (struct ext2_fs *fs, unsigned int block,
+        const char *name, int name_len, struct ext2_dir_entry **prev)
+{
+    struct dir_iter it;
+
+    dir_iter_init_block(&it, block, 0);
+    while (dir_iter_next(fs, &it)) {
+        if (ENTRY_HAS_NAME(it.entry, name, name_len)) {
+            if (prev)
+                *prev = it.prev;
+            return it.entry;
+        }
+    }
 
-            /* Found an entry with the same name, so return its inode number */
-            if (!strcmp(current_name, entry_name))
-                return cur_entry->inode;
+    return NULL;
+}
 
-            block_pos += cur_entry->rec_len;
+/*
+ * Create a new directory entry with given inode, name and type, with the 
+ * directory referred to by parent_inode as its parent. An inode with no 
+ * links is taken to be a newly allocated one, which is initialized (along 
+ * with the . and .. entries of a directory), and any other inode gains a 
+ * link. Return 0 on success, EEXIST if the name is already taken, ENOENT if
+ * the parent or the linked inode is being removed, or ENOSPC if there is no
+ * room for the entry, in which case a new inode is freed again.
+ */
+int create_entry (struct ext2_fs *fs, unsigned int parent_inode,
+        unsigned int entry_inode, char *entry_name, unsigned char type)
+{
+    struct ext2_inode *parent_ino = get_inode(fs, parent_inode);
+    struct ext2_inode *entry_ino = get_inode(fs, entry_inode);
+    int name_len = strlen(entry_name);
+    int is_new;
+    int ret_val = 0;
+
+    /* An existing inode gains its link before the entry exists, so it cannot
+     * be freed in the meantime. A new one cannot be reached by any other 
+     * thread until its entry is in place, so it is set up unlocked. */
+    lock_inode(fs, entry_inode);
+    is_new = !entry_ino->i_links_count;
+    if (!is_new && entry_ino->i_dtime)
+        ret_val = ENOENT;
+    else if (!is_new) 
+        entry_ino->i_links_count++;
+    unlock_inode(fs, entry_inode);
+
+    if (ret_val)
+        return ret_val;
+    if (is_new)
+        init_inode(fs, entry_inode, type);
+    log_dirty_inode(fs, parent_inode);
+    log_dirty_inode(fs, entry_inode);
+
+    lock_inode(fs, parent_inode);
+    if (parent_ino->i_dtime)
+        ret_val = ENOENT;
+    else if (lookup_inode_locked(fs, parent_inode, entry_name, name_len))
+        ret_val = EEXIST;
+    else
+        ret_val = add_entry(fs, parent_inode, entry_inode, entry_name, type);
+
+    /* If the entry we are creating is a new directory, it needs . and .. 
+     * entries, which are in place before the parent is unlocked */
+    if (!ret_val && is_new && type == EXT2_FT_DIR) {
+        ret_val = add_entry(fs, entry_inode, entry_inode, ".", EXT2_FT_DIR);
+        if (!ret_val) {
+            entry_ino->i_links_count++;
+            ret_val = add_entry(fs, entry_inode, parent_inode, "..", EXT2_FT_DIR);
         }
 
-        k++;
+        if (!ret_val)
+            parent_ino->i_links_count++;
+        else 
+            unlink_entry(fs, parent_inode, entry_name, name_len);
+    }
+
+    if (!ret_val)
+        dcache_insert(fs, parent_inode, entry_name, name_len, entry_inode);
+    unlock_inode(fs, parent_inode);
+
+    /* Take back the link the entry would have been */
+    if (ret_val && put_link(fs, entry_inode, FALSE))
+        free_resources(fs, entry_inode);
+    return ret_val;
+}
+
+/*
+ * Place a new entry with the given inode, name and type in the directory 
+ * referred to by parent_inode, whose lock must be held (unless no other 
+ * thread can reach it yet). Neither the inode nor the dentry cache is 
+ * updated. Return 0 on success, or ENOSPC if the directory cannot grow.
+ */
+int add_entry (struct ext2_fs *fs, unsigned int parent_inode,
+        unsigned int entry_inode, char *entry_name, unsigned char type)
+{
+    struct ext2_inode *parent_ino = get_inode(fs, parent_inode);
+    struct ext2_dir_entry *cur_entry = NULL;
+
+    /* Indexed directories keep the entry in the leaf block its name hashes to,
+     * and only fall back to being ordinary directories if the index is 
+     * damaged */
+    if (is_indexed_dir(fs, parent_ino)) {
+        cur_entry = dx_add_entry(fs, parent_inode, entry_name, strlen(entry_name));
+        if (!cur_entry && is_indexed_dir(fs, parent_ino))
+            return ENOSPC;
     }
 
+    if (!cur_entry)
+        cur_entry = add_linear_entry(fs, parent_inode, entry_name);
+    if (!cur_entry)
+        return ENOSPC;
+
+    /* Set the other fields of our new dir_entry */
+    cur_entry->inode = entry_inode;
+    cur_entry->name_len = strlen(entry_name);
+    cur_entry->file_type = type;
+
+    /* Names are not NUL-terminated on disk, and a byte past the name may 
+     * already belong to the next entry */
+    memcpy(cur_entry->name, entry_name, cur_entry->name_len);
     return 0;
 }
 
 /*
- * Create a new directory entry with given inode, name and type, with the 
- * directory referred to by parent_inode as its parent.
+ * Make room for a new entry with the given name in the unindexed directory
+ * referred to by parent_inode. The entry goes after the last entry of the 
+ * first block with enough room there, as always. Failing that, it goes in 
+ * the first large enough gap left behind by removed entries, and only then
+ * in a new block. Filling the tails first keeps removed entries restorable 
+ * for as long as possible. The directory's free-space map is consulted so 
+ * that only blocks known to have room are looked at; if memory is too short
+ * for one, every block is looked at instead. A directory outgrowing
+ * its first block gets a hash index instead, if the file system allows it.
+ * Return the new entry, whose rec_len is set but whose other fields are not,
+ * or NULL if there are no free blocks left.
  */
-void create_entry (unsigned int parent_inode, unsigned int entry_inode, 
-        char *entry_name, unsigned char type) 
+struct ext2_dir_entry *add_linear_entry (struct ext2_fs *fs, unsigned int parent_inode,
+        char *entry_name) 
 {
     /* The actual size of the new dir_entry we are trying to create is the size
      * of the dir_entry struct plus the length of the name, rounded up to the 
      * nearest multiple of 4 */
     int dir_entry_size = sizeof(struct ext2_dir_entry);
-    int new_actual_len = PAD_REC_LEN(dir_entry_size + strlen(entry_name));
+    int name_len = strlen(entry_name);
+    int new_actual_len = PAD_REC_LEN(dir_entry_size + name_len);
 
-    int k = 0;
-    int is_inserted = 0;
-    unsigned long block_pos;
+    unsigned int k;
+    unsigned int block;
+    unsigned int num_blocks;
+    int tail_only;
 
-    struct ext2_inode *parent_ino = get_inode(parent_inode);
-    struct ext2_dir_entry *prev;
+    struct ext2_inode *dir = get_inode(fs, parent_inode);
+    struct dir_space_map *map = get_dir_space_map(fs, parent_inode);
     struct ext2_dir_entry *cur_entry;
 
-    /* Loop through the parent directory's blocks, looking for a block with enough
-     * space at the end to fit our new directory entry */
-    while (!is_inserted && k < NUM_INITIAL_DIRECT_BLOCKS && parent_ino->i_block[k]) {
-        block_pos = 0;
+    num_blocks = (map) ? map->num_blocks : dir->i_size / EXT2_BLOCK_SIZE;
+    for (tail_only = TRUE; tail_only >= FALSE; tail_only--) {
+        for (k = 0; k < num_blocks; k++) {
+            if (!map) {
+                cur_entry = insert_into_dir_block(fs, get_block_num(fs, dir, k), name_len,
+                    tail_only);
+                if (cur_entry)
+                    return cur_entry;
+                continue;
+            }
 
-        while (block_pos < EXT2_BLOCK_SIZE) {
-            cur_entry = get_entry(parent_ino->i_block[k], block_pos);
-            block_pos += cur_entry->rec_len;
+            if (map->largest_gap[k] == DIR_GAP_UNKNOWN)
+                map->largest_gap[k] = get_largest_gap(fs, map->blocks[k], &map->tail_gap[k]);
+            if (((tail_only) ? map->tail_gap[k] : map->largest_gap[k]) < new_actual_len)
+                continue;
+
+            /* The caller is yet to fill in the new entry, so this block's 
+             * gaps are recomputed the next time it is looked at */
+            cur_entry = insert_into_dir_block(fs, map->blocks[k], name_len, tail_only);
+            map->largest_gap[k] = DIR_GAP_UNKNOWN;
+            if (cur_entry)
+                return cur_entry;
         }
+    }
 
-        prev = cur_entry;
-        int prev_actual_len = PAD_REC_LEN(dir_entry_size + prev->name_len);
-
-        /* If there is enough space after the final entry of this block to insert
-         * our new entry, do so */
-        if (new_actual_len <= (prev->rec_len - prev_actual_len)) {
-            cur_entry = (struct ext2_dir_entry *) ((unsigned char *)cur_entry +
-                prev_actual_len);
-
-            /* Update the record lengths of our new entry and its predecessor */
-            cur_entry->rec_len = prev->rec_len - prev_actual_len;
-            prev->rec_len = prev_actual_len;
-
-            is_inserted = 1;
-        }
-        else k++;
+    /* A directory that has filled its first block is indexed from now on */
+    if (num_blocks == 1 && !IS_DOT_ENTRY(entry_name) && can_index_dirs(fs) && 
+            !dx_make_indexed(fs, parent_inode)) {
+        drop_dir_space_map(fs, parent_inode);
+        cur_entry = dx_add_entry(fs, parent_inode, entry_name, name_len);
+        if (cur_entry || is_indexed_dir(fs, get_inode(fs, parent_inode)))
+            return cur_entry;
+        map = get_dir_space_map(fs, parent_inode);
     }
 
-    /* If none of the currently allocated blocks had enough space at the end to 
-     * fit our new entry, we need to allocate a new block and insert it there */
-    if (!is_inserted) {
-        unsigned int new_block = allocate_block();
-        
-        /* Append the location of the newly allocated block to the 
-         * parent inode's i_block[] array */
-        parent_ino->i_block[k] = new_block;
+    /* If none of the currently allocated blocks had a large enough gap to 
+     * fit our new entry, we need to allocate a new block and insert it there.
+     * The new block is already a single empty entry spanning the block. */
+    block = add_dir_block(fs, parent_inode);
+    if (!block)
+        return NULL;
 
-        /* New 1024-byte block allocated, so we need two more 512-byte ones */
-        parent_ino->i_blocks += (EXT2_BLOCK_SIZE / DISK_SECTOR_SIZE);
-        parent_ino->i_size += EXT2_BLOCK_SIZE;
+    if (map && add_to_dir_space_map(map, block) < 0)
+        drop_dir_space_map(fs, parent_inode);
+    return get_entry(fs, block, 0);
+}
+
+/*
+ * Return the size of the largest gap in the given directory block that a new
+ * entry could be placed in: the slack after a live entry, or the whole of an
+ * unused record. The gap after the last entry is stored in tail_gap.
+ */
+unsigned int get_largest_gap (struct ext2_fs *fs, unsigned int block,
+        unsigned short *tail_gap) 
+{
+    int dir_entry_size = sizeof(struct ext2_dir_entry);
+    unsigned int largest_gap = 0;
+    unsigned int gap = 0;
+    unsigned long block_pos = 0;
+    struct ext2_dir_entry *cur_entry;
+
+    while (block_pos < EXT2_BLOCK_SIZE) {
+        cur_entry = get_entry(fs, block, block_pos);
+        if (cur_entry->rec_len < dir_entry_size)
+            break;
+
+        gap = cur_entry->rec_len;
+        if (cur_entry->inode)
+            gap -= PAD_REC_LEN(dir_entry_size + cur_entry->name_len);
+        if (gap > largest_gap)
+            largest_gap = gap;
+
+        block_pos += cur_entry->rec_len;
+    }
+
+    *tail_gap = gap;
+    return largest_gap;
+}
+
+/*
+ * Return the free-space map of the unindexed directory referred to by 
+ * dir_inode, building it from the directory's blocks the first time, or 
+ * NULL if memory is short. The map belongs to the directory, so its lock 
+ * must be held while it is used.
+ */
+struct dir_space_map *get_dir_space_map (struct ext2_fs *fs, unsigned int dir_inode) 
+{
+    struct ext2_inode *dir = get_inode(fs, dir_inode);
+    struct dir_space_map *map;
+    unsigned int k;
+
+    pthread_mutex_lock(&fs->space_map_lock);
+    for (map = fs->dir_space_maps; map; map = map->next) {
+        if (map->dir_inode == dir_inode)
+            break;
+    }
+    pthread_mutex_unlock(&fs->space_map_lock);
+
+    if (map)
+        return map;
 
-        cur_entry = get_entry(parent_ino->i_block[k], 0);
+    map = calloc(1, sizeof(struct dir_space_map));
+    if (!map)
+        return NULL;
+
+    map->dir_inode = dir_inode;
+
+    /* Gaps are only computed once a block is looked at */
+    for (k = 0; k < dir->i_size / EXT2_BLOCK_SIZE; k++) {
+        if (add_to_dir_space_map(map, get_block_num(fs, dir, k)) < 0) {
+            free(map->blocks);
+            free(map->tail_gap);
+            free(map->largest_gap);
+            free(map);
+            return NULL;
+        }
+    }
+
+    pthread_mutex_lock(&fs->space_map_lock);
+    map->next = fs->dir_space_maps;
+    fs->dir_space_maps = map;
+    pthread_mutex_unlock(&fs->space_map_lock);
+    return map;
+}
+
+/*
+ * Append the given block, whose gaps are yet to be computed, to the given 
+ * free-space map. Return 0 on success, or -1 if memory is short, in which
+ * case the map is left as it was.
+ */
+int add_to_dir_space_map (struct dir_space_map *map, unsigned int block) 
+{
+    unsigned int capacity;
+    void *grown;
+
+    if (map->num_blocks == map->capacity) {
+        capacity = (map->capacity) ? map->capacity * 2 : 16;
+        if (!(grown = realloc(map->blocks, capacity * sizeof(unsigned int))))
+            return -1;
+        map->blocks = grown;
+        if (!(grown = realloc(map->tail_gap, capacity * sizeof(unsigned short))))
+            return -1;
+        map->tail_gap = grown;
+        if (!(grown = realloc(map->largest_gap, capacity * sizeof(unsigned short))))
+            return -1;
+        map->largest_gap = grown;
+        map->capacity = capacity;
+    }
+
+    map->blocks[map->num_blocks] = block;
+    map->largest_gap[map->num_blocks] = DIR_GAP_UNKNOWN;
+    map->num_blocks++;
+    return 0;
+}
+
+/*
+ * Note that entries have been removed from or restored to the given block of
+ * the directory referred to by dir_inode, so its gaps need recomputing.
+ */
+void mark_dir_space_changed (struct ext2_fs *fs, unsigned int dir_inode,
+        unsigned int block) 
+{
+    struct dir_space_map *map;
+    unsigned int k;
+
+    pthread_mutex_lock(&fs->space_map_lock);
+    for (map = fs->dir_space_maps; map; map = map->next) {
+        if (map->dir_inode == dir_inode)
+            break;
+    }
+    pthread_mutex_unlock(&fs->space_map_lock);
+
+    for (k = 0; map && k < map->num_blocks; k++) {
+        if (map->blocks[k] == block)
+            map->largest_gap[k] = DIR_GAP_UNKNOWN;
+    }
+}
+
+/*
+ * Forget the free-space map of the directory referred to by dir_inode, if it
+ * has one, because its blocks have been rearranged or freed.
+ */
+void drop_dir_space_map (struct ext2_fs *fs, unsigned int dir_inode) 
+{
+    struct dir_space_map **link;
+    struct dir_space_map *map;
+
+    pthread_mutex_lock(&fs->space_map_lock);
+    for (link = &fs->dir_space_maps; (map = *link); link = &map->next) {
+        if (map->dir_inode == dir_inode) {
+            *link = map->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&fs->space_map_lock);
+
+    if (map) {
+        free(map->blocks);
+        free(map->tail_gap);
+        free(map->largest_gap);
+        free(map);
+    }
+}
+
+/*
+ * Make room for a new entry whose name is name_len characters long in the
+ * given directory block, in the first gap large enough to hold it, or only 
+ * in the slack after the last entry if tail_only is set. Return the new 
+ * entry, whose rec_len is set but whose other fields are not, or NULL if 
+ * there is no room.
+ */
+struct ext2_dir_entry *insert_into_dir_block (struct ext2_fs *fs, unsigned int block,
+        int name_len, int tail_only) 
+{
+    int dir_entry_size = sizeof(struct ext2_dir_entry);
+    int new_actual_len = PAD_REC_LEN(dir_entry_size + name_len);
+    int cur_actual_len;
+
+    unsigned long block_pos = 0;
+    struct ext2_dir_entry *cur_entry;
+    struct ext2_dir_entry *new_entry;
+
+    while (block_pos < EXT2_BLOCK_SIZE) {
+        cur_entry = get_entry(fs, block, block_pos);
+        if (cur_entry->rec_len < dir_entry_size)
+            break;
+
+        block_pos += cur_entry->rec_len;
+        if (tail_only && block_pos < EXT2_BLOCK_SIZE)
+            continue;
+
+        /* An unused record can be taken over whole */
+        cur_actual_len = (cur_entry->inode) ? 
+            PAD_REC_LEN(dir_entry_size + cur_entry->name_len) : 0;
         
-        /* Since this is currently the only entry in the block */
-        cur_entry->rec_len = EXT2_BLOCK_SIZE;
+        if (!cur_actual_len && cur_entry->rec_len >= new_actual_len)
+            return cur_entry;
+
+        if (cur_actual_len && cur_entry->rec_len - cur_actual_len >= new_actual_len) {
+            new_entry = (struct ext2_dir_entry *) ((unsigned char *) cur_entry + 
+                cur_actual_len);
+            new_entry->rec_len = cur_entry->rec_len - cur_actual_len;
+            cur_entry->rec_len = cur_actual_len;
+            return new_entry;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Start a walk over the entries of the given directory, block by block, in
+ * the order they are laid out. Only live entries are visited, unless flags
+ * has DIR_ITER_REMOVED set, in which case unused records and the removed 
+ * entries left in the gaps after records are visited too, with is_removed 
+ * set. The index blocks of an indexed directory have no removed entries.
+ */
+void dir_iter_init (struct dir_iter *it, struct ext2_inode *dir, int flags) 
+{
+    memset(it, 0, sizeof(struct dir_iter));
+    it->dir = dir;
+    it->num_blocks = dir->i_size / EXT2_BLOCK_SIZE;
+    it->flags = flags;
+    it->record_pos = EXT2_BLOCK_SIZE;
+}
+
+/*
+ * Start a walk over the entries of the given directory block alone, as 
+ * described for dir_iter_init().
+ */
+void dir_iter_init_block (struct dir_iter *it, unsigned int block, int flags) 
+{
+    memset(it, 0, sizeof(struct dir_iter));
+    it->block = block;
+    it->num_blocks = 1;
+    it->flags = flags;
+    it->record_pos = EXT2_BLOCK_SIZE;
+}
+
+/*
+ * Return whether the record at block_pos in a directory block is sound: its
+ * rec_len covers its name, is a multiple of 4 and stays within the block.
+ */
+int is_valid_dir_record (struct ext2_dir_entry *record, unsigned long block_pos) 
+{
+    return record->rec_len >= sizeof(struct ext2_dir_entry) + record->name_len &&
+        !(record->rec_len % 4) && block_pos + record->rec_len <= EXT2_BLOCK_SIZE;
+}
+
+/*
+ * Advance the walk to the next entry. Return 1 if there is one, setting the
+ * fields of the iterator as described for struct dir_iter. Otherwise, 
+ * return 0. Entries are not copied, so names should be compared in place 
+ * with ENTRY_HAS_NAME().
+ */
+int dir_iter_next (struct ext2_fs *fs, struct dir_iter *it) 
+{
+    int dir_entry_size = sizeof(struct ext2_dir_entry);
+    struct ext2_dir_entry *slot;
+    unsigned long gap_end;
+
+    while (TRUE) {
+        /* A removed entry sits in the gap after the current record for as 
+         * long as its name still fits there */
+        if (it->record && (it->flags & DIR_ITER_REMOVED) && !it->in_index) {
+            gap_end = it->record_pos + it->record->rec_len;
+            if (it->slot_pos + dir_entry_size <= gap_end) {
+                slot = get_entry(fs, it->block, it->slot_pos);
+                it->slot_pos += PAD_REC_LEN(dir_entry_size + slot->name_len);
+
+                if (slot->name_len && it->slot_pos <= gap_end) {
+                    it->entry = slot;
+                    it->is_removed = TRUE;
+                    return TRUE;
+                }
+                continue;
+            }
+        }
+
+        /* Move on to the next record, in the next block if need be */
+        if (it->record) {
+            it->prev = it->record;
+            it->record_pos += it->record->rec_len;
+            it->record = NULL;
+        }
+
+        if (it->record_pos >= EXT2_BLOCK_SIZE && !dir_iter_next_block(fs, it))
+            return FALSE;
+
+        it->record = get_entry(fs, it->block, it->record_pos);
+        if (!is_valid_dir_record(it->record, it->record_pos)) {
+            /* The rest of a damaged block cannot be trusted */
+            it->record = NULL;
+            it->record_pos = EXT2_BLOCK_SIZE;
+            continue;
+        }
+
+        it->slot_pos = it->record_pos + PAD_REC_LEN(dir_entry_size + it->record->name_len);
+        it->entry = it->record;
+        it->is_removed = !it->record->inode;
+
+        if (!it->is_removed || ((it->flags & DIR_ITER_REMOVED) && !it->in_index))
+            return TRUE;
+    }
+}
+
+/*
+ * Move the walk to the start of the next valid block of the directory. 
+ * Return 1 if there is one, or 0 if the walk is over.
+ */
+int dir_iter_next_block (struct ext2_fs *fs, struct dir_iter *it) 
+{
+    unsigned int lblock;
+
+    while (it->next_lblock < it->num_blocks) {
+        lblock = it->next_lblock++;
+        if (it->dir)
+            it->block = get_block_num(fs, it->dir, lblock);
+        if (!is_valid_block(fs, it->block))
+            continue;
+
+        it->in_index = it->dir && (it->flags & DIR_ITER_REMOVED) && 
+            is_indexed_dir(fs, it->dir) && is_dx_node(fs, it->dir, lblock);
+        it->record_pos = 0;
+        it->prev = NULL;
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+/*
+ * Rewrite the given directory block to hold just the num entries in list 
+ * (which must not point into the block itself), packed together at its 
+ * start with the last record stretching to the end of the block. The rest
+ * of the block is zeroed, so no stale entries linger in the slack.
+ */
+void pack_dir_block (unsigned char *block, struct ext2_dir_entry **list, int num) 
+{
+    struct ext2_dir_entry *entry = (struct ext2_dir_entry *) block;
+    unsigned long block_pos = 0;
+    int entry_len;
+    int k;
+
+    for (k = 0; k < num; k++) {
+        entry = (struct ext2_dir_entry *) (block + block_pos);
+        entry_len = PAD_REC_LEN(sizeof(struct ext2_dir_entry) + list[k]->name_len);
+
+        memcpy(entry, list[k], sizeof(struct ext2_dir_entry) + list[k]->name_len);
+        entry->rec_len = entry_len;
+        block_pos += entry_len;
+    }
+
+    memset(block + block_pos, 0, EXT2_BLOCK_SIZE - block_pos);
+
+    if (num)
+        entry->rec_len += EXT2_BLOCK_SIZE - block_pos;
+    else 
+        entry->rec_len = EXT2_BLOCK_SIZE;
+}
+
+/*
+ * Append a new block to the directory referred to by dir_inode, holding a
+ * single empty entry that spans the whole block, and return its number, or
+ * 0 if there are no free blocks left.
+ */
+unsigned int add_dir_block (struct ext2_fs *fs, unsigned int dir_inode) 
+{
+    struct ext2_inode *dir = get_inode(fs, dir_inode);
+    struct ext2_dir_entry *entry;
+
+    unsigned int lblock = dir->i_size / EXT2_BLOCK_SIZE;
+    unsigned int *slot;
+    unsigned int block;
+
+    /* Place the new block right after the directory's last one, together 
+     * with any indirect block needed to map it */
+    struct block_run run = { 0, 0, get_blocks_needed(lblock + 1) - get_blocks_needed(lblock),
+        (lblock) ? get_block_num(fs, dir, lblock - 1) + 1 : get_block_goal(fs, dir_inode) };
+
+    slot = get_block_slot(fs, dir, lblock, &run);
+    block = (slot) ? take_block(fs, &run) : 0;
+    release_run(fs, &run);
+    if (!block)
+        return 0;
+
+    *slot = block;
+
+    /* New 1024-byte block allocated, so we need two more 512-byte ones */
+    dir->i_blocks += (EXT2_BLOCK_SIZE / DISK_SECTOR_SIZE);
+    dir->i_size += EXT2_BLOCK_SIZE;
+
+    entry = get_entry(fs, block, 0);
+    memset(entry, 0, EXT2_BLOCK_SIZE);
+    entry->rec_len = EXT2_BLOCK_SIZE;
+    return block;
+}
+
+/*
+ * Rewrite the entries of the unindexed directory referred to by dir_inode
+ * densely, in their current order, and free the blocks at its end that are
+ * left empty. If is_recursive is set, do the same for every directory below
+ * it. Removed entries are not kept, so they can no longer be restored. 
+ * Indexed directories place their entries by hash, and damaged directories
+ * cannot be packed safely, so both are left as they are. Return the number
+ * of blocks freed, or -1 if memory is short.
+ */
+int compact_dir (struct ext2_fs *fs, unsigned int dir_inode, int is_recursive) 
+{
+    struct ext2_inode *dir = get_inode(fs, dir_inode);
+    struct dir_iter it;
+
+    int num_freed = 0;
+    int ret_val;
+
+    if (!is_indexed_dir(fs, dir) && (num_freed = pack_dir_entries(fs, dir_inode)) < 0)
+        return num_freed;
+
+    if (!is_recursive)
+        return num_freed;
+
+    dir_iter_init(&it, dir, 0);
+    while (dir_iter_next(fs, &it)) {
+        if (IS_DOT_NAME(it.entry->name, it.entry->name_len) || !is_dir(fs, it.entry->inode))
+            continue;
+
+        ret_val = compact_dir(fs, it.entry->inode, TRUE);
+        if (ret_val < 0)
+            return ret_val;
+        num_freed += ret_val;
+    }
+
+    return num_freed;
+}
+
+/*
+ * Pack the entries of the unindexed directory referred to by dir_inode into
+ * as few of its leading blocks as they fit in, as described for 
+ * compact_dir(), and free the rest. Return the number of blocks freed, or 
+ * -1 if memory is short.
+ */
+int pack_dir_entries (struct ext2_fs *fs, unsigned int dir_inode) 
+{
+    struct ext2_inode *dir = get_inode(fs, dir_inode);
+    struct ext2_dir_entry **list;
+    struct dir_iter it;
+
+    unsigned char *copy;
+    unsigned long copy_pos = 0;
+    unsigned int num_blocks = dir->i_size / EXT2_BLOCK_SIZE;
+    unsigned int num_entries = 0;
+    unsigned int lblock = 0;
+    unsigned int first = 0;
+    unsigned int k;
+
+    int entry_len;
+    int block_len = 0;
+    int num_freed;
+
+    for (k = 0; k < num_blocks; k++) {
+        if (!is_valid_block(fs, get_block_num(fs, dir, k)))
+            return 0;
+    }
+
+    /* The entries are copied out first, since packing them overwrites the
+     * blocks they are in */
+    copy = malloc(dir->i_size);
+    list = malloc(dir->i_size / sizeof(struct ext2_dir_entry) * sizeof(struct ext2_dir_entry *));
+    if (!copy || !list) {
+        free(copy);
+        free(list);
+        return -1;
+    }
+
+    dir_iter_init(&it, dir, 0);
+    while (dir_iter_next(fs, &it)) {
+        entry_len = PAD_REC_LEN(sizeof(struct ext2_dir_entry) + it.entry->name_len);
+        if (entry_len > it.entry->rec_len) {
+            free(copy);
+            free(list);
+            return 0;
+        }
+
+        memcpy(copy + copy_pos, it.entry, sizeof(struct ext2_dir_entry) + it.entry->name_len);
+        list[num_entries++] = (struct ext2_dir_entry *) (copy + copy_pos);
+        copy_pos += entry_len;
+    }
+
+    /* Fill each block in turn with as many entries as fit in it */
+    for (k = 0; k <= num_entries; k++) {
+        entry_len = (k < num_entries) ? 
+            PAD_REC_LEN(sizeof(struct ext2_dir_entry) + list[k]->name_len) : 0;
+
+        if (k == num_entries || block_len + entry_len > EXT2_BLOCK_SIZE) {
+            pack_dir_block(get_block(fs, get_block_num(fs, dir, lblock)), list + first, k - first);
+            lblock++;
+            first = k;
+            block_len = 0;
+        }
+        block_len += entry_len;
     }
 
-    /* Set the other fields of our new dir_entry */
-    cur_entry->inode = entry_inode;
-    cur_entry->name_len = strlen(entry_name);
-    cur_entry->file_type = type;
+    free(copy);
+    free(list);
+
+    log_dirty_inode(fs, dir_inode);
+    num_freed = truncate_block_map(fs, dir, lblock);
+    dir->i_size = lblock * EXT2_BLOCK_SIZE;
+    drop_dir_space_map(fs, dir_inode);
+    return num_freed;
+}
+
+/*
+ * Initialize the inode structure with the given number with the requested
+ * file type.
+ */
+void init_inode (struct ext2_fs *fs, unsigned int inode, unsigned char type) 
+{
+    struct ext2_inode *ino = get_inode(fs, inode);
+
+    ino->i_mode = get_imode(type);
+    ino->i_uid = 0;
+    ino->i_size = 0;
+    ino->i_ctime = time(NULL);
+    ino->i_dtime = 0;
+    ino->i_gid = 0;
+    ino->i_links_count = 1;
+    ino->i_blocks = 0;
+    ino->osd1 = 0;
+    memset(ino->i_block, 0, 15 * sizeof(unsigned int));
+    ino->i_generation = 0;
+    ino->i_file_acl = 0;
+    ino->i_dir_acl = 0;
+    ino->i_faddr = 0;
+    memset(ino->extra, 0, 3 * sizeof(unsigned int));
+
+    if (type == EXT2_FT_DIR)
+        adjust_used_dirs(fs, get_inode_group(fs, inode), 1);
+}
+
+/*
+ * Write the contents supplied by src to the data blocks of the specified
+ * (currently empty) inode, whose size must already be set. If src can 
+ * report holes, the blocks it skips and any blocks that are entirely zero 
+ * are left as holes in the block map. Otherwise every block is allocated.
+ * data_blocks is the number of data blocks src is expected to fill, e.g. 
+ * only the allocated part of a sparse source, and sizes the runs the blocks
+ * are taken from. The contents are read a chunk at a time into a buffer 
+ * before the inode's lock is taken, so a slow source does not hold up the
+ * other inodes sharing its lock stripe. Return 0 on success, or -1 if the 
+ * file system ran out of blocks, src failed or the inode was removed before
+ * it could be written.
+ */
+int write_to_inode (struct ext2_fs *fs, unsigned int inode, struct ext2_source *src,
+        unsigned int data_blocks) 
+{
+    struct ext2_inode *ino = get_inode(fs, inode);
+    unsigned long long bytes_left = get_file_size(ino);
+    unsigned int lblock = 0;
+    unsigned int num_blocks;
+    unsigned long len;
+    unsigned char *buf;
+    long long skipped;
+    long filled;
+    int ret_val = 0;
+
+    /* The file's blocks, including its indirect blocks, are laid out in 
+     * order in as few contiguous runs as possible, starting from the 
+     * inode's own group */
+    struct block_run run = { 0, 0, get_blocks_needed(data_blocks), get_block_goal(fs, inode) };
+
+    buf = malloc(WRITE_CHUNK_BLOCKS * EXT2_BLOCK_SIZE);
+    if (!buf) {
+        perror("malloc");
+        return -1;
+    }
+
+    log_dirty_inode(fs, inode);
+    while (bytes_left && !ret_val) {
+        /* Jump over whatever hole the source has at the current position */
+        if (src->skip_hole) {
+            if ((skipped = src->skip_hole(src->ctx)) < 0) {
+                ret_val = -1;
+                break;
+            }
+            if ((unsigned long long) skipped >= bytes_left)
+                break;
+
+            lblock += skipped / EXT2_BLOCK_SIZE;
+            bytes_left -= skipped;
+        }
+
+        len = MIN(bytes_left, (unsigned long long) WRITE_CHUNK_BLOCKS * EXT2_BLOCK_SIZE);
+        num_blocks = (len + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+        if ((filled = read_from_source(src, buf, len)) < 0) {
+            ret_val = -1;
+            break;
+        }
+        memset(buf + filled, 0, num_blocks * EXT2_BLOCK_SIZE - filled);
+
+        /* Removing the file waits for the chunk being written to finish */
+        lock_inode(fs, inode);
+        if (ino->i_links_count && !ino->i_dtime)
+            ret_val = write_file_blocks(fs, ino, lblock, buf, num_blocks, &run, 
+                src->skip_hole != NULL);
+        else 
+            ret_val = -1;
+        unlock_inode(fs, inode);
+
+        lblock += num_blocks;
+        bytes_left -= len;
+    }
+
+    free(buf);
+
+    /* Holes leave part of the last run unused, so give it back */
+    release_run(fs, &run);
+    return ret_val;
+}
+
+/*
+ * Map the num_blocks blocks of file contents in buf to the given inode from
+ * its lblock'th block on, taking the blocks (and any indirect blocks on the
+ * way to them) from run, and copy the contents in, a contiguous run of 
+ * blocks at a time. If is_sparse is set, blocks that are entirely zero are
+ * left as holes. The inode's lock must be held. Return 0 on success, or -1
+ * if the file system ran out of blocks or the image could not be written to.
+ */
+int write_file_blocks (struct ext2_fs *fs, struct ext2_inode *ino, unsigned int lblock,
+        unsigned char *buf, unsigned int num_blocks, struct block_run *run, int is_sparse)
+{
+    unsigned int k;
+    unsigned int block;
+    unsigned int *slot;
+
+    /* The contiguous run of blocks not yet copied in, and where its contents
+     * start in buf */
+    unsigned int fill_start = 0;
+    unsigned int fill_blocks = 0;
+    unsigned int fill_pos = 0;
+
+    for (k = 0; k < num_blocks; k++) {
+        if (is_sparse && bitmap_is_clear(buf + k * EXT2_BLOCK_SIZE, EXT2_BLOCK_SIZE * 8))
+            continue;
+
+        slot = get_block_slot(fs, ino, lblock + k, run);
+        block = (slot) ? take_block(fs, run) : 0;
+        if (!block)
+            return -1;
+
+        *slot = block;
+        ino->i_blocks += (EXT2_BLOCK_SIZE / DISK_SECTOR_SIZE);
+
+        if (fill_blocks && block == fill_start + fill_blocks && k == fill_pos + fill_blocks) {
+            fill_blocks++;
+            continue;
+        }
+
+        if (fill_blocks && copy_file_blocks(fs, fill_start, buf + fill_pos * EXT2_BLOCK_SIZE,
+                fill_blocks) < 0)
+            return -1;
+
+        fill_start = block;
+        fill_blocks = 1;
+        fill_pos = k;
+    }
+
+    if (fill_blocks && copy_file_blocks(fs, fill_start, buf + fill_pos * EXT2_BLOCK_SIZE,
+            fill_blocks) < 0)
+        return -1;
+
+    return 0;
+}
+
+/*
+ * Copy the num_blocks blocks of file contents in buf to the contiguous 
+ * blocks starting at first_block. Return 0 on success, or -1 (after 
+ * printing why) if the image could not be written to.
+ */
+int copy_file_blocks (struct ext2_fs *fs, unsigned int first_block,
+        const unsigned char *buf, unsigned int num_blocks)
+{
+    if (fs->journal)
+        return write_journaled_blocks(fs, first_block, buf, num_blocks);
+
+    memcpy(get_block(fs, first_block), buf, (size_t) num_blocks * EXT2_BLOCK_SIZE);
+    return 0;
+}
+
+/*
+ * Read up to len bytes from src into buf. Sources may supply fewer bytes 
+ * than requested, so keep reading until buf is full or the source runs dry.
+ * Return the number of bytes read, or -1 if src failed.
+ */
+long read_from_source (struct ext2_source *src, unsigned char *buf, unsigned long len) 
+{
+    unsigned long filled = 0;
+    long bytes_read;
+
+    while (filled < len) {
+        bytes_read = src->read(src->ctx, buf + filled, len - filled);
+        if (bytes_read < 0)
+            return -1;
+        if (!bytes_read)
+            break;
+
+        filled += bytes_read;
+    }
+
+    return filled;
+}
+
+/*
+ * Give back the blocks of the given run that were allocated but never used.
+ */
+void release_run (struct ext2_fs *fs, struct block_run *run) 
+{
+    while (run->next < run->end)
+        deallocate_block(fs, run->next++);
+}
+
+/*
+ * Source reader that supplies the contents of a struct buffer_source.
+ */
+long read_from_buffer (void *ctx, unsigned char *buf, unsigned long len) 
+{
+    struct buffer_source *buffer = ctx;
+    unsigned long available = buffer->len - buffer->pos;
+
+    if (len > available)
+        len = available;
+
+    memcpy(buf, buffer->data + buffer->pos, len);
+    buffer->pos += len;
+    return len;
+}
+
+/*
+ * Source reader that supplies the rest of the contents of the file whose 
+ * descriptor ctx points to. Each read goes straight into the caller's 
+ * buffer, so nothing is held in memory no matter how big the file is.
+ */
+long read_from_file (void *ctx, unsigned char *buf, unsigned long len) 
+{
+    return read(*(int *) ctx, buf, len);
+}
+
+/*
+ * Hole skipper for the file whose descriptor ctx points to. Move the file 
+ * offset past the whole blocks of any hole starting at it, as reported by 
+ * SEEK_DATA, and return the number of bytes skipped, or -1 on error. File
+ * systems that do not report holes have none as far as this is concerned.
+ */
+long long skip_file_hole (void *ctx) 
+{
+    int fd = *(int *) ctx;
+    off_t cur = lseek(fd, 0, SEEK_CUR);
+    off_t data;
+
+    if (cur < 0)
+        return -1;
+
+    data = lseek(fd, cur, SEEK_DATA);
+    if (data < 0) {
+        /* ENXIO means the rest of the file is one hole */
+        if (errno != ENXIO)
+            return (lseek(fd, cur, SEEK_SET) < 0) ? -1 : 0;
+
+        if ((data = lseek(fd, 0, SEEK_END)) < 0)
+            return -1;
+    }
+
+    /* Only skip whole blocks, so the offset stays block aligned */
+    data = cur + (data - cur) / EXT2_BLOCK_SIZE * EXT2_BLOCK_SIZE;
+    if (lseek(fd, data, SEEK_SET) < 0)
+        return -1;
+
+    return data - cur;
+}
+
+/*
+ * Return a pointer to the slot of the given inode's block map holding the
+ * number of its lblock'th data block. Any missing indirect blocks on the way
+ * to that slot are taken from run and zeroed, unless run is NULL, in which 
+ * case NULL is returned if the slot does not exist. NULL is also returned 
+ * if an indirect block on the way is not a valid block number.
+ */
+unsigned int *get_block_slot (struct ext2_fs *fs, struct ext2_inode *ino,
+        unsigned int lblock, struct block_run *run)
+{
+    unsigned int *slot;
+    unsigned int level;
+    unsigned int span = 1;
+    unsigned long long offset = lblock;
+
+    if (offset < NUM_INITIAL_DIRECT_BLOCKS)
+        return &ino->i_block[offset];
+
+    /* Find the level of indirection that covers this block, and the offset
+     * of the block within the blocks mapped at that level */
+    offset -= NUM_INITIAL_DIRECT_BLOCKS;
+    for (level = 1; level <= 3; level++) {
+        span *= NUM_INDIRECT_POINTERS;
+        if (offset < span)
+            break;
+        offset -= span;
+    }
+
+    if (level > 3)
+        return NULL;
+
+    /* Descend from the top-level indirect block one level at a time */
+    slot = &ino->i_block[NUM_INITIAL_DIRECT_BLOCKS + level - 1];
+    while (level > 0) {
+        if (!*slot) {
+            if (!run)
+                return NULL;
+
+            *slot = take_block(fs, run);
+            if (!*slot)
+                return NULL;
+
+            memset(get_block(fs, *slot), 0, EXT2_BLOCK_SIZE);
+            ino->i_blocks += (EXT2_BLOCK_SIZE / DISK_SECTOR_SIZE);
+        } else if (!is_valid_block(fs, *slot)) {
+            return NULL;
+        }
+
+        span /= NUM_INDIRECT_POINTERS;
+        slot = (unsigned int *) get_block(fs, *slot) + offset / span;
+        offset %= span;
+        level--;
+    }
+
+    return slot;
+}
+
+/*
+ * Return the number of the given inode's lblock'th data block, or 0 if it 
+ * has none.
+ */
+unsigned int get_block_num (struct ext2_fs *fs, struct ext2_inode *ino,
+        unsigned int lblock) 
+{
+    unsigned int *slot = get_block_slot(fs, ino, lblock, NULL);
+    return (slot) ? *slot : 0;
+}
+
+/*
+ * Return the total number of blocks, including indirect blocks, needed to
+ * store a file with num_blocks data blocks.
+ */
+unsigned int get_blocks_needed (unsigned int num_blocks) 
+{
+    unsigned long long per_block = NUM_INDIRECT_POINTERS;
+    unsigned long long left = num_blocks;
+    unsigned long long total = num_blocks;
+
+    /* Data blocks mapped by the single indirect block */
+    if (left <= NUM_INITIAL_DIRECT_BLOCKS)
+        return total;
+    left -= NUM_INITIAL_DIRECT_BLOCKS;
+    total += 1;
+
+    /* Data blocks mapped by the double indirect block */
+    if (left <= per_block)
+        return total;
+    left -= per_block;
+    total += 1 + (MIN(left, per_block * per_block) + per_block - 1) / per_block;
+
+    /* Data blocks mapped by the triple indirect block */
+    if (left <= per_block * per_block)
+        return total;
+    left -= per_block * per_block;
+    total += 1 + (left + per_block * per_block - 1) / (per_block * per_block) + 
+        (left + per_block - 1) / per_block;
+
+    return total;
+}
+
+/*
+ * Call visit on every block in the given inode's block map: each data block
+ * with level 0, and each indirect block (before the blocks it points to)
+ * with its level of indirection. Holes and block numbers outside the file
+ * system are skipped. If visit returns a nonzero value, the walk stops and
+ * that value is returned. Otherwise, return 0.
+ */
+int walk_block_map (struct ext2_fs *fs, struct ext2_inode *ino, block_visitor visit,
+        void *arg) 
+{
+    int k;
+    int ret_val;
+
+    for (k = 0; k < NUM_INITIAL_DIRECT_BLOCKS; k++) {
+        if (is_valid_block(fs, ino->i_block[k]) && (ret_val = visit(fs, ino->i_block[k], 0, arg)))
+            return ret_val;
+    }
+
+    for (k = 0; k < 3; k++) {
+        ret_val = walk_indirect_block(fs, ino->i_block[NUM_INITIAL_DIRECT_BLOCKS + k], 
+            k + 1, visit, arg);
+        if (ret_val)
+            return ret_val;
+    }
+
+    return 0;
+}
+
+/*
+ * Call visit on the given indirect block of the given level and then on
+ * every block it maps, as described for walk_block_map().
+ */
+int walk_indirect_block (struct ext2_fs *fs, unsigned int block, int level,
+        block_visitor visit, void *arg) 
+{
+    unsigned int *pos;
+    unsigned int *end;
+    int ret_val;
+
+    if (!is_valid_block(fs, block))
+        return 0;
 
-    memcpy(cur_entry->name, entry_name, cur_entry->name_len);
-    cur_entry->name[cur_entry->name_len] = '\0';
+    if ((ret_val = visit(fs, block, level, arg)))
+        return ret_val;
 
-    struct ext2_inode *entry_ino = get_inode(entry_inode);
+    pos = (unsigned int *) get_block(fs, block);
+    end = pos + NUM_INDIRECT_POINTERS;
 
-    /* If the entry we are creating is for a new file, we need to initialize 
-     * the inode struct. Otherwise, simply update the inode's number of 
-     * links. */
-    if (!entry_ino->i_links_count)
-        init_inode(entry_ino, type);
-    else entry_ino->i_links_count++;
+    for (; pos < end; pos++) {
+        if (level > 1)
+            ret_val = walk_indirect_block(fs, *pos, level - 1, visit, arg);
+        else if (is_valid_block(fs, *pos))
+            ret_val = visit(fs, *pos, 0, arg);
 
-    /* If the entry we are creating is a new directory, it needs . and .. entries */
-    if (type == EXT2_FT_DIR && !IS_DOT_ENTRY(entry_name)) {
-        create_entry(entry_inode, entry_inode, ".", EXT2_FT_DIR);
-        create_entry(entry_inode, parent_inode, "..", EXT2_FT_DIR);
+        if (ret_val)
+            return ret_val;
     }
+
+    return 0;
 }
 
 /*
- * Initialize an inode structure with the requested file type.
+ * Free every block of the given inode from logical block num_blocks on, 
+ * along with the indirect blocks that no longer map anything, and update 
+ * i_blocks. Return the number of blocks freed.
  */
-void init_inode (struct ext2_inode *ino, unsigned char type) 
+int truncate_block_map (struct ext2_fs *fs, struct ext2_inode *ino,
+        unsigned int num_blocks) 
 {
-    ino->i_mode = get_imode(type);
-    ino->i_uid = 0;
-    ino->i_size = 0;
-    ino->i_ctime = time(NULL);
-    ino->i_dtime = 0;
-    ino->i_gid = 0;
-    ino->i_links_count = 1;
-    ino->i_blocks = 0;
-    ino->osd1 = 0;
-    memset(ino->i_block, 0, 15 * sizeof(unsigned int));
-    ino->i_generation = 0;
-    ino->i_file_acl = 0;
-    ino->i_dir_acl = 0;
-    ino->i_faddr = 0;
-    memset(ino->extra, 0, 3 * sizeof(unsigned int));
+    unsigned long long first = NUM_INITIAL_DIRECT_BLOCKS;
+    unsigned long long span = NUM_INDIRECT_POINTERS;
+    int num_freed = 0;
+    int k;
 
-    if (type == EXT2_FT_DIR)
-        get_group_desc()->bg_used_dirs_count++;
+    for (k = num_blocks; k < NUM_INITIAL_DIRECT_BLOCKS; k++) {
+        if (is_valid_block(fs, ino->i_block[k])) {
+            deallocate_block(fs, ino->i_block[k]);
+            num_freed++;
+        }
+        ino->i_block[k] = 0;
+    }
+
+    for (k = 0; k < 3; k++) {
+        num_freed += truncate_indirect_block(fs, &ino->i_block[NUM_INITIAL_DIRECT_BLOCKS + k], 
+            k + 1, first, num_blocks);
+        first += span;
+        span *= NUM_INDIRECT_POINTERS;
+    }
+
+    ino->i_blocks -= num_freed * (EXT2_BLOCK_SIZE / DISK_SECTOR_SIZE);
+    return num_freed;
 }
 
 /*
- * Write the given contents to the data blocks of the specified
- * (currently empty) inode.
+ * Free the blocks mapped by the indirect block of the given level pointed 
+ * to by slot, whose first entry maps logical block first, from logical 
+ * block num_blocks on. The indirect block itself is freed, and the slot
+ * cleared, if it is left mapping nothing. Return the number of blocks freed.
  */
-void write_to_inode (unsigned int inode, char *contents) 
+int truncate_indirect_block (struct ext2_fs *fs, unsigned int *slot, int level,
+        unsigned long long first, unsigned int num_blocks)
 {
-    struct ext2_inode *ino = get_inode(inode);
-
-    int direct_pos = 0;
-    int bytes_written = 0;
-    int bytes_to_write = ino->i_size;
+    unsigned int *pos;
+    unsigned long long span = 1;
+    unsigned long long cur;
+    int num_freed = 0;
+    int k;
 
-    int k = 0;
-    int bytes_allocated = 0;
-    
-    unsigned int *indirect_pos = 0;
-    unsigned char *cur_block;
+    if (!is_valid_block(fs, *slot))
+        return 0;
 
-    /* Allocate to this inode all blocks that will be necessary to 
-     * store the specified contents */
-    while (bytes_allocated < bytes_to_write) {
+    for (k = 1; k < level; k++)
+        span *= NUM_INDIRECT_POINTERS;
 
-        if (k < NUM_INITIAL_DIRECT_BLOCKS) {
-            /* In this case, we allocate a direct block normally */
-            ino->i_block[k] = allocate_block();
-            ino->i_blocks += (EXT2_BLOCK_SIZE / DISK_SECTOR_SIZE);
-            k++;
-        
-        } else if (k == NUM_INITIAL_DIRECT_BLOCKS) {
-            /* In this case, we need to allocate a new pointer to a direct
-             * block inside the indirect block */
-            if (!indirect_pos) {
-                ino->i_block[k] = allocate_block();
-                ino->i_blocks += (EXT2_BLOCK_SIZE / DISK_SECTOR_SIZE);
-                indirect_pos = (unsigned int *) get_block(ino->i_block[k]);
-            }
+    pos = (unsigned int *) get_block(fs, *slot);
+    for (k = 0, cur = first; k < NUM_INDIRECT_POINTERS; k++, cur += span) {
+        if (cur + span <= num_blocks)
+            continue;
 
-            *indirect_pos = allocate_block();
-            ino->i_blocks += (EXT2_BLOCK_SIZE / DISK_SECTOR_SIZE);
-            indirect_pos++;
+        if (level > 1) {
+            num_freed += truncate_indirect_block(fs, &pos[k], level - 1, cur, num_blocks);
+        } else if (is_valid_block(fs, pos[k])) {
+            deallocate_block(fs, pos[k]);
+            num_freed++;
+            pos[k] = 0;
         }
+    }
 
-        bytes_allocated += EXT2_BLOCK_SIZE;
+    if (first >= num_blocks) {
+        deallocate_block(fs, *slot);
+        *slot = 0;
+        num_freed++;
     }
 
-    k = 0;
-    indirect_pos = 0;
+    return num_freed;
+}
+
+/*
+ * Return the size in bytes of the file referred to by the given inode. For
+ * regular files, i_dir_acl holds the upper 32 bits of the size.
+ */
+unsigned long long get_file_size (struct ext2_inode *ino) 
+{
+    unsigned long long size = ino->i_size;
 
-    /* Now that all the necessary blocks are allocated, we can write the 
-     * specified contents to the inode */
-    while (bytes_written < bytes_to_write) {
+    if (TYPE_MASK(ino->i_mode) == EXT2_S_IFREG)
+        size |= (unsigned long long) ino->i_dir_acl << 32;
 
-        if (!direct_pos && k < NUM_INITIAL_DIRECT_BLOCKS) {
-            cur_block = get_block(ino->i_block[k]);
-            k++;    
-        
-        } else if (!direct_pos && k == NUM_INITIAL_DIRECT_BLOCKS) {
-            /* In this case, the contents we need to write are too large 
-             * to fit in the initial 12 direct blocks, so we need to use
-             * the single indirect block */
-            indirect_pos = (!indirect_pos) ? 
-                (unsigned int *) get_block(ino->i_block[k]) : 
-                (indirect_pos + 1);
-            cur_block = get_block(*indirect_pos);
-        }
+    return size;
+}
 
-        cur_block[direct_pos] = contents[bytes_written];
+/*
+ * Set the size in bytes of the file referred to by the given inode, marking
+ * the file system as containing large files if necessary.
+ */
+void set_file_size (struct ext2_fs *fs, struct ext2_inode *ino, unsigned long long size) 
+{
+    ino->i_size = (unsigned int) size;
 
-        /* Advance the current position in the block by 1, resetting
-         * back to 0 at EXT2_BLOCK_SIZE */
-        direct_pos = (direct_pos + 1) % EXT2_BLOCK_SIZE;
-        bytes_written++;
+    if (TYPE_MASK(ino->i_mode) == EXT2_S_IFREG) {
+        ino->i_dir_acl = (unsigned int) (size >> 32);
+        
+        if (size > EXT2_MAX_SMALL_FILE_SIZE)
+            __atomic_fetch_or(&get_super_block(fs)->s_feature_ro_compat,
+                EXT2_FEATURE_RO_COMPAT_LARGE_FILE, __ATOMIC_RELAXED);
     }
 }
 
 /*
  * Remove the directory entry with the given name from the parent
- * directory referred to by parent_inode.
+ * directory referred to by parent_inode. Return 0 on success, or ENOENT if
+ * there is no such entry (any more).
  */
-void remove_entry (unsigned int parent_inode, char *entry_name) 
+int remove_entry (struct ext2_fs *fs, unsigned int parent_inode, char *entry_name) 
 {
-    unsigned int entry_inode = find_entry(parent_inode, entry_name);
+    struct ext2_inode *parent_ino = get_inode(fs, parent_inode);
+    unsigned int entry_inode = 0;
 
-    struct ext2_inode *entry_ino = get_inode(entry_inode);
-    struct ext2_inode *parent_ino = get_inode(parent_inode);
-    struct ext2_dir_entry *cur_entry;
-    struct ext2_dir_entry *prev;
-    
-    int k = 0;
-    int found = 0;
-    unsigned long block_pos;
-    char current_name[EXT2_NAME_LEN + 1];
-
-    /* Search through the parent directory's blocks for the target entry */
-    while (!found && k < NUM_INITIAL_DIRECT_BLOCKS && parent_ino->i_block[k]) {
-        block_pos = 0;
-        
-        cur_entry = get_entry(parent_ino->i_block[k], block_pos);
-        memcpy(current_name, cur_entry->name, cur_entry->name_len);
-        current_name[cur_entry->name_len] = '\0';
-
-        if (!strcmp(current_name, entry_name)) {
-            /* If the target entry is the first one in its block, we 
-             * simply zero out its inode field, making this entry
-             * unrecoverable */
-            cur_entry->inode = 0;
-            found = 1;
-        
-        } else {
-            /* Otherwise, we check the rest of the block's entries */
-            block_pos += cur_entry->rec_len;
-
-            while (!found && block_pos < EXT2_BLOCK_SIZE) {
-                prev = cur_entry;
-                cur_entry = get_entry(parent_ino->i_block[k], block_pos);
-
-                memcpy(current_name, cur_entry->name, cur_entry->name_len);
-                current_name[cur_entry->name_len] = '\0';
-
-                if (!strcmp(current_name, entry_name)) {
-                    /* Adjust the previous entry's record length to point to
-                     * the entry after the current one */
-                    prev->rec_len += cur_entry->rec_len;
-                    found = 1;
-                } else {
-                    block_pos += cur_entry->rec_len;
-                }
-            }
-        }
+    lock_inode(fs, parent_inode);
+    if (!parent_ino->i_dtime)
+        entry_inode = unlink_entry(fs, parent_inode, entry_name, strlen(entry_name));
+    unlock_inode(fs, parent_inode);
+
+    if (!entry_inode)
+        return ENOENT;
+    log_dirty_inode(fs, parent_inode);
+    log_dirty_inode(fs, entry_inode);
 
-        k++;
-    }
-    
     /* If this entry is a directory, or is a file with no other hard links
      * to it remaining, we need to free the inode's resources, and, in the 
      * case of a directory, recursively free the resources of all its 
      * entries that match this description as well. Otherwise, simply 
-     * decrement the links count. */
-    if (is_dir(entry_inode)) 
-        get_group_desc()->bg_used_dirs_count--;
+     * decrement the links count. The entry is already gone, so no other 
+     * thread can reach a directory being freed. */
+    if (put_link(fs, entry_inode, FALSE))
+        free_resources(fs, entry_inode);
+    return 0;
+}
+
+/*
+ * Take the entry with the name_len character name out of the directory 
+ * referred to by parent_inode, whose lock must be held, leaving its inode 
+ * as it is. Return the inode number the entry referred to, or 0 if there is
+ * no such entry.
+ */
+unsigned int unlink_entry (struct ext2_fs *fs, unsigned int parent_inode,
+        const char *name, int name_len) 
+{
+    struct ext2_dir_entry *prev;
+    struct ext2_dir_entry *cur_entry = lookup_entry(fs, parent_inode, name, name_len, &prev);
+    unsigned int entry_inode;
+
+    if (!cur_entry)
+        return 0;
+
+    entry_inode = cur_entry->inode;
+    if (!prev) {
+        /* If the target entry is the first one in its block, we simply zero 
+         * out its inode field, making this entry unrecoverable */
+        cur_entry->inode = 0;
+    } else {
+        /* Otherwise, adjust the previous entry's record length to point to
+         * the entry after the current one */
+        prev->rec_len += cur_entry->rec_len;
+    }
+
+    dcache_insert(fs, parent_inode, name, name_len, 0);
+    mark_dir_space_changed(fs, parent_inode, GET_BLOCK_OF(fs, cur_entry));
+    return entry_inode;
+}
 
-    int is_last_copy = !is_dir(entry_inode) && (entry_ino->i_links_count == 1);
-    if (is_dir(entry_inode) || is_last_copy)
-        free_resources(entry_inode, entry_name);
-    else entry_ino->i_links_count--;
+/*
+ * Drop the link to the given inode held by an entry being removed, which is
+ * a . or .. entry if is_dot is set. If that leaves the inode to be freed 
+ * (i.e. it is a directory and this is not a dotted entry, or it is a file 
+ * with no other hard links), its links count is left for free_resources() 
+ * to drop, and it is marked as deleted under its lock instead, so that it 
+ * gains no new entries or links. Return 1 if the caller must now free it, 
+ * and 0 otherwise.
+ */
+int put_link (struct ext2_fs *fs, unsigned int inode, int is_dot) 
+{
+    struct ext2_inode *ino = get_inode(fs, inode);
+    int is_last;
+
+    lock_inode(fs, inode);
+    is_last = (is_dir(fs, inode)) ? !is_dot : ino->i_links_count == 1;
+    if (is_last)
+        ino->i_dtime = time(NULL);
+    else 
+        ino->i_links_count--;
+    unlock_inode(fs, inode);
+
+    return is_last;
 }
 
 /*
  * Deallocate the given inode's blocks and inode number and adjust the 
  * free data block and inode counters accordingly. If this is a directory,
  * recursively deallocate the inodes and blocks of all its entries that are
- * also directories, or files with no remaining hard links.
+ * also directories, or files with no remaining hard links. The inode must
+ * have been claimed by put_link().
  */
-void free_resources (unsigned int inode_num, char *entry_name) 
+void free_resources (struct ext2_fs *fs, unsigned int inode_num) 
 {
-    struct ext2_inode *ino = get_inode(inode_num);
-    struct ext2_inode *cur_ino;
+    struct ext2_inode *ino = get_inode(fs, inode_num);
     struct ext2_dir_entry *cur_entry;
-
-    int k = 0;
-    int is_last_copy;
-    int is_non_dotted_dir;
-
-    unsigned int direct_block;
-    unsigned int *indirect_pos;
-    unsigned int *indirect_end;
-    
-    unsigned long block_pos;
-    char current_name[EXT2_NAME_LEN + 1];
+    struct dir_iter it;
+    unsigned int pending[4];
 
     /* If this is a directory, we need to recursively free the resources of 
-     * all its entries that are directories or files with no hard links */
-    if (is_dir(inode_num)) {
-        while (k < NUM_INITIAL_DIRECT_BLOCKS && ino->i_block[k]) {
-            block_pos = 0;
-
-            while (block_pos < EXT2_BLOCK_SIZE) {
-                cur_entry = get_entry(ino->i_block[k], block_pos);
-                
-                memcpy(current_name, cur_entry->name, cur_entry->name_len);
-                current_name[cur_entry->name_len] = '\0';
-                cur_ino = get_inode(cur_entry->inode);
-
-                is_last_copy = !is_dir(cur_entry->inode) && 
-                    (cur_ino->i_links_count == 1);
-                is_non_dotted_dir = is_dir(cur_entry->inode) && 
-                    !IS_DOT_ENTRY(current_name);
-
-                if (is_last_copy || is_non_dotted_dir) {
-                    /* If the current entry is a non-dotted directory or a 
-                     * file with no remaining hard links, we need to free
-                     * its resources as well */
-                    free_resources(cur_entry->inode, current_name);
-                } else {
-                    /* Otherwise, we simply decrement the inode's links
-                     * count. Note that, in the case of a dotted entry
-                     * (. or ..) we know that this is not the last link
-                     * due to the depth-first nature of the recursion. */
-                    cur_ino->i_links_count--;
-                }
-
-                block_pos += cur_entry->rec_len;
-            }
-
-            k++;
+     * all its entries that are directories or files with no hard links. 
+     * Other threads can no longer change it, so it is walked unlocked. */
+    if (is_dir(fs, inode_num)) {
+        dir_iter_init(&it, ino, 0);
+
+        while (dir_iter_next(fs, &it)) {
+            cur_entry = it.entry;
+
+            /* Non-dotted directories and files with no remaining hard 
+             * links are freed as well, and other inodes just lose a link. 
+             * Note that a dotted entry (. or ..) is never the last link, 
+             * due to the depth-first nature of the recursion. */
+            if (put_link(fs, cur_entry->inode, IS_DOT_NAME(cur_entry->name, 
+                    cur_entry->name_len)))
+                free_resources(fs, cur_entry->inode);
         }
     }
 
-    deallocate_inode(inode_num);
-
-    /* Deallocate all the inode's blocks (but don't zero them out) */
-    k = 0;
-    while (k < NUM_INITIAL_DIRECT_BLOCKS && ino->i_block[k]) {
-        deallocate_block(ino->i_block[k]);
-        k++;
+    /* Every directory freed here, including nested ones, leaves its group */
+    if (is_dir(fs, inode_num)) {
+        adjust_used_dirs(fs, get_inode_group(fs, inode_num), -1);
+        dcache_purge_dir(fs, inode_num);
+        drop_dir_space_map(fs, inode_num);
     }
 
-    if (k == NUM_INITIAL_DIRECT_BLOCKS && ino->i_block[k]) {
-        indirect_pos = (unsigned int *) get_block(ino->i_block[k]);
-        indirect_end = indirect_pos + (EXT2_BLOCK_SIZE / sizeof(unsigned int));
-        direct_block = *indirect_pos;
-
-        while (direct_block && indirect_pos < indirect_end) {
-            deallocate_block(direct_block);
-
-            indirect_pos++;
-            direct_block = *indirect_pos;
-        }
-
-        deallocate_block(ino->i_block[k]);
-    }
+    /* Deallocate all the inode's blocks (but don't zero them out) */
+    memset(pending, 0, sizeof(pending));
+    walk_block_map(fs, ino, deallocate_visitor, pending);
+    deallocate_visitor(fs, 0, 3, pending);
 
     ino->i_dtime = time(NULL);
     ino->i_links_count--;
+
+    /* Only now may another thread reuse the inode */
+    deallocate_inode(fs, inode_num);
 }
 
 /*
  * Mark the specified inode number as free and update the free inode counters.
  */
-void deallocate_inode (unsigned int inode_num) 
+void deallocate_inode (struct ext2_fs *fs, unsigned int inode_num) 
 {
-    unsigned char *inode_bitmap = get_inode_bitmap();
-    int bit = GET_BIT(inode_num);
-    int byte = GET_BYTE(inode_num);
-
-    MARK_AS_FREE(inode_bitmap, byte, bit);
-    get_super_block()->s_free_inodes_count++;
-    get_group_desc()->bg_free_inodes_count++;
+    unsigned int group = get_inode_group(fs, inode_num);
+    unsigned int index = get_inode_index(fs, inode_num);
+    struct group_summary *summary = get_group_summary(fs, group);
+
+    lock_group(fs, group);
+    BITMAP_CLEAR(get_inode_bitmap(fs, group), index);
+    adjust_free_inodes(fs, group, 1);
+
+    if (index < summary->first_free_inode)
+        summary->first_free_inode = index;
+    unlock_group(fs, group);
+    log_dirty_inode(fs, inode_num);
 }
 
 /*
  * Mark the specified block number as free and update the free block counters.
  */
-void deallocate_block (unsigned int block_num) 
+void deallocate_block (struct ext2_fs *fs, unsigned int block_num) 
 {
-    unsigned char *block_bitmap = get_block_bitmap();
-    int bit = GET_BIT(block_num);
-    int byte = GET_BYTE(block_num);
-
-    MARK_AS_FREE(block_bitmap, byte, bit);
-    get_super_block()->s_free_blocks_count++;
-    get_group_desc()->bg_free_blocks_count++;
+    unsigned int group = get_block_group(fs, block_num);
+    unsigned int index = get_block_index(fs, block_num);
+    struct group_summary *summary = get_group_summary(fs, group);
+
+    lock_group(fs, group);
+    BITMAP_CLEAR(get_block_bitmap(fs, group), index);
+    adjust_free_blocks(fs, group, 1);
+
+    /* The freed block may have merged two free runs, so the longest run is
+     * recomputed lazily by the next search that needs it */
+    if (index < summary->first_free_block)
+        summary->first_free_block = index;
+    summary->longest_free_run = SUMMARY_RUN_UNKNOWN;
+    unlock_group(fs, group);
+    log_dirty_blocks(fs, block_num, 1);
+    journal_free_block(fs, block_num);
 }
 
 /*
@@ -581,68 +2224,21 @@ void deallocate_block (unsigned int block_num)
  * (using ext2_rm) entry with the given name. If the entry is found, return
  * its inode number. Otherwise, return 0.
  */
-unsigned int find_removed_entry (unsigned int parent_inode, char *entry_name) 
+unsigned int find_removed_entry (struct ext2_fs *fs, unsigned int parent_inode,
+        char *entry_name) 
 {
-    struct ext2_inode *parent_ino = get_inode(parent_inode);
-    struct ext2_dir_entry *cur_entry;
-
-    int k = 0;
-    int found = 0;
-    int dir_entry_size = sizeof(struct ext2_dir_entry);
-    int actual_cur_len;
-    
-    unsigned int target_inode = 0;
-    unsigned long block_pos, next_intact_pos;
-    
-    char current_name[EXT2_NAME_LEN + 1];
-
-    /* Search through the parent inode's blocks for the removed entry */
-    while (!found && k < NUM_INITIAL_DIRECT_BLOCKS && parent_ino->i_block[k]) {
-        block_pos = 0;
-
-        cur_entry = get_entry(parent_ino->i_block[k], block_pos);
-        memcpy(current_name, cur_entry->name, cur_entry->name_len);
-        current_name[cur_entry->name_len] = '\0';
-
-        if (!strcmp(current_name, entry_name)) {
-            /* If the target entry to restore is the first one in its block,
-             * then we know it is unrecoverable */
-            found = 1;
-        
-        } else {
-            /* Otherwise, search through the rest of the block's entries */
-            while (!found && block_pos < EXT2_BLOCK_SIZE) {
-                cur_entry = get_entry(parent_ino->i_block[k], block_pos);
-                next_intact_pos = block_pos + cur_entry->rec_len;
-
-                actual_cur_len = PAD_REC_LEN(dir_entry_size + cur_entry->name_len);
-                block_pos += actual_cur_len;
-
-                /* Search the gap between the latest intact entry and the next
-                 * intact entry, if such a gap exists */
-                while (!found && block_pos < next_intact_pos) {
-                    cur_entry = get_entry(parent_ino->i_block[k], block_pos);
-                    memcpy(current_name, cur_entry->name, cur_entry->name_len);
-                    current_name[cur_entry->name_len] = '\0';
-
-                    if (!strcmp(current_name, entry_name)) {
-                        /* If this deleted entry has the name we are looking for, then
-                         * we are done */
-                        target_inode = cur_entry->inode;
-                        found = 1;
-                    } else {
-                        /* Otherwise, advance to the next deleted entry slot */
-                        actual_cur_len = PAD_REC_LEN(dir_entry_size + cur_entry->name_len);
-                        block_pos += actual_cur_len;
-                    }
-                }
-            }
-        }
-
-        k++;
+    struct dir_iter it;
+    int name_len = strlen(entry_name);
+
+    /* A removed entry that was the first in its block is left as an unused
+     * record with no inode, so it is found but unrecoverable */
+    dir_iter_init(&it, get_inode(fs, parent_inode), DIR_ITER_REMOVED);
+    while (dir_iter_next(fs, &it)) {
+        if (it.is_removed && ENTRY_HAS_NAME(it.entry, entry_name, name_len))
+            return it.entry->inode;
     }
 
-    return target_inode;
+    return 0;
 }
 
 /*
@@ -653,91 +2249,36 @@ unsigned int find_removed_entry (unsigned int parent_inode, char *entry_name)
  * The second argument signifies whether or not this is the initial call to the
  * function or a nested recursive call.
  */
-int is_recoverable (unsigned int inode_num, int is_first) 
+int is_recoverable (struct ext2_fs *fs, unsigned int inode_num, int is_first) 
 {
-    unsigned char *block_bitmap = get_block_bitmap();
-    unsigned char *inode_bitmap = get_inode_bitmap();
-
     struct ext2_inode *ino;
-    struct ext2_dir_entry *cur_entry;
-
-    unsigned int direct_block;
-    unsigned int *indirect_pos;
-    unsigned int *indirect_end;
-    unsigned long block_pos;
-    
-    int k;
-    int bit = GET_BIT(inode_num);
-    int byte = GET_BYTE(inode_num);
-    
-    char current_name[EXT2_NAME_LEN + 1];
+    struct dir_iter it;
+    int ret_val;
 
     /* First, we check if this inode and all its data blocks are recoverable.
      * If any of them are not, we return 0 if this is the initial call to 
      * is_recoverable(), and -1 otherwise. */
-    if (IN_USE(inode_bitmap, byte, bit)) 
+    if (is_inode_in_use(fs, inode_num)) 
         return ZERO_OR_NEG_ONE(is_first);
     
-    ino = get_inode(inode_num);
-    k = 0;
+    ino = get_inode(fs, inode_num);
 
-    while (k < NUM_INITIAL_DIRECT_BLOCKS && ino->i_block[k]) {
-        bit = GET_BIT(ino->i_block[k]);
-        byte = GET_BYTE(ino->i_block[k]);
-
-        if (IN_USE(block_bitmap, byte, bit))
-            return ZERO_OR_NEG_ONE(is_first);;
-
-        k++;
-    }
-
-    if (k == NUM_INITIAL_DIRECT_BLOCKS && ino->i_block[k]) {
-        bit = GET_BIT(ino->i_block[k]);
-        byte = GET_BYTE(ino->i_block[k]);
-            
-        if (IN_USE(block_bitmap, byte, bit))
-            return ZERO_OR_NEG_ONE(is_first);;
-
-        indirect_pos = (unsigned int *) get_block(ino->i_block[k]);
-        indirect_end = indirect_pos + (EXT2_BLOCK_SIZE / sizeof(unsigned int));
-        direct_block = *indirect_pos;
-
-        while (direct_block && indirect_pos < indirect_end) {
-            bit = GET_BIT(direct_block);
-            byte = GET_BYTE(direct_block);
-                
-            if (IN_USE(block_bitmap, byte, bit))
-                return ZERO_OR_NEG_ONE(is_first);;
-
-            indirect_pos++;
-            direct_block = *indirect_pos;
-        }
-    }
+    /* Indirect blocks are checked before the blocks they point to, so their
+     * contents are only trusted if they have not been reused */
+    if (walk_block_map(fs, ino, in_use_visitor, NULL))
+        return ZERO_OR_NEG_ONE(is_first);
 
     /* Now, if the inode refers to a directory, we recursively check if all 
      * its entries are recoverable, and if any of them are not, return -1 */
-    if (is_dir(inode_num)) {
-        k = 0;
-
-        while (k < NUM_INITIAL_DIRECT_BLOCKS && ino->i_block[k]) {
-            block_pos = 0;
-
-            while (block_pos < EXT2_BLOCK_SIZE) {
-                cur_entry = get_entry(ino->i_block[k], block_pos);
-
-                memcpy(current_name, cur_entry->name, cur_entry->name_len);
-                current_name[cur_entry->name_len] = '\0';
-
-                if (!IS_DOT_ENTRY(current_name)) {
-                    int ret_val = is_recoverable(cur_entry->inode, FALSE);
-                    if (ret_val < 0)
-                        return ret_val;
-                }
-
-                block_pos += cur_entry->rec_len;
+    if (is_dir(fs, inode_num)) {
+        dir_iter_init(&it, ino, 0);
+
+        while (dir_iter_next(fs, &it)) {
+            if (!IS_DOT_NAME(it.entry->name, it.entry->name_len)) {
+                ret_val = is_recoverable(fs, it.entry->inode, FALSE);
+                if (ret_val < 0)
+                    return ret_val;
             }
-
-            k++;
         }
     }
 
@@ -750,65 +2291,35 @@ int is_recoverable (unsigned int inode_num, int is_first)
  * this entry is itself a directory, also attempt to recover as many of its 
  * entries as possible.
  */
-void restore_entry (unsigned int parent_inode, char *entry_name) 
+void restore_entry (struct ext2_fs *fs, unsigned int parent_inode, char *entry_name) 
 {
-    struct ext2_inode *parent_ino = get_inode(parent_inode);
     struct ext2_dir_entry *cur_entry;
-    struct ext2_dir_entry *prev_intact;
-
-    int k = 0;
-    int found = 0;
-    int dir_entry_size = sizeof(struct ext2_dir_entry);
-    int actual_cur_len;
+    struct dir_iter it;
 
-    unsigned long block_pos;
-    unsigned long next_intact_pos;
+    int name_len = strlen(entry_name);
     unsigned long prev_intact_distance;
 
-    char current_name[EXT2_NAME_LEN + 1];
-
-    /* Search through the parent inode's blocks for the removed entry */    
-    while (!found && k < NUM_INITIAL_DIRECT_BLOCKS && parent_ino->i_block[k]) {
-        block_pos = 0;
-
-        while (!found && block_pos < EXT2_BLOCK_SIZE) {
-            cur_entry = get_entry(parent_ino->i_block[k], block_pos);
-            prev_intact = cur_entry;
-
-            next_intact_pos = block_pos + cur_entry->rec_len;
-            prev_intact_distance = 0;
-
-            actual_cur_len = PAD_REC_LEN(dir_entry_size + cur_entry->name_len);
-            block_pos += actual_cur_len;
-
-            /* Search the gap between the latest intact entry and the next
-             * intact entry, if such a gap exists */
-            while (!found && block_pos < next_intact_pos) {
-                cur_entry = get_entry(parent_ino->i_block[k], block_pos);
-                memcpy(current_name, cur_entry->name, cur_entry->name_len);
-                current_name[cur_entry->name_len] = '\0';
-
-                prev_intact_distance += actual_cur_len;
-
-                if (!strcmp(current_name, entry_name)) {
-                    cur_entry->rec_len = prev_intact->rec_len - prev_intact_distance;
-                    prev_intact->rec_len = prev_intact_distance;    
-
-                    /* We are not restoring any hard links, thus we can assume
-                     * that this entry's inode has no other links and its 
-                     * resources now need to be reallocated */
-                    reallocate_resources(cur_entry->inode);
-                    found = 1;
-                
-                } else {
-                    /* Otherwise, advance to the next deleted entry slot */
-                    actual_cur_len = PAD_REC_LEN(dir_entry_size + cur_entry->name_len);
-                    block_pos += actual_cur_len;
-                }
-            }
-        }
-
-        k++;
+    /* Search the gaps between intact entries for the removed entry */
+    dir_iter_init(&it, get_inode(fs, parent_inode), DIR_ITER_REMOVED);
+    while (dir_iter_next(fs, &it)) {
+        cur_entry = it.entry;
+        if (cur_entry == it.record || !ENTRY_HAS_NAME(cur_entry, entry_name, name_len))
+            continue;
+
+        /* Split the record of the intact entry before it in two, so the
+         * entry is back in the rec_len chain */
+        prev_intact_distance = (unsigned char *) cur_entry - (unsigned char *) it.record;
+        cur_entry->rec_len = it.record->rec_len - prev_intact_distance;
+        it.record->rec_len = prev_intact_distance;
+
+        /* We are not restoring any hard links, thus we can assume
+         * that this entry's inode has no other links and its 
+         * resources now need to be reallocated */
+        log_dirty_inode(fs, parent_inode);
+        reallocate_resources(fs, cur_entry->inode);
+        dcache_insert(fs, parent_inode, entry_name, name_len, cur_entry->inode);
+        mark_dir_space_changed(fs, parent_inode, it.block);
+        return;
     }
 }
 
@@ -817,21 +2328,13 @@ void restore_entry (unsigned int parent_inode, char *entry_name)
  * update the associated counters. If the inode is a directory, also attempt
  * to reallocate the resources of as many of its entries as possible.
  */
-void reallocate_resources (unsigned int inode_num) 
+void reallocate_resources (struct ext2_fs *fs, unsigned int inode_num) 
 {
-    struct ext2_inode *ino = get_inode(inode_num);
+    struct ext2_inode *ino = get_inode(fs, inode_num);
     struct ext2_inode *cur_ino;
     struct ext2_dir_entry *cur_entry;
-
-    unsigned int direct_block;
-    unsigned int *indirect_pos;
-    unsigned int *indirect_end;
-    
-    unsigned long block_pos;
+    struct dir_iter it;
     
-    char current_name[EXT2_NAME_LEN + 1];
-    
-    int k = 0;
     int is_file_with_no_links;
     int is_non_dotted_dir;
 
@@ -839,66 +2342,38 @@ void reallocate_resources (unsigned int inode_num)
      * inode then we terminate this reallocation call. Note that if this
      * attempt fails, we know the inode is a directory since we know we are
      * not restoring any files with existing links. */
-    if (!attempt_inode_reallocation(inode_num))
+    if (!attempt_inode_reallocation(fs, inode_num))
         return;
 
     /* If inode reallocation succeeded, we proceed with trying to recover as
      * many of its blocks as possible. */
-    while (k < NUM_INITIAL_DIRECT_BLOCKS && ino->i_block[k]) {
-        attempt_block_reallocation(ino->i_block[k]);
-        k++;
-    }
-
-    if (k == NUM_INITIAL_DIRECT_BLOCKS && ino->i_block[k]) {
-        attempt_block_reallocation(ino->i_block[k]);
-
-        indirect_pos = (unsigned int *) get_block(ino->i_block[k]);
-        indirect_end = indirect_pos + (EXT2_BLOCK_SIZE / sizeof(unsigned int));
-        direct_block = *indirect_pos;
-
-        while (direct_block && indirect_pos < indirect_end) {
-            attempt_block_reallocation(direct_block);
-            indirect_pos++;
-            direct_block = *indirect_pos;
-        }
-    }
+    walk_block_map(fs, ino, reallocate_visitor, NULL);
 
     /* If this inode is a directory, we need to recursively attempt to free as
      * many of its entries as possible that are also directories, or files
      * with no existing links. */
-    if (is_dir(inode_num)) {
-        k = 0;
-
-        while (k < NUM_INITIAL_DIRECT_BLOCKS && ino->i_block[k]) {
-            block_pos = 0;
-
-            while (block_pos < EXT2_BLOCK_SIZE) {
-                cur_entry = get_entry(ino->i_block[k], block_pos);
-
-                memcpy(current_name, cur_entry->name, cur_entry->name_len);
-                current_name[cur_entry->name_len] = '\0';
-                cur_ino = get_inode(cur_entry->inode);
-
-                is_file_with_no_links = !is_dir(cur_entry->inode) && 
-                    (!cur_ino->i_links_count);
-                is_non_dotted_dir = is_dir(cur_entry->inode) && 
-                    !IS_DOT_ENTRY(current_name);
-
-                if (is_file_with_no_links || is_non_dotted_dir) {
-                    /* In this case, we recursively attempt to reallocate this
-                     * entry's resources. */    
-                    reallocate_resources(cur_entry->inode);
-                
-                } else {
-                    /* Otherwise, we simply increment its inode's links count
-                     * and move on. */
-                    cur_ino->i_links_count++;
-                }
-
-                block_pos += cur_entry->rec_len;
+    if (is_dir(fs, inode_num)) {
+        dir_iter_init(&it, ino, 0);
+
+        while (dir_iter_next(fs, &it)) {
+            cur_entry = it.entry;
+            cur_ino = get_inode(fs, cur_entry->inode);
+
+            is_file_with_no_links = !is_dir(fs, cur_entry->inode) && 
+                (!cur_ino->i_links_count);
+            is_non_dotted_dir = is_dir(fs, cur_entry->inode) && 
+                !IS_DOT_NAME(cur_entry->name, cur_entry->name_len);
+
+            if (is_file_with_no_links || is_non_dotted_dir) {
+                /* In this case, we recursively attempt to reallocate this
+                 * entry's resources. */    
+                reallocate_resources(fs, cur_entry->inode);
+            
+            } else {
+                /* Otherwise, we simply increment its inode's links count
+                 * and move on. */
+                cur_ino->i_links_count++;
             }
-
-            k++;
         }
     }
 
@@ -906,133 +2381,330 @@ void reallocate_resources (unsigned int inode_num)
      * set to 0, and its link count should be incremented. */
     ino->i_dtime = 0;
     ino->i_links_count++;
-    if (is_dir(inode_num))
-        get_group_desc()->bg_used_dirs_count++;
+    if (is_dir(fs, inode_num))
+        adjust_used_dirs(fs, get_inode_group(fs, inode_num), 1);
 }
 
 /*
  * If the specified inode number is free, mark it as used, update the free 
  * inode counters and return 1. Otherwise, return 0.
  */
-int attempt_inode_reallocation (unsigned int inode_num) 
+int attempt_inode_reallocation (struct ext2_fs *fs, unsigned int inode_num) 
 {
-    unsigned char *inode_bitmap = get_inode_bitmap();
-    int bit = GET_BIT(inode_num);
-    int byte = GET_BYTE(inode_num);
-
-    if (!IN_USE(inode_bitmap, byte, bit)) {
-        MARK_AS_USED(inode_bitmap, byte, bit);
-        get_super_block()->s_free_inodes_count--;
-        get_group_desc()->bg_free_inodes_count--;
-        return 1;
+    unsigned int group = get_inode_group(fs, inode_num);
+    unsigned char *inode_bitmap = get_inode_bitmap(fs, group);
+    unsigned int index = get_inode_index(fs, inode_num);
+    int is_free;
+
+    lock_group(fs, group);
+    is_free = !BITMAP_TEST(inode_bitmap, index);
+    if (is_free) {
+        BITMAP_SET(inode_bitmap, index);
+        adjust_free_inodes(fs, group, -1);
     }
+    unlock_group(fs, group);
 
-    return 0;
+    if (is_free)
+        log_dirty_inode(fs, inode_num);
+    return is_free;
 }
 
 /*
  * If the specified block number is free, mark it as used, update the free
  * block counters.
  */
-void attempt_block_reallocation (unsigned int block_num) 
+void attempt_block_reallocation (struct ext2_fs *fs, unsigned int block_num) 
+{
+    unsigned int group = get_block_group(fs, block_num);
+    unsigned char *block_bitmap = get_block_bitmap(fs, group);
+    unsigned int index = get_block_index(fs, block_num);
+
+    lock_group(fs, group);
+    if (!BITMAP_TEST(block_bitmap, index)) {
+        BITMAP_SET(block_bitmap, index);
+        adjust_free_blocks(fs, group, -1);
+    }
+    unlock_group(fs, group);
+    log_dirty_blocks(fs, block_num, 1);
+}
+
+/*
+ * Block map visitor that deallocates each block. An indirect block is only 
+ * freed once the walk is done reading it, since another thread could reuse
+ * it right away: arg holds the indirect block still being read at each 
+ * level, and the walk has moved past all of those at or below the level of
+ * the block being visited. A final call with a level of 3 and a block of 0
+ * frees the rest.
+ */
+int deallocate_visitor (struct ext2_fs *fs, unsigned int block, int level, void *arg) 
 {
-    unsigned char *block_bitmap = get_block_bitmap();
-    int bit = GET_BIT(block_num);
-    int byte = GET_BYTE(block_num);
+    unsigned int *pending = arg;
+    int k;
 
-    if (!IN_USE(block_bitmap, byte, bit)) {
-        MARK_AS_USED(block_bitmap, byte, bit);
-        get_super_block()->s_free_blocks_count--;
-        get_group_desc()->bg_free_blocks_count--;
+    if (!level) {
+        deallocate_block(fs, block);
+        return 0;
+    }
+
+    for (k = 1; k <= level; k++) {
+        if (pending[k])
+            deallocate_block(fs, pending[k]);
+        pending[k] = 0;
     }
+
+    pending[level] = block;
+    return 0;
+}
+
+/*
+ * Block map visitor that stops the walk at the first block in use.
+ */
+int in_use_visitor (struct ext2_fs *fs, unsigned int block, int level, void *arg) 
+{
+    return is_block_in_use(fs, block);
+}
+
+/*
+ * Block map visitor that attempts to reallocate each block.
+ */
+int reallocate_visitor (struct ext2_fs *fs, unsigned int block, int level, void *arg) 
+{
+    attempt_block_reallocation(fs, block);
+    return 0;
 }
 
 /* 
  * Return 1 if the given inode refers to a directory on the current disk,
  * and returns 0 otherwise.
  */
-int is_dir (unsigned int inode) 
+int is_dir (struct ext2_fs *fs, unsigned int inode) 
 {
-    struct ext2_inode *ino = get_inode(inode);
+    struct ext2_inode *ino = get_inode(fs, inode);
     return TYPE_MASK(ino->i_mode) == EXT2_S_IFDIR;
 }
 
 /*
  * Return a pointer to the file system's super block.
  */
-struct ext2_super_block *get_super_block () 
+struct ext2_super_block *get_super_block (struct ext2_fs *fs) 
 {
     struct ext2_super_block *sb = (struct ext2_super_block *) (
-        (unsigned char *) disk + EXT2_BLOCK_SIZE);
+        (unsigned char *) fs->disk + EXT2_SUPER_OFFSET);
     return sb;
 }
 
 /*
- * Return a pointer to the (sole) block group descriptor.
+ * Return the number of the first non-reserved inode.
+ */
+unsigned int get_first_ino (struct ext2_fs *fs) 
+{
+    struct ext2_super_block *sb = get_super_block(fs);
+    return (sb->s_rev_level == EXT2_GOOD_OLD_REV) ? EXT2_GOOD_OLD_FIRST_INO : 
+        sb->s_first_ino;
+}
+
+/*
+ * Return the number of block groups in the file system.
+ */
+unsigned int get_num_groups (struct ext2_fs *fs) 
+{
+    struct ext2_super_block *sb = get_super_block(fs);
+    unsigned int num_blocks = sb->s_blocks_count - sb->s_first_data_block;
+
+    return (num_blocks + sb->s_blocks_per_group - 1) / sb->s_blocks_per_group;
+}
+
+/*
+ * Return the number of the first block belonging to the given group.
+ */
+unsigned int get_group_first_block (struct ext2_fs *fs, unsigned int group) 
+{
+    struct ext2_super_block *sb = get_super_block(fs);
+    return sb->s_first_data_block + group * sb->s_blocks_per_group;
+}
+
+/*
+ * Return the number of blocks tracked by the given group's block bitmap. 
+ * This is s_blocks_per_group for every group but possibly the last one.
+ */
+unsigned int get_blocks_in_group (struct ext2_fs *fs, unsigned int group) 
+{
+    struct ext2_super_block *sb = get_super_block(fs);
+    unsigned int remaining = sb->s_blocks_count - get_group_first_block(fs, group);
+
+    return (remaining < sb->s_blocks_per_group) ? remaining : sb->s_blocks_per_group;
+}
+
+/*
+ * Return 1 if the given group starts with a copy of the superblock and the
+ * group descriptor table (and its reserved blocks), and 0 otherwise. With 
+ * sparse_super, only groups 0, 1 and the powers of 3, 5 and 7 have one.
+ */
+int group_has_super (struct ext2_fs *fs, unsigned int group) 
+{
+    unsigned int base, power;
+
+    if (group <= 1 || !(get_super_block(fs)->s_feature_ro_compat & 
+            EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER))
+        return TRUE;
+
+    for (base = 3; base <= 7; base += 2) {
+        for (power = base; power < group; power *= base)
+            ;
+        if (power == group)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+/*
+ * Return the number of blocks taken by the group descriptor table.
+ */
+unsigned int get_num_gdt_blocks (struct ext2_fs *fs) 
+{
+    return (get_num_groups(fs) * sizeof(struct ext2_group_desc) + EXT2_BLOCK_SIZE - 1) / 
+        EXT2_BLOCK_SIZE;
+}
+
+/*
+ * Return the group containing the given inode.
+ */
+unsigned int get_inode_group (struct ext2_fs *fs, unsigned int inode) 
+{
+    return INDEX(inode) / get_super_block(fs)->s_inodes_per_group;
+}
+
+/*
+ * Return the position of the given inode within its group's inode bitmap
+ * and inode table.
+ */
+unsigned int get_inode_index (struct ext2_fs *fs, unsigned int inode) 
+{
+    return INDEX(inode) % get_super_block(fs)->s_inodes_per_group;
+}
+
+/*
+ * Return the group containing the given block.
+ */
+unsigned int get_block_group (struct ext2_fs *fs, unsigned int block) 
+{
+    struct ext2_super_block *sb = get_super_block(fs);
+    return (block - sb->s_first_data_block) / sb->s_blocks_per_group;
+}
+
+/*
+ * Return the position of the given block within its group's block bitmap.
+ */
+unsigned int get_block_index (struct ext2_fs *fs, unsigned int block) 
+{
+    struct ext2_super_block *sb = get_super_block(fs);
+    return (block - sb->s_first_data_block) % sb->s_blocks_per_group;
+}
+
+/*
+ * Return 1 if the given block number lies within the file system's data
+ * blocks, and 0 otherwise (including for the null block number 0).
+ */
+int is_valid_block (struct ext2_fs *fs, unsigned int block) 
+{
+    struct ext2_super_block *sb = get_super_block(fs);
+    return block && block >= sb->s_first_data_block && block < sb->s_blocks_count;
+}
+
+/*
+ * Return 1 if the given inode is marked as in use in its group's inode 
+ * bitmap, and 0 otherwise.
+ */
+int is_inode_in_use (struct ext2_fs *fs, unsigned int inode) 
+{
+    return BITMAP_TEST(get_inode_bitmap(fs, get_inode_group(fs, inode)), get_inode_index(fs, inode));
+}
+
+/*
+ * Return 1 if the given block is marked as in use in its group's block
+ * bitmap, and 0 otherwise.
+ */
+int is_block_in_use (struct ext2_fs *fs, unsigned int block) 
+{
+    return BITMAP_TEST(get_block_bitmap(fs, get_block_group(fs, block)), get_block_index(fs, block));
+}
+
+/*
+ * Return a pointer to the descriptor of the given block group. The 
+ * descriptor table starts in the block following the superblock.
+ */
+struct ext2_group_desc *get_group_desc (struct ext2_fs *fs, unsigned int group) 
+{
+    struct ext2_group_desc *gd_table = (struct ext2_group_desc *) get_block(fs, 
+        get_super_block(fs)->s_first_data_block + 1);
+    return &gd_table[group];
+}
+
+/*
+ * Return a pointer to the given group's block bitmap on disk.
  */
-struct ext2_group_desc *get_group_desc () 
+unsigned char *get_block_bitmap (struct ext2_fs *fs, unsigned int group) 
 {
-    struct ext2_group_desc *gd = (struct ext2_group_desc *) (
-        (unsigned char *) disk + 2*EXT2_BLOCK_SIZE);
-    return gd;
+    return get_block(fs, get_group_desc(fs, group)->bg_block_bitmap);
 }
 
 /*
- * Return a pointer to the block bitmap on disk.
+ * Return a pointer to the given group's inode bitmap on disk.
  */
-unsigned char *get_block_bitmap () 
+unsigned char *get_inode_bitmap (struct ext2_fs *fs, unsigned int group) 
 {
-    int block_bitmap_offset = get_group_desc()->bg_block_bitmap * EXT2_BLOCK_SIZE;
-    unsigned char *block_bitmap = (unsigned char *) (disk + block_bitmap_offset);
-    return block_bitmap;
+    return get_block(fs, get_group_desc(fs, group)->bg_inode_bitmap);
 }
 
 /*
- * Return a pointer to the inode bitmap on disk.
+ * Return a pointer to the given group's inode table on disk.
  */
-unsigned char *get_inode_bitmap () 
+unsigned char *get_inode_table (struct ext2_fs *fs, unsigned int group) 
 {
-    int inode_bitmap_offset = get_group_desc()->bg_inode_bitmap * EXT2_BLOCK_SIZE;
-    unsigned char *inode_bitmap = (unsigned char *) (disk + inode_bitmap_offset);
-    return inode_bitmap;
+    return get_block(fs, get_group_desc(fs, group)->bg_inode_table);
 }
 
 /*
- * Return a pointer to the inode table on disk.
+ * Return the size of an on-disk inode, which may be larger than the 
+ * ext2_inode structure on dynamic revision file systems.
  */
-unsigned char *get_inode_table () 
+unsigned int get_inode_size (struct ext2_fs *fs) 
 {
-    int inode_table_offset = get_group_desc()->bg_inode_table * EXT2_BLOCK_SIZE;
-    unsigned char *inode_table = (unsigned char *) (disk + inode_table_offset);
-    return inode_table;
+    struct ext2_super_block *sb = get_super_block(fs);
+    return (sb->s_rev_level == EXT2_GOOD_OLD_REV) ? sizeof(struct ext2_inode) : 
+        sb->s_inode_size;
 }
 
 /*
  * Return a pointer to the inode structure with the given number.
  */
-struct ext2_inode *get_inode (unsigned int inode) 
+struct ext2_inode *get_inode (struct ext2_fs *fs, unsigned int inode) 
 {
-    struct ext2_inode *ino = (struct ext2_inode *) ((unsigned char *) get_inode_table() +
-        INDEX(inode) * sizeof(struct ext2_inode));
+    struct ext2_inode *ino = (struct ext2_inode *) (
+        get_inode_table(fs, get_inode_group(fs, inode)) + 
+        (size_t) get_inode_index(fs, inode) * get_inode_size(fs));
     return ino;
 }
 
 /*
  * Return a pointer to the directory entry at the given block and position.
  */
-struct ext2_dir_entry *get_entry (unsigned int block_num, unsigned long block_pos) 
+struct ext2_dir_entry *get_entry (struct ext2_fs *fs, unsigned int block_num,
+        unsigned long block_pos) 
 {
-    struct ext2_dir_entry *entry = (struct ext2_dir_entry *) ((unsigned char *)disk +
-        block_num * EXT2_BLOCK_SIZE + block_pos);
+    struct ext2_dir_entry *entry = (struct ext2_dir_entry *) (get_block(fs, block_num) +
+        block_pos);
     return entry;
 }
 
 /*
  * Return a pointer to the beginning of the block with the given number.
  */
-unsigned char *get_block (unsigned int block_num) 
+unsigned char *get_block (struct ext2_fs *fs, unsigned int block_num) 
 {
-    unsigned char *block = (unsigned char *) (disk + block_num * EXT2_BLOCK_SIZE);
+    /* Widen before multiplying, since images may be larger than 4 GB */
+    unsigned char *block = (unsigned char *) (fs->disk + (size_t) block_num * EXT2_BLOCK_SIZE);
     return block;
 }
 
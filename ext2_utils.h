@@ -1,59 +1,421 @@
 #include <string.h>
+#include <pthread.h>
 #include "ext2.h"
+#include "ext2_bitmap.h"
 
 /* Macro definitions */
-#define DISK_BLOCKS 128
 #define DISK_SECTOR_SIZE 512
-#define NUM_BITS 8
+#define EXT2_SUPER_OFFSET 1024
+#define EXT2_SUPER_MAGIC 0xEF53
+#define EXT2_MIN_BLOCK_SIZE 1024
+#define EXT2_GOOD_OLD_REV 0
 #define NUM_INITIAL_DIRECT_BLOCKS 12
+#define NUM_INDIRECT_POINTERS (EXT2_BLOCK_SIZE / sizeof(unsigned int))
+#define MAX_FILE_BLOCKS (NUM_INITIAL_DIRECT_BLOCKS + NUM_INDIRECT_POINTERS + \
+    NUM_INDIRECT_POINTERS * NUM_INDIRECT_POINTERS + \
+    NUM_INDIRECT_POINTERS * NUM_INDIRECT_POINTERS * NUM_INDIRECT_POINTERS)
 #define TRUE 1
 #define FALSE 0
+#define ALLOC_POLICY_LINEAR 0
+#define ALLOC_POLICY_LOCALITY 1
+#define SUMMARY_RUN_UNKNOWN (~0U)
+#define EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER 0x0001
+#define EXT2_FEATURE_RO_COMPAT_LARGE_FILE 0x0002
+#define EXT2_FEATURE_COMPAT_RESIZE_INO 0x0010
+#define EXT2_RESIZE_INO 7
+#define EXT2_MAX_SMALL_FILE_SIZE 0x7FFFFFFFULL
+#define WRITE_CHUNK_BLOCKS 64
+#define DX_MAX_LEVELS 2
+#define DCACHE_INITIAL_BUCKETS 256
+#define DIR_GAP_UNKNOWN 0xFFFF
+#define DCACHE_MAX_CHAIN 2
+#define DX_BAD_INDEX ((struct ext2_dir_entry *) -1)
+#define DIR_ITER_REMOVED 0x1
+#define INODE_LOCK_STRIPES 64
+#define DIRTY_LOG_BUF_SIZE 4096
+#define DIRTY_LOG_SUFFIX ".dirty"
+#define OPEN_DISK_PRIVATE 0x1
+#define JOURNAL_DATA_CHUNK 64
+#define PAGEMAP_CHUNK 512
+#define JOURNAL_CHECK_INTERVAL 16
 
-#define GET_BIT(x) ((x - 1) % NUM_BITS)
-#define GET_BYTE(x) ((x - 1) / NUM_BITS)
 #define HAS_TRAILING_SLASH(PATH) (PATH[strlen(PATH) - 1] == '/')
 #define INDEX(x) (x - 1)
-#define IN_USE(BITMAP, BYTE, BIT) (BITMAP[BYTE] & (1 << BIT))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
 #define IS_ABSOLUTE(PATH) (PATH[0] == '/')
 #define IS_DOT_ENTRY(NAME) (!strcmp(NAME, ".") || !strcmp(NAME, ".."))
-#define MARK_AS_FREE(BITMAP, BYTE, BIT) (BITMAP[BYTE] &= ~(1 << BIT))
-#define MARK_AS_USED(BITMAP, BYTE, BIT) (BITMAP[BYTE] |= (1 << BIT))
+#define IS_DOT_NAME(NAME, LEN) ((NAME)[0] == '.' && ((LEN) == 1 || ((LEN) == 2 && (NAME)[1] == '.')))
+#define ENTRY_HAS_NAME(ENTRY, NAME, LEN) ((ENTRY)->name_len == (LEN) && \
+    !memcmp((ENTRY)->name, NAME, LEN))
 #define PAD_REC_LEN(x) ((x + 3) & ~3)
+#define GET_BLOCK_OF(FS, PTR) (((unsigned char *) (PTR) - (FS)->disk) / EXT2_BLOCK_SIZE)
 #define TYPE_MASK(x) (x & ~4095)
 #define ZERO_OR_NEG_ONE(IS_FIRST) (IS_FIRST ? 0 : -1)
 
-/* Global variable re-declarations */
-extern unsigned char *disk;
+/* In-memory allocation summary of a block group. No inode or block before
+ * first_free_inode or first_free_block is free, and no run of free blocks
+ * is longer than longest_free_run (SUMMARY_RUN_UNKNOWN if not yet known). */
+struct group_summary 
+{
+    unsigned int first_free_inode;
+    unsigned int first_free_block;
+    unsigned int longest_free_run;
+};
+
+/* In-memory free-space summary of an unindexed directory: the physical 
+ * number of each of its blocks, and the slack after the last entry and the
+ * largest gap anywhere in each, which a new entry could be placed in. A 
+ * largest_gap of DIR_GAP_UNKNOWN means both need recomputing. */
+struct dir_space_map 
+{
+    unsigned int dir_inode;
+    unsigned int num_blocks;
+    unsigned int capacity;
+    unsigned int *blocks;
+    unsigned short *tail_gap;
+    unsigned short *largest_gap;
+    struct dir_space_map *next;
+};
+
+/* The journal of an image whose changes are being journaled: the image
+ * block holding each of its maxlen blocks, where its log starts and the ID
+ * of the next transaction, and the blocks freed since the last commit. The
+ * page map is used to find the pages of the mapping that were changed. 
+ * is_journal_filling() counts its calls, and the blocks and inodes 
+ * allocated or freed, since it last looked at the page map. */
+struct ext2_journal 
+{
+    unsigned int *blocks;
+    unsigned int maxlen;
+    unsigned int first;
+    unsigned int sequence;
+    unsigned char uuid[16];
+    unsigned char *freed_blocks;
+    int pagemap_fd;
+    long page_size;
+    unsigned int num_checks;
+    unsigned long num_allocs;
+};
+
+/* An open disk image: its mapping, and the in-memory state built up while
+ * working on it. Every utility function takes the handle of the image it is
+ * to work on, so any number of images can be open at once. 
+ *
+ * Threads may create and remove entries and write files on one image at 
+ * once. Each group's bitmaps, descriptor and summary are guarded by its
+ * group lock, and each inode (including the entries of a directory) by the
+ * inode lock its number hashes to. The dentry cache, the list of space
+ * maps and the dirty log buffer have a lock of their own. No thread holds
+ * two inode locks at once, and the other locks are only taken last, so they
+ * cannot deadlock. The journal, if any, may only be committed while no other
+ * thread is using the image. */
+struct ext2_fs 
+{
+    unsigned char *disk;
+    size_t disk_size;
+    int disk_fd;
+    int alloc_policy;
+    struct group_summary *group_summaries;
+    struct dir_space_map *dir_space_maps;
+    struct dentry **dcache_buckets;
+    unsigned int dcache_num_buckets;
+    unsigned int dcache_num_entries;
+    unsigned int num_group_locks;
+    pthread_mutex_t *group_locks;
+    pthread_rwlock_t inode_locks[INODE_LOCK_STRIPES];
+    pthread_mutex_t dcache_lock;
+    pthread_mutex_t space_map_lock;
+    char *dirty_log_path;
+    int dirty_log_fd;
+    size_t dirty_log_len;
+    char dirty_log_buf[DIRTY_LOG_BUF_SIZE];
+    pthread_mutex_t dirty_log_lock;
+    struct ext2_journal *journal;
+};
+
+/* A run of contiguous blocks being handed out one at a time by take_block().
+ * Blocks [next, end) are allocated but not yet used, remaining is the number
+ * of blocks still expected to be handed out, and goal is where to look for
+ * the next run. */
+struct block_run 
+{
+    unsigned int next;
+    unsigned int end;
+    unsigned int remaining;
+    unsigned int goal;
+};
+
+/* Called by walk_block_map() for each block of an inode; level is 0 for data
+ * blocks and the level of indirection for indirect blocks. A nonzero return
+ * value stops the walk. */
+typedef int (*block_visitor) (struct ext2_fs *fs, unsigned int block, int level,
+        void *arg);
+
+/* Position of a walk over the entries of a directory (or of a single one of
+ * its blocks) by dir_iter_next(). entry is the current entry, record is the
+ * record in the rec_len chain holding it (the entry itself, unless it is a
+ * removed one in the gap after the record), and prev is the record before
+ * that in the same block, or NULL. The rest is private to the walk. */
+struct dir_iter 
+{
+    struct ext2_dir_entry *entry;
+    struct ext2_dir_entry *record;
+    struct ext2_dir_entry *prev;
+    int is_removed;
+    unsigned int block;
+    struct ext2_inode *dir;
+    unsigned int next_lblock;
+    unsigned int num_blocks;
+    int flags;
+    int in_index;
+    unsigned long record_pos;
+    unsigned long slot_pos;
+};
+
+/* Where write_to_inode() gets a file's contents from. read fills buf with 
+ * up to len bytes, returning the number of bytes supplied, 0 at the end of
+ * the contents or -1 on error. skip_hole, if not NULL, moves past the whole
+ * blocks of any hole at the current position, returning the number of bytes
+ * skipped or -1 on error. */
+struct ext2_source 
+{
+    long (*read) (void *ctx, unsigned char *buf, unsigned long len);
+    long long (*skip_hole) (void *ctx);
+    void *ctx;
+};
+
+/* Context for read_from_buffer(), supplying the len bytes at data */
+struct buffer_source 
+{
+    const char *data;
+    unsigned long len;
+    unsigned long pos;
+};
+
+/* One level of the path from the root of a directory index down to a leaf:
+ * the dx_entry array of an index block and the entry followed within it */
+struct dx_frame 
+{
+    struct dx_entry *entries;
+    struct dx_entry *at;
+};
+
+/* A run of count blocks from first, as recorded in a dirty log */
+struct dirty_range 
+{
+    unsigned int first;
+    unsigned int count;
+};
+
+/* What an image's dirty log holds, as read by read_dirty_log() */
+struct dirty_log 
+{
+    unsigned int *inodes;
+    unsigned long num_inodes;
+    struct dirty_range *ranges;
+    unsigned long num_ranges;
+};
 
 /* Utility function declarations */
-void init_disk (char *diskpath);
-unsigned int get_inode_at_path (char *path);
-unsigned int allocate_inode ();
-unsigned int allocate_block ();
-unsigned int find_entry (unsigned int parent_inode, char *entry_name);
-void create_entry (unsigned int parent_inode, unsigned int entry_inode, 
-        char *entry_name, unsigned char type);
-void init_inode (struct ext2_inode *ino, unsigned char type);
-void write_to_inode (unsigned int inode, char *contents);
-void remove_entry (unsigned int parent_inode, char *entry_name);
-void free_resources (unsigned int inode_num, char *entry_name);
-void deallocate_inode (unsigned int inode_num);
-void deallocate_block (unsigned int block_num);
-unsigned int find_removed_entry (unsigned int parent_inode, char *entry_name);
-int is_recoverable (unsigned int inode_num, int is_first);
-void restore_entry (unsigned int parent_inode, char *entry_name);
-void reallocate_resources (unsigned int inode_num);
-int attempt_inode_reallocation (unsigned int inode_num);
-void attempt_block_reallocation (unsigned int block_num);
-int is_dir (unsigned int inode);
-
-struct ext2_super_block *get_super_block ();
-struct ext2_group_desc *get_group_desc ();
-unsigned char *get_block_bitmap ();
-unsigned char *get_inode_bitmap ();
-unsigned char *get_inode_table ();
-struct ext2_inode *get_inode (unsigned int inode);
-struct ext2_dir_entry *get_entry (unsigned int block_num, unsigned long block_pos);
-unsigned char *get_block (unsigned int block_num);
+struct ext2_fs *open_disk (char *diskpath);
+struct ext2_fs *open_disk_flags (char *diskpath, int flags);
+int close_disk (struct ext2_fs *fs);
+int init_locks (struct ext2_fs *fs);
+void destroy_locks (struct ext2_fs *fs);
+void lock_group (struct ext2_fs *fs, unsigned int group);
+void unlock_group (struct ext2_fs *fs, unsigned int group);
+void lock_inode (struct ext2_fs *fs, unsigned int inode);
+void lock_inode_shared (struct ext2_fs *fs, unsigned int inode);
+void unlock_inode (struct ext2_fs *fs, unsigned int inode);
+void build_group_summaries (struct ext2_fs *fs);
+unsigned int find_longest_free_run (struct ext2_fs *fs, unsigned int group);
+struct group_summary *get_group_summary (struct ext2_fs *fs, unsigned int group);
+unsigned int get_inode_at_path (struct ext2_fs *fs, char *path);
+void set_alloc_policy (struct ext2_fs *fs, int policy);
+unsigned int allocate_inode (struct ext2_fs *fs, unsigned int parent_inode,
+        unsigned char type);
+unsigned int find_inode_group (struct ext2_fs *fs, unsigned int parent_inode,
+        unsigned char type);
+unsigned int allocate_inode_in_group (struct ext2_fs *fs, unsigned int group);
+unsigned int allocate_block (struct ext2_fs *fs, unsigned int goal);
+unsigned int allocate_blocks (struct ext2_fs *fs, unsigned int goal, unsigned int n,
+        unsigned int *got);
+unsigned int allocate_run_in_group (struct ext2_fs *fs, unsigned int group,
+        unsigned int start, unsigned int max_len, unsigned int min_len, unsigned int *got);
+unsigned int take_block (struct ext2_fs *fs, struct block_run *run);
+unsigned int get_block_goal (struct ext2_fs *fs, unsigned int inode);
+void adjust_free_blocks (struct ext2_fs *fs, unsigned int group, int delta);
+void adjust_free_inodes (struct ext2_fs *fs, unsigned int group, int delta);
+void adjust_used_dirs (struct ext2_fs *fs, unsigned int group, int delta);
+unsigned int find_entry (struct ext2_fs *fs, unsigned int parent_inode, char *entry_name);
+unsigned int lookup_inode (struct ext2_fs *fs, unsigned int parent_inode,
+        const char *name, int name_len);
+unsigned int lookup_inode_locked (struct ext2_fs *fs, unsigned int parent_inode,
+        const char *name, int name_len);
+struct ext2_dir_entry *lookup_entry (struct ext2_fs *fs, unsigned int parent_inode,
+        const char *name, int name_len, struct ext2_dir_entry **prev);
+int create_entry (struct ext2_fs *fs, unsigned int parent_inode,
+        unsigned int entry_inode, char *entry_name, unsigned char type);
+int add_entry (struct ext2_fs *fs, unsigned int parent_inode,
+        unsigned int entry_inode, char *entry_name, unsigned char type);
+struct ext2_dir_entry *add_linear_entry (struct ext2_fs *fs, unsigned int parent_inode,
+        char *entry_name);
+struct ext2_dir_entry *search_dir_block (struct ext2_fs *fs, unsigned int block,
+        const char *name, int name_len, struct ext2_dir_entry **prev);
+struct ext2_dir_entry *insert_into_dir_block (struct ext2_fs *fs, unsigned int block,
+        int name_len, int tail_only);
+unsigned int get_largest_gap (struct ext2_fs *fs, unsigned int block,
+        unsigned short *tail_gap);
+struct dir_space_map *get_dir_space_map (struct ext2_fs *fs, unsigned int dir_inode);
+int add_to_dir_space_map (struct dir_space_map *map, unsigned int block);
+void mark_dir_space_changed (struct ext2_fs *fs, unsigned int dir_inode,
+        unsigned int block);
+void drop_dir_space_map (struct ext2_fs *fs, unsigned int dir_inode);
+void dir_iter_init (struct dir_iter *it, struct ext2_inode *dir, int flags);
+void dir_iter_init_block (struct dir_iter *it, unsigned int block, int flags);
+int dir_iter_next (struct ext2_fs *fs, struct dir_iter *it);
+int is_valid_dir_record (struct ext2_dir_entry *record, unsigned long block_pos);
+int dir_iter_next_block (struct ext2_fs *fs, struct dir_iter *it);
+void pack_dir_block (unsigned char *block, struct ext2_dir_entry **list, int num);
+unsigned int add_dir_block (struct ext2_fs *fs, unsigned int dir_inode);
+int compact_dir (struct ext2_fs *fs, unsigned int dir_inode, int is_recursive);
+int pack_dir_entries (struct ext2_fs *fs, unsigned int dir_inode);
+void init_inode (struct ext2_fs *fs, unsigned int inode, unsigned char type);
+int write_to_inode (struct ext2_fs *fs, unsigned int inode, struct ext2_source *src,
+        unsigned int data_blocks);
+int write_file_blocks (struct ext2_fs *fs, struct ext2_inode *ino, unsigned int lblock,
+        unsigned char *buf, unsigned int num_blocks, struct block_run *run, int is_sparse);
+int copy_file_blocks (struct ext2_fs *fs, unsigned int first_block,
+        const unsigned char *buf, unsigned int num_blocks);
+long read_from_source (struct ext2_source *src, unsigned char *buf, unsigned long len);
+void release_run (struct ext2_fs *fs, struct block_run *run);
+long read_from_buffer (void *ctx, unsigned char *buf, unsigned long len);
+long read_from_file (void *ctx, unsigned char *buf, unsigned long len);
+long long skip_file_hole (void *ctx);
+unsigned int *get_block_slot (struct ext2_fs *fs, struct ext2_inode *ino,
+        unsigned int lblock, struct block_run *run);
+unsigned int get_block_num (struct ext2_fs *fs, struct ext2_inode *ino,
+        unsigned int lblock);
+unsigned int get_blocks_needed (unsigned int num_blocks);
+int walk_block_map (struct ext2_fs *fs, struct ext2_inode *ino, block_visitor visit,
+        void *arg);
+int walk_indirect_block (struct ext2_fs *fs, unsigned int block, int level,
+        block_visitor visit, void *arg);
+int truncate_block_map (struct ext2_fs *fs, struct ext2_inode *ino,
+        unsigned int num_blocks);
+int truncate_indirect_block (struct ext2_fs *fs, unsigned int *slot, int level,
+        unsigned long long first, unsigned int num_blocks);
+unsigned long long get_file_size (struct ext2_inode *ino);
+void set_file_size (struct ext2_fs *fs, struct ext2_inode *ino, unsigned long long size);
+int remove_entry (struct ext2_fs *fs, unsigned int parent_inode, char *entry_name);
+unsigned int unlink_entry (struct ext2_fs *fs, unsigned int parent_inode,
+        const char *name, int name_len);
+int put_link (struct ext2_fs *fs, unsigned int inode, int is_dot);
+void free_resources (struct ext2_fs *fs, unsigned int inode_num);
+void deallocate_inode (struct ext2_fs *fs, unsigned int inode_num);
+void deallocate_block (struct ext2_fs *fs, unsigned int block_num);
+unsigned int find_removed_entry (struct ext2_fs *fs, unsigned int parent_inode,
+        char *entry_name);
+int is_recoverable (struct ext2_fs *fs, unsigned int inode_num, int is_first);
+void restore_entry (struct ext2_fs *fs, unsigned int parent_inode, char *entry_name);
+void reallocate_resources (struct ext2_fs *fs, unsigned int inode_num);
+int attempt_inode_reallocation (struct ext2_fs *fs, unsigned int inode_num);
+void attempt_block_reallocation (struct ext2_fs *fs, unsigned int block_num);
+int deallocate_visitor (struct ext2_fs *fs, unsigned int block, int level, void *arg);
+int in_use_visitor (struct ext2_fs *fs, unsigned int block, int level, void *arg);
+int reallocate_visitor (struct ext2_fs *fs, unsigned int block, int level, void *arg);
+int is_dir (struct ext2_fs *fs, unsigned int inode);
+
+/* Command function declarations */
+int cmd_mkdir (struct ext2_fs *fs, char *path);
+int cmd_cp (struct ext2_fs *fs, char *src_path, char *dest_path);
+int copy_from_fd (struct ext2_fs *fs, int src_fd, char *src_path, char *dest_path);
+int cmd_ln (struct ext2_fs *fs, char *src_path, char *dest_path, int is_symlink);
+int cmd_rm (struct ext2_fs *fs, char *target_path, int is_recursive);
+int cmd_restore (struct ext2_fs *fs, char *target_path, int is_recursive);
+int cmd_compact_dir (struct ext2_fs *fs, char *target_path, int is_recursive);
+
+/* Indexed directory function declarations */
+unsigned int dx_hash (const char *name, int len, int version, const unsigned int *seed);
+int can_index_dirs (struct ext2_fs *fs);
+int is_indexed_dir (struct ext2_fs *fs, struct ext2_inode *dir);
+struct dx_root_info *get_dx_root_info (struct ext2_fs *fs, struct ext2_inode *dir);
+unsigned int get_dx_name_hash (struct ext2_fs *fs, struct dx_root_info *info,
+        const char *name, int name_len);
+struct dx_entry *get_dx_node_entries (struct ext2_fs *fs, struct ext2_inode *dir,
+        unsigned int lblock);
+struct dx_entry *dx_search_entries (struct dx_entry *entries, unsigned int hash);
+int dx_probe (struct ext2_fs *fs, struct ext2_inode *dir, unsigned int hash,
+        struct dx_frame *frames);
+unsigned int dx_next_leaf (struct ext2_fs *fs, struct ext2_inode *dir,
+        struct dx_frame *frames, int num_frames, unsigned int hash);
+int is_dx_node (struct ext2_fs *fs, struct ext2_inode *dir, unsigned int lblock);
+struct ext2_dir_entry *dx_find_entry (struct ext2_fs *fs, unsigned int parent_inode,
+        const char *name, int name_len, struct ext2_dir_entry **prev);
+void dx_insert_entry (struct dx_entry *entries, struct dx_entry *at, unsigned int hash,
+        unsigned int lblock);
+struct dx_entry *dx_add_node (struct ext2_fs *fs, unsigned int dir_inode,
+        unsigned int *lblock);
+int dx_make_room (struct ext2_fs *fs, unsigned int dir_inode, struct dx_frame *frames,
+        int num_frames);
+unsigned int dx_split_leaf (struct ext2_fs *fs, unsigned int dir_inode,
+        struct dx_root_info *info, struct dx_frame *frames, int num_frames, unsigned int hash);
+struct ext2_dir_entry *dx_add_entry (struct ext2_fs *fs, unsigned int parent_inode,
+        const char *name, int name_len);
+int dx_make_indexed (struct ext2_fs *fs, unsigned int dir_inode);
+
+/* Dentry cache function declarations */
+int dcache_lookup (struct ext2_fs *fs, unsigned int parent_inode, const char *name,
+        int name_len, unsigned int *inode);
+void dcache_insert (struct ext2_fs *fs, unsigned int parent_inode, const char *name,
+        int name_len, unsigned int inode);
+void dcache_invalidate (struct ext2_fs *fs, unsigned int parent_inode, const char *name,
+        int name_len);
+void dcache_purge_dir (struct ext2_fs *fs, unsigned int dir_inode);
+void dcache_destroy (struct ext2_fs *fs);
+
+/* Dirty log function declarations */
+int open_dirty_log (struct ext2_fs *fs, const char *diskpath, int is_logging);
+void log_dirty_inode (struct ext2_fs *fs, unsigned int inode);
+void log_dirty_blocks (struct ext2_fs *fs, unsigned int first, unsigned int count);
+void close_dirty_log (struct ext2_fs *fs);
+int reset_dirty_log (struct ext2_fs *fs, int is_create);
+int read_dirty_log (struct ext2_fs *fs, struct dirty_log *log);
+void free_dirty_log (struct dirty_log *log);
+
+/* Journal function declarations */
+int open_journal (struct ext2_fs *fs, int is_journaling);
+int commit_journal (struct ext2_fs *fs);
+int is_journal_filling (struct ext2_fs *fs);
+void journal_count_allocs (struct ext2_fs *fs, int delta);
+int close_journal (struct ext2_fs *fs);
+void journal_free_block (struct ext2_fs *fs, unsigned int block);
+int write_journaled_blocks (struct ext2_fs *fs, unsigned int first_block,
+        const unsigned char *buf, unsigned int num_blocks);
+
+struct ext2_super_block *get_super_block (struct ext2_fs *fs);
+unsigned int get_first_ino (struct ext2_fs *fs);
+unsigned int get_num_groups (struct ext2_fs *fs);
+unsigned int get_group_first_block (struct ext2_fs *fs, unsigned int group);
+unsigned int get_blocks_in_group (struct ext2_fs *fs, unsigned int group);
+int group_has_super (struct ext2_fs *fs, unsigned int group);
+unsigned int get_num_gdt_blocks (struct ext2_fs *fs);
+unsigned int get_inode_group (struct ext2_fs *fs, unsigned int inode);
+unsigned int get_inode_index (struct ext2_fs *fs, unsigned int inode);
+unsigned int get_block_group (struct ext2_fs *fs, unsigned int block);
+unsigned int get_block_index (struct ext2_fs *fs, unsigned int block);
+int is_valid_block (struct ext2_fs *fs, unsigned int block);
+int is_inode_in_use (struct ext2_fs *fs, unsigned int inode);
+int is_block_in_use (struct ext2_fs *fs, unsigned int block);
+struct ext2_group_desc *get_group_desc (struct ext2_fs *fs, unsigned int group);
+unsigned char *get_block_bitmap (struct ext2_fs *fs, unsigned int group);
+unsigned char *get_inode_bitmap (struct ext2_fs *fs, unsigned int group);
+unsigned char *get_inode_table (struct ext2_fs *fs, unsigned int group);
+unsigned int get_inode_size (struct ext2_fs *fs);
+struct ext2_inode *get_inode (struct ext2_fs *fs, unsigned int inode);
+struct ext2_dir_entry *get_entry (struct ext2_fs *fs, unsigned int block_num,
+        unsigned long block_pos);
+unsigned char *get_block (struct ext2_fs *fs, unsigned int block_num);
 unsigned short get_imode (unsigned char type);
 unsigned char get_file_type (unsigned short mode);
@@ -76,6 +76,35 @@ echo "Restore Test 14"
 echo "Checker Test 15"
 ./ext2_checker self-tester/runs/case15-checker.img
 
+# Large images (sparse files, kept out of runs so they are not dumped)
+large_img=$(mktemp)
+truncate -s 16G $large_img
+mke2fs -q -F -t ext2 -b 1024 -N 65536 -j $large_img
+
+echo "Large Journaled Image Test 16"
+./ext2_mkdir $large_img /level1 && echo "Opened a 16 GiB journaled image"
+
+echo "Large Image Dry Run Test 17"
+tune2fs -O ^has_journal $large_img > /dev/null
+./ext2_checker $large_img -n > /dev/null && echo "Checked a 16 GiB image without changing it"
+
+rm -f $large_img
+
+# Corrupt images (built on the fly, kept out of runs as well)
+corrupt_img=$(mktemp)
+truncate -s 8M $corrupt_img
+mke2fs -q -F -t ext2 -b 1024 -N 1024 -O ^dir_index $corrupt_img
+(echo "mkdir /big"; for i in $(seq 1 800); do echo "mkdir /big/some_long_directory_name_$i"; done) |
+	./ext2_batch $corrupt_img - > /dev/null
+debugfs -w -R "sif /big block[IND] 4000000000" $corrupt_img 2> /dev/null
+cp $corrupt_img $corrupt_img.2
+
+echo "Checker Bad Indirect Block Test 18"
+./ext2_checker $corrupt_img > /dev/null && echo "Checked a directory with a bad indirect block"
+./ext2_checker $corrupt_img.2 -j 2 > /dev/null && echo "Checked it with 2 threads"
+
+rm -f $corrupt_img $corrupt_img.2
+
 # --- Now do the dumps ---
 the_files="$(ls self-tester/runs)"
 for the_file in $the_files